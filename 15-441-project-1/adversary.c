@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "adversary.h"
+
+// where an adversary connection is
+enum
+{
+    ADV_CLOSED = 0,
+    ADV_CONNECTING,
+    ADV_OPEN
+};
+
+#define SLOW_READ_DEPTH 32     // requests a slow reader pipelines
+#define SLOW_READ_RCVBUF 4096  // keeps the server's answers backed up
+#define SLOW_BODY_LENGTH 100000000
+
+const char *adversary_names[ADV_KINDS] = {"slow_header", "slow_body", "slow_read", "half_open", "flood"};
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int adversary_kind(const char *name)
+{
+    for (int k = 0; k < ADV_KINDS; ++k)
+    {
+        if (strcmp(name, adversary_names[k]) == 0)
+            return k;
+    }
+    return -1;
+}
+
+static void adversary_open(Adversaries *a, Adversary_Conn *c)
+{
+    c->fd = socket(a->server.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+    {
+        a->failed++;
+        c->retry_at = now_ns() + a->drip_ms * 1000000UL;
+        return;
+    }
+    if (c->kind == ADV_SLOW_READ)
+    {
+        int size = SLOW_READ_RCVBUF;
+        setsockopt(c->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (connect(c->fd, (struct sockaddr *)&a->server, a->server_len) < 0 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        a->failed++;
+        c->retry_at = now_ns() + a->drip_ms * 1000000UL;
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(a->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->state = ADV_CONNECTING;
+    c->sent = 0;
+    a->connecting++;
+}
+
+static void adversary_close(Adversaries *a, Adversary_Conn *c, int evicted)
+{
+    close(c->fd);
+    if (c->state == ADV_OPEN)
+        a->held--;
+    else
+        a->connecting--;
+    c->state = ADV_CLOSED;
+    if (evicted)
+        a->evicted++;
+    else
+        a->failed++;
+    // a flood comes straight back, the others at their own pace
+    c->retry_at = c->kind == ADV_FLOOD ? 0 : now_ns() + a->drip_ms * 1000000UL;
+}
+
+// connected: send what comes before the dripping
+static void adversary_connected(Adversaries *a, Adversary_Conn *c)
+{
+    char buf[8192];
+    int len = 0;
+    switch (c->kind)
+    {
+    case ADV_SLOW_HEADER:
+        len = sprintf(buf, "GET / HTTP/1.1\r\nHost: lisod\r\n");
+        break;
+    case ADV_SLOW_BODY:
+        len = sprintf(buf, "POST / HTTP/1.1\r\nHost: lisod\r\nContent-Length: %d\r\n\r\n", SLOW_BODY_LENGTH);
+        break;
+    case ADV_SLOW_READ:
+        for (int i = 0; i < SLOW_READ_DEPTH && len < (int)sizeof(buf) - 512; ++i)
+            len += snprintf(buf + len, 512, "GET %s HTTP/1.1\r\nHost: lisod\r\n\r\n", a->uri);
+        break;
+    }
+    if (len > 0 && write(c->fd, buf, len) < 0)
+    {
+        adversary_close(a, c, 1);
+        return;
+    }
+
+    // a slow reader is only woken by the server giving up on it
+    struct epoll_event ev;
+    ev.events = c->kind == ADV_SLOW_READ ? EPOLLRDHUP : EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    epoll_ctl(a->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->state = ADV_OPEN;
+    a->connecting--;
+    a->held++;
+    a->opened++;
+}
+
+static void adversary_drip(Adversaries *a, Adversary_Conn *c)
+{
+    static const char header[] = "X-Slow: 1\r\n";
+    char byte = c->kind == ADV_SLOW_HEADER ? header[c->sent % (sizeof(header) - 1)] : 'x';
+    if (write(c->fd, &byte, 1) != 1 && errno != EAGAIN)
+        adversary_close(a, c, 1);
+    else
+        c->sent++;
+}
+
+static void adversary_event(Adversaries *a, Adversary_Conn *c, int events)
+{
+    if (c->state == ADV_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+            adversary_close(a, c, 0);
+        else
+            adversary_connected(a, c);
+        return;
+    }
+    if (events & EPOLLIN)
+    {
+        // whatever the server answers (408, 503...), it then closes
+        char buf[4096];
+        int n;
+        while ((n = read(c->fd, buf, sizeof(buf))) > 0)
+            ;
+        if (n == 0 || errno != EAGAIN)
+        {
+            adversary_close(a, c, 1);
+            return;
+        }
+    }
+    if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        adversary_close(a, c, 1);
+}
+
+void *adversary_loop(void *arg)
+{
+    Adversaries *a = (Adversaries *)arg;
+    struct epoll_event events[256];
+    unsigned long next_drip = now_ns() + a->drip_ms * 1000000UL;
+
+    while (!__atomic_load_n(&a->stop, __ATOMIC_ACQUIRE))
+    {
+        unsigned long now = now_ns();
+        for (int i = 0; i < a->count; ++i)
+        {
+            if (a->conns[i].state == ADV_CLOSED && now >= a->conns[i].retry_at)
+                adversary_open(a, &a->conns[i]);
+        }
+        if (now >= next_drip)
+        {
+            for (int i = 0; i < a->count; ++i)
+            {
+                Adversary_Conn *c = &a->conns[i];
+                if (c->state == ADV_OPEN && (c->kind == ADV_SLOW_HEADER || c->kind == ADV_SLOW_BODY))
+                    adversary_drip(a, c);
+            }
+            next_drip = now + a->drip_ms * 1000000UL;
+        }
+
+        int n = epoll_wait(a->epfd, events, 256, 10);
+        for (int i = 0; i < n; ++i)
+        {
+            Adversary_Conn *c = (Adversary_Conn *)events[i].data.ptr;
+            if (c->state != ADV_CLOSED)
+                adversary_event(a, c, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * start a thread keeping counts[kind] connections of each kind open against
+ * server until stop_adversaries()
+ */
+Adversaries *create_adversaries(const int *counts, const char *uri, int drip_ms, struct sockaddr *server,
+                                socklen_t server_len)
+{
+    Adversaries *a = calloc(1, sizeof(Adversaries));
+    for (int k = 0; k < ADV_KINDS; ++k)
+    {
+        a->counts[k] = counts[k];
+        a->count += counts[k];
+    }
+    a->conns = calloc(a->count > 0 ? a->count : 1, sizeof(Adversary_Conn));
+    int i = 0;
+    for (int k = 0; k < ADV_KINDS; ++k)
+    {
+        for (int j = 0; j < counts[k]; ++j)
+            a->conns[i++].kind = k;
+    }
+    a->uri = uri;
+    a->drip_ms = drip_ms;
+    memcpy(&a->server, server, server_len);
+    a->server_len = server_len;
+    a->epfd = epoll_create1(0);
+    if (pthread_create(&a->tid, NULL, adversary_loop, a) != 0)
+    {
+        close(a->epfd);
+        free(a->conns);
+        free(a);
+        return NULL;
+    }
+    return a;
+}
+
+void stop_adversaries(Adversaries *a)
+{
+    if (__atomic_exchange_n(&a->stop, 1, __ATOMIC_ACQ_REL))
+        return;
+    pthread_join(a->tid, NULL);
+}
+
+void adversary_digest(Adversaries *a, char *buf, size_t size)
+{
+    int at = snprintf(buf, size, "Adversaries:");
+    for (int k = 0; k < ADV_KINDS && at < (int)size; ++k)
+    {
+        if (a->counts[k] > 0)
+            at += snprintf(buf + at, size - at, " %s %d,", adversary_names[k], a->counts[k]);
+    }
+    if (at < (int)size)
+        snprintf(buf + at, size - at, " held %d, connecting %d, opened %lu, evicted %lu, failed %lu\n", a->held,
+                 a->connecting, a->opened, a->evicted, a->failed);
+}
+
+void destroy_adversaries(Adversaries *a)
+{
+    stop_adversaries(a);
+    for (int i = 0; i < a->count; ++i)
+    {
+        if (a->conns[i].state != ADV_CLOSED)
+            close(a->conns[i].fd);
+    }
+    close(a->epfd);
+    free(a->conns);
+    free(a);
+}
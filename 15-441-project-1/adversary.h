@@ -0,0 +1,61 @@
+#ifndef _ADVERSARY_H_
+#define _ADVERSARY_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// badly behaved clients lisod_bench runs next to the measured ones
+enum
+{
+    ADV_SLOW_HEADER = 0, // request headers a byte at a time
+    ADV_SLOW_BODY,       // a large POST body a byte at a time
+    ADV_SLOW_READ,       // pipelined requests for uri, never reads the answers
+    ADV_HALF_OPEN,       // connects and goes silent
+    ADV_FLOOD,           // as many silent connections as asked, reopened as soon as dropped
+    ADV_KINDS
+};
+
+typedef struct
+{
+    int fd;
+    int kind;
+    int state;
+    int sent; // drip bytes so far
+    unsigned long retry_at; // ns, reconnect not before
+} Adversary_Conn;
+
+typedef struct
+{
+    Adversary_Conn *conns;
+    int count;
+    int counts[ADV_KINDS];
+    const char *uri; // slow_read asks for it, best something large
+    int drip_ms;     // slow clients send a byte this often
+    struct sockaddr_storage server;
+    socklen_t server_len;
+    pthread_t tid;
+    int epfd;
+    int stop;
+    int held;       // connected right now
+    int connecting; // connect() not answered yet, e.g. the backlog is full
+    unsigned long opened;
+    unsigned long evicted; // closed by the server
+    unsigned long failed;  // connect() refused or out of fds
+} Adversaries;
+
+extern const char *adversary_names[ADV_KINDS];
+
+int adversary_kind(const char *name);
+
+Adversaries *create_adversaries(const int *counts, const char *uri, int drip_ms, struct sockaddr *server,
+                                socklen_t server_len);
+
+void stop_adversaries(Adversaries *a);
+
+void adversary_digest(Adversaries *a, char *buf, size_t size);
+
+void destroy_adversaries(Adversaries *a);
+
+#endif
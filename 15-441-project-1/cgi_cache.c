@@ -0,0 +1,356 @@
+#include <strings.h>
+
+#include "cgi_cache.h"
+#include "timer_wheel.h"
+
+Cgi_Cache *create_cgi_cache(size_t max_bytes, const char *vary, int pass_ttl)
+{
+    Cgi_Cache *c = calloc(1, sizeof(Cgi_Cache));
+    c->max_bytes = max_bytes;
+    c->vary = vary == NULL ? "" : vary;
+    c->pass_ttl = pass_ttl;
+    return c;
+}
+
+static unsigned int hash_key(const char *key)
+{
+    unsigned int h = 5381;
+    while (*key != '\0')
+        h = h * 33 + (unsigned char)*key++;
+    return h % CACHE_BUCKETS;
+}
+
+// whether name is one of the comma separated names in list
+static int in_list(const char *list, const char *name, size_t name_len)
+{
+    while (*list != '\0')
+    {
+        while (*list == ' ' || *list == ',')
+            list++;
+        size_t len = strcspn(list, ", ");
+        if (len > 0 && len == name_len && strncasecmp(list, name, len) == 0)
+            return 1;
+        list += len;
+    }
+    return 0;
+}
+
+/**
+ * cache key of a CGI request: its scheme, since the script sees which
+ * listener it came in on, its URI, script and query, plus the values of
+ * the request headers listed in vary. NULL if it may not be served from or
+ * stored in a shared cache.
+ */
+char *cgi_cache_key(Cgi_Cache *c, Request *request, int https)
+{
+    if (strcmp(request->http_method, "GET") != 0)
+        return NULL;
+    for (int i = 0; i < request->header_count; ++i)
+    {
+        const char *name = request->headers[i].header_name;
+        if (strcasecmp(name, "Authorization") == 0)
+            return NULL;
+        if (strcasecmp(name, "Cookie") == 0 && !in_list(c->vary, name, strlen(name)))
+            return NULL;
+        if (strcasecmp(name, "Content-Length") == 0 && atoi(request->headers[i].header_value) > 0)
+            return NULL;
+    }
+
+    const char *scheme = https ? "https " : "http ";
+    size_t size = strlen(scheme) + strlen(request->http_uri) + 1;
+    char *key = malloc(size);
+    strcpy(key, scheme);
+    strcat(key, request->http_uri);
+    for (int i = 0; i < request->header_count; ++i)
+    {
+        const char *name = request->headers[i].header_name;
+        if (!in_list(c->vary, name, strlen(name)))
+            continue;
+        size += strlen(name) + strlen(request->headers[i].header_value) + 2;
+        key = realloc(key, size);
+        strcat(key, "\n");
+        strcat(key, name);
+        strcat(key, ":");
+        strcat(key, request->headers[i].header_value);
+    }
+    return key;
+}
+
+/**
+ * how long the HTTP response a script produced may be reused, in ms: what
+ * Cache-Control gives it, 0 if it says no-store (or private, no-cache),
+ * has no max-age, sets a cookie or varies on a header that is not part of
+ * the key
+ */
+int cgi_cache_ttl(Cgi_Cache *c, const char *http, int len)
+{
+    long max_age = 0;
+    long s_maxage = -1;
+    const char *end = http + len;
+    const char *line = memchr(http, '\n', len);
+    while (line != NULL && ++line < end && *line != '\r' && *line != '\n')
+    {
+        const char *eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        // one client's session is nobody else's business
+        if (strncasecmp(line, "Set-Cookie:", 11) == 0 || strncasecmp(line, "Set-Cookie2:", 12) == 0)
+            return 0;
+        if (strncasecmp(line, "Cache-Control:", 14) == 0)
+        {
+            for (const char *p = line + 14; p < eol; p++)
+            {
+                if (strncasecmp(p, "no-store", 8) == 0 || strncasecmp(p, "no-cache", 8) == 0 ||
+                    strncasecmp(p, "private", 7) == 0)
+                    return 0;
+                if (strncasecmp(p, "s-maxage=", 9) == 0)
+                    s_maxage = atol(p + 9);
+                else if (strncasecmp(p, "max-age=", 8) == 0 && (p == line + 14 || p[-1] != '-'))
+                    max_age = atol(p + 8);
+            }
+        }
+        else if (strncasecmp(line, "Vary:", 5) == 0)
+        {
+            const char *p = line + 5;
+            while (p < eol)
+            {
+                while (p < eol && (*p == ' ' || *p == ','))
+                    p++;
+                size_t name_len = 0;
+                while (p + name_len < eol && strchr(", \r\n", p[name_len]) == NULL)
+                    name_len++;
+                if (name_len == 0)
+                    break;
+                if (*p == '*' || !in_list(c->vary, p, name_len))
+                    return 0;
+                p += name_len;
+            }
+        }
+        line = memchr(line, '\n', end - line);
+    }
+
+    long ttl = s_maxage >= 0 ? s_maxage : max_age;
+    if (ttl <= 0)
+        return 0;
+    return ttl > 86400 ? 86400000 : ttl * 1000;
+}
+
+static void unlink_entry(Cgi_Cache *c, Cache_Entry *e)
+{
+    Cache_Entry **p = &c->buckets[hash_key(e->key)];
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        c->oldest = e->newer;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        c->newest = e->older;
+    if (e->response != NULL && !e->filling)
+        c->bytes -= e->len;
+    c->entries--;
+    free(e->key);
+    free(e->response);
+    free(e);
+}
+
+// make room by dropping the oldest entries nobody is filling
+static void evict(Cgi_Cache *c, size_t bytes, int entries, Cache_Entry *keep)
+{
+    Cache_Entry *e = c->oldest;
+    while (e != NULL && (c->bytes + bytes > c->max_bytes || c->entries + entries > CACHE_MAX_ENTRIES))
+    {
+        Cache_Entry *newer = e->newer;
+        if (!e->filling && e != keep)
+        {
+            if (e->response != NULL)
+                c->evicted++;
+            unlink_entry(c, e);
+        }
+        e = newer;
+    }
+}
+
+/**
+ * look key up for client fd. A miss creates the entry this client's run
+ * fills, concurrent requests for it then wait on that run.
+ */
+int cgi_cache_lookup(Cgi_Cache *c, const char *key, int fd, const char *request, int len, Cache_Entry **entry)
+{
+    unsigned long now = timer_now_ms();
+    Cache_Entry *e = c->buckets[hash_key(key)];
+    while (e != NULL && strcmp(e->key, key) != 0)
+        e = e->next;
+
+    if (e != NULL && !e->filling && e->expires <= now)
+    {
+        unlink_entry(c, e);
+        e = NULL;
+    }
+
+    if (e != NULL && e->filling)
+    {
+        Cache_Waiter *waiter = malloc(sizeof(Cache_Waiter));
+        waiter->fd = fd;
+        waiter->request = malloc(len);
+        memcpy(waiter->request, request, len);
+        waiter->len = len;
+        waiter->next = e->waiters;
+        e->waiters = waiter;
+        c->coalesced++;
+        return CACHE_WAIT;
+    }
+    if (e != NULL && e->response != NULL)
+    {
+        c->hits++;
+        *entry = e;
+        return CACHE_HIT;
+    }
+    if (e != NULL)
+    {
+        c->passes++;
+        return CACHE_PASS;
+    }
+
+    evict(c, 0, 1, NULL);
+    e = calloc(1, sizeof(Cache_Entry));
+    e->key = strdup(key);
+    e->filling = 1;
+    unsigned int h = hash_key(key);
+    e->next = c->buckets[h];
+    c->buckets[h] = e;
+    e->older = c->newest;
+    if (c->newest != NULL)
+        c->newest->newer = e;
+    else
+        c->oldest = e;
+    c->newest = e;
+    c->entries++;
+    c->misses++;
+    *entry = e;
+    return CACHE_MISS;
+}
+
+// more of the response being filled in
+void cgi_cache_append(Cgi_Cache *c, Cache_Entry *e, const char *buf, int len)
+{
+    if (e->too_big)
+        return;
+    if ((size_t)(e->len + len) > c->max_bytes)
+    {
+        e->too_big = 1;
+        return;
+    }
+    e->response = realloc(e->response, e->len + len);
+    memcpy(e->response + e->len, buf, len);
+    e->len += len;
+}
+
+/**
+ * the run filling e is over. With ttl > 0 the response is stored and the
+ * waiters are returned to be served from it. With ttl 0 (or if it did not
+ * fit) the response could not be shared: e stays behind for a while as a pass, so requests for the
+ * key stop waiting on each other. With ttl < 0 the run failed and e goes.
+ * In both of the latter cases the waiters are moved to c->retry instead.
+ */
+Cache_Waiter *cgi_cache_finish(Cgi_Cache *c, Cache_Entry *e, int ttl)
+{
+    Cache_Waiter *waiters = e->waiters;
+    e->waiters = NULL;
+    e->filling = 0;
+
+    if (ttl > 0 && !e->too_big && e->response != NULL)
+    {
+        evict(c, e->len, 0, e);
+        c->bytes += e->len;
+        e->expires = timer_now_ms() + ttl;
+        c->stored++;
+        return waiters;
+    }
+
+    free(e->response);
+    e->response = NULL;
+    e->len = 0;
+    if (ttl >= 0)
+    {
+        // also when it was too big to keep
+        e->expires = timer_now_ms() + c->pass_ttl;
+    }
+    else
+        unlink_entry(c, e);
+
+    while (waiters != NULL)
+    {
+        Cache_Waiter *next = waiters->next;
+        waiters->next = c->retry;
+        c->retry = waiters;
+        waiters = next;
+    }
+    return NULL;
+}
+
+/**
+ * client fd no longer waits on anyone's run
+ */
+void cgi_cache_forget(Cgi_Cache *c, int fd)
+{
+    for (Cache_Entry *e = c->newest; e != NULL; e = e->older)
+    {
+        if (!e->filling)
+            continue;
+        for (Cache_Waiter **p = &e->waiters; *p != NULL; p = &(*p)->next)
+        {
+            if ((*p)->fd == fd)
+            {
+                Cache_Waiter *waiter = *p;
+                *p = waiter->next;
+                free(waiter->request);
+                free(waiter);
+                return;
+            }
+        }
+    }
+    for (Cache_Waiter **p = &c->retry; *p != NULL; p = &(*p)->next)
+    {
+        if ((*p)->fd == fd)
+        {
+            Cache_Waiter *waiter = *p;
+            *p = waiter->next;
+            free(waiter->request);
+            free(waiter);
+            return;
+        }
+    }
+}
+
+void cgi_cache_digest(Cgi_Cache *c, char *buf, size_t size)
+{
+    snprintf(buf, size, "CGI cache entries: %d, bytes: %zu, hits: %lu, misses: %lu, coalesced: %lu, "
+                        "passes: %lu, stored: %lu, evicted: %lu\n",
+             c->entries, c->bytes, c->hits, c->misses, c->coalesced, c->passes, c->stored, c->evicted);
+}
+
+static void free_waiters(Cache_Waiter *waiter)
+{
+    while (waiter != NULL)
+    {
+        Cache_Waiter *next = waiter->next;
+        free(waiter->request);
+        free(waiter);
+        waiter = next;
+    }
+}
+
+void destroy_cgi_cache(Cgi_Cache *c)
+{
+    while (c->oldest != NULL)
+    {
+        free_waiters(c->oldest->waiters);
+        unlink_entry(c, c->oldest);
+    }
+    free_waiters(c->retry);
+    free(c);
+}
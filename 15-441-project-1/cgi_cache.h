@@ -0,0 +1,82 @@
+#ifndef _CGI_CACHE_H_
+#define _CGI_CACHE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_ENTRIES 4096
+
+// what cgi_cache_lookup() found
+enum
+{
+    CACHE_MISS = 0, // the caller runs the script and fills the entry
+    CACHE_HIT,
+    CACHE_WAIT, // someone else's run fills it, wait for cgi_cache_finish()
+    CACHE_PASS  // recently not cacheable, run the script without waiting
+};
+
+typedef struct Cache_Waiter
+{
+    int fd;
+    char *request; // header block, to run it on its own if need be
+    int len;
+    struct Cache_Waiter *next;
+} Cache_Waiter;
+
+typedef struct Cache_Entry
+{
+    char *key;
+    char *response; // whole HTTP response, NULL for a pass
+    int len;
+    int filling;   // the first request's script still runs
+    int too_big;   // its response outgrew the cache while filling
+    int ttl;       // ms the response may be reused, set by the filler
+    unsigned long expires; // ms
+    Cache_Waiter *waiters;
+    struct Cache_Entry *next;  // hash chain
+    struct Cache_Entry *older; // insertion order, for eviction
+    struct Cache_Entry *newer;
+} Cache_Entry;
+
+typedef struct
+{
+    size_t max_bytes;
+    size_t bytes;
+    const char *vary; // comma separated request headers that may be part of a key
+    int pass_ttl;
+    int entries;
+    Cache_Entry *buckets[CACHE_BUCKETS];
+    Cache_Entry *oldest;
+    Cache_Entry *newest;
+    Cache_Waiter *retry; // waiters that have to run their request themselves
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long coalesced;
+    unsigned long passes;
+    unsigned long stored;
+    unsigned long evicted;
+} Cgi_Cache;
+
+Cgi_Cache *create_cgi_cache(size_t max_bytes, const char *vary, int pass_ttl);
+
+char *cgi_cache_key(Cgi_Cache *c, Request *request, int https);
+
+int cgi_cache_ttl(Cgi_Cache *c, const char *http, int len);
+
+int cgi_cache_lookup(Cgi_Cache *c, const char *key, int fd, const char *request, int len, Cache_Entry **entry);
+
+void cgi_cache_append(Cgi_Cache *c, Cache_Entry *e, const char *buf, int len);
+
+Cache_Waiter *cgi_cache_finish(Cgi_Cache *c, Cache_Entry *e, int ttl);
+
+void cgi_cache_forget(Cgi_Cache *c, int fd);
+
+void cgi_cache_digest(Cgi_Cache *c, char *buf, size_t size);
+
+void destroy_cgi_cache(Cgi_Cache *c);
+
+#endif
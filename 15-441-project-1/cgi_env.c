@@ -0,0 +1,146 @@
+#include <ctype.h>
+#include <strings.h>
+
+#include "cgi_env.h"
+
+#define ENV_ENTRIES 32
+#define ENV_ARENA 1024
+
+// the part of a CGI environment that does not depend on the request
+static const char *CONSTANTS[CGI_ENV_CONSTANTS] = {
+    "GATEWAY_INTERFACE=CGI/1.1",
+    "SCRIPT_NAME=/cgi",
+    "SERVER_PROTOCOL=HTTP/1.1",
+    "SERVER_SOFTWARE=Liso/1.0"};
+
+Cgi_Env *create_cgi_env(int http_port, int https_port)
+{
+    Cgi_Env *env = calloc(1, sizeof(Cgi_Env));
+    for (int i = 0; i < CGI_ENV_CONSTANTS; ++i)
+        env->constants[i] = strdup(CONSTANTS[i]);
+    env->http_port = malloc(32);
+    snprintf(env->http_port, 32, "SERVER_PORT=%d", http_port);
+    env->https_port = malloc(32);
+    snprintf(env->https_port, 32, "SERVER_PORT=%d", https_port);
+
+    env->envp_size = ENV_ENTRIES;
+    env->envp = malloc(env->envp_size * sizeof(char *));
+    env->offsets = malloc(env->envp_size * sizeof(size_t));
+    env->arena_size = ENV_ARENA;
+    env->arena = malloc(env->arena_size);
+    return env;
+}
+
+/**
+ * room for entry *count of len bytes at the end of the arena. Entries are
+ * kept as offsets until the arena is done growing.
+ */
+static char *reserve(Cgi_Env *env, int *count, size_t *used, size_t len)
+{
+    if (*count + 1 >= env->envp_size)
+    {
+        env->envp_size *= 2;
+        env->envp = realloc(env->envp, env->envp_size * sizeof(char *));
+        env->offsets = realloc(env->offsets, env->envp_size * sizeof(size_t));
+    }
+    if (*used + len > env->arena_size)
+    {
+        while (*used + len > env->arena_size)
+            env->arena_size *= 2;
+        env->arena = realloc(env->arena, env->arena_size);
+    }
+    env->offsets[*count] = *used;
+    char *at = env->arena + *used;
+    *used += len;
+    (*count)++;
+    return at;
+}
+
+static void put(Cgi_Env *env, int *count, size_t *used, const char *name, const char *value, size_t value_len)
+{
+    size_t name_len = strlen(name);
+    char *at = reserve(env, count, used, name_len + value_len + 2);
+    memcpy(at, name, name_len);
+    at[name_len] = '=';
+    memcpy(at + name_len + 1, value, value_len);
+    at[name_len + value_len + 1] = '\0';
+}
+
+/**
+ * the environment of a CGI request: the constants, then the variables of
+ * this request and every request header as HTTP_<NAME>. The result stays
+ * valid until the next call, which reuses the same memory.
+ */
+char **cgi_env_build(Cgi_Env *env, Request *request, const char *addr, int https)
+{
+    int count = 0;
+    size_t used = 0;
+
+    const char *uri = request->http_uri;
+    const char *mark = strchr(uri, '?');
+    size_t path_len = mark == NULL ? strlen(uri) : (size_t)(mark - uri);
+    const char *query = mark == NULL ? "" : mark + 1;
+
+    put(env, &count, &used, "QUERY_STRING", query, strlen(query));
+    put(env, &count, &used, "REQUEST_URI", uri, path_len);
+    // what follows the script name, /cgi
+    put(env, &count, &used, "PATH_INFO", uri + (path_len < 4 ? path_len : 4), path_len < 4 ? 0 : path_len - 4);
+    put(env, &count, &used, "REMOTE_ADDR", addr, strlen(addr));
+    put(env, &count, &used, "REQUEST_METHOD", request->http_method, strlen(request->http_method));
+    if (https)
+        put(env, &count, &used, "HTTPS", "on", 2);
+
+    for (int k = 0; k < request->header_count; ++k)
+    {
+        const char *name = request->headers[k].header_name;
+        const char *value = request->headers[k].header_value;
+        size_t value_len = strlen(value);
+
+        if (strcasecmp(name, "Content-Length") == 0)
+            put(env, &count, &used, "CONTENT_LENGTH", value, value_len);
+        else if (strcasecmp(name, "Content-Type") == 0)
+            put(env, &count, &used, "CONTENT_TYPE", value, value_len);
+        // credentials stay with us, and HTTP_PROXY would redirect the
+        // script's own outgoing requests (httpoxy)
+        else if (strcasecmp(name, "Authorization") != 0 && strcasecmp(name, "Proxy") != 0)
+        {
+            size_t name_len = strlen(name);
+            char *at = reserve(env, &count, &used, 5 + name_len + value_len + 2);
+            memcpy(at, "HTTP_", 5);
+            for (size_t i = 0; i < name_len; ++i)
+                at[5 + i] = name[i] == '-' ? '_' : toupper((unsigned char)name[i]);
+            at[5 + name_len] = '=';
+            memcpy(at + 6 + name_len, value, value_len);
+            at[6 + name_len + value_len] = '\0';
+        }
+    }
+
+    // the arena has its final address now
+    for (int i = 0; i < count; ++i)
+        env->envp[i] = env->arena + env->offsets[i];
+
+    if (count + CGI_ENV_CONSTANTS + 2 > env->envp_size)
+    {
+        env->envp_size = count + CGI_ENV_CONSTANTS + 2;
+        env->envp = realloc(env->envp, env->envp_size * sizeof(char *));
+        env->offsets = realloc(env->offsets, env->envp_size * sizeof(size_t));
+    }
+    for (int i = 0; i < CGI_ENV_CONSTANTS; ++i)
+        env->envp[count++] = env->constants[i];
+    env->envp[count++] = https ? env->https_port : env->http_port;
+    env->envp[count] = NULL;
+
+    return env->envp;
+}
+
+void destroy_cgi_env(Cgi_Env *env)
+{
+    for (int i = 0; i < CGI_ENV_CONSTANTS; ++i)
+        free(env->constants[i]);
+    free(env->http_port);
+    free(env->https_port);
+    free(env->envp);
+    free(env->offsets);
+    free(env->arena);
+    free(env);
+}
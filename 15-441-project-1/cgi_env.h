@@ -0,0 +1,30 @@
+#ifndef _CGI_ENV_H_
+#define _CGI_ENV_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parse.h"
+
+#define CGI_ENV_CONSTANTS 4
+
+typedef struct
+{
+    char *constants[CGI_ENV_CONSTANTS]; // same for every request, rendered once
+    char *http_port;                    // SERVER_PORT= of either listener
+    char *https_port;
+    char **envp;    // last built environment, NULL terminated
+    int envp_size;  // entries envp has room for
+    char *arena;    // strings of the variable part, all in one block
+    size_t arena_size;
+    size_t *offsets; // where each entry starts in arena while it may move
+} Cgi_Env;
+
+Cgi_Env *create_cgi_env(int http_port, int https_port);
+
+char **cgi_env_build(Cgi_Env *env, Request *request, const char *addr, int https);
+
+void destroy_cgi_env(Cgi_Env *env);
+
+#endif
@@ -0,0 +1,192 @@
+#include "cgi_limit.h"
+#include "timer_wheel.h"
+
+Cgi_Limiter *create_cgi_limiter(int max, int per_script, int queue_max)
+{
+    Cgi_Limiter *lim = calloc(1, sizeof(Cgi_Limiter));
+    lim->max = max;
+    lim->per_script = per_script;
+    lim->queue_max = queue_max;
+    lim->slots = malloc(max * sizeof(Cgi_Slot));
+    for (int i = 0; i < max; ++i)
+        lim->slots[i].fd = -1;
+    return lim;
+}
+
+// whether one more copy of script may run now
+static int may_run(Cgi_Limiter *lim, const char *script)
+{
+    if (lim->running >= lim->max)
+        return 0;
+    if (lim->per_script <= 0)
+        return 1;
+    int same = 0;
+    for (int i = 0; i < lim->max; ++i)
+    {
+        if (lim->slots[i].fd >= 0 && strcmp(lim->slots[i].script, script) == 0)
+            same++;
+    }
+    return same < lim->per_script;
+}
+
+static void take_slot(Cgi_Limiter *lim, int fd, char *script)
+{
+    for (int i = 0; i < lim->max; ++i)
+    {
+        if (lim->slots[i].fd < 0)
+        {
+            lim->slots[i].fd = fd;
+            lim->slots[i].script = script;
+            lim->running++;
+            lim->admitted++;
+            return;
+        }
+    }
+}
+
+/**
+ * ask to run script for client fd. Requests that have to wait are queued
+ * with their header block, unless the queue is full already.
+ */
+int cgi_limit_acquire(Cgi_Limiter *lim, int fd, const char *script, const char *request, int len)
+{
+    // nobody may overtake those already waiting
+    if (lim->queued == 0 && may_run(lim, script))
+    {
+        take_slot(lim, fd, strdup(script));
+        return CGI_RUN;
+    }
+    if (lim->queued >= lim->queue_max)
+    {
+        lim->rejected++;
+        return CGI_REJECTED;
+    }
+
+    Cgi_Waiter *waiter = malloc(sizeof(Cgi_Waiter));
+    waiter->fd = fd;
+    waiter->script = strdup(script);
+    waiter->request = malloc(len);
+    memcpy(waiter->request, request, len);
+    waiter->len = len;
+    waiter->since = timer_now_ms();
+    waiter->next = NULL;
+    if (lim->tail != NULL)
+        lim->tail->next = waiter;
+    else
+        lim->head = waiter;
+    lim->tail = waiter;
+    lim->queued++;
+    histogram_record(&lim->queue_length, lim->queued);
+    return CGI_QUEUED;
+}
+
+static void unlink_waiter(Cgi_Limiter *lim, Cgi_Waiter *prev, Cgi_Waiter *waiter)
+{
+    if (prev != NULL)
+        prev->next = waiter->next;
+    else
+        lim->head = waiter->next;
+    if (lim->tail == waiter)
+        lim->tail = prev;
+    lim->queued--;
+    histogram_record(&lim->wait_ms, timer_now_ms() - waiter->since);
+}
+
+/**
+ * the longest waiting request that may run now, its slot already taken.
+ * Requests for a script at its own limit let others go first. Returns the
+ * client, -1 if none; the header block is the caller's to free.
+ */
+int cgi_limit_next(Cgi_Limiter *lim, char **request, int *len)
+{
+    Cgi_Waiter *prev = NULL;
+    for (Cgi_Waiter *waiter = lim->head; waiter != NULL && lim->running < lim->max; waiter = waiter->next)
+    {
+        if (may_run(lim, waiter->script))
+        {
+            unlink_waiter(lim, prev, waiter);
+            take_slot(lim, waiter->fd, waiter->script);
+            int fd = waiter->fd;
+            *request = waiter->request;
+            *len = waiter->len;
+            free(waiter);
+            return fd;
+        }
+        prev = waiter;
+    }
+    return -1;
+}
+
+int cgi_limit_queued(Cgi_Limiter *lim, int fd)
+{
+    for (Cgi_Waiter *waiter = lim->head; waiter != NULL; waiter = waiter->next)
+    {
+        if (waiter->fd == fd)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * client fd is done with its script, or gave up waiting for one
+ */
+void cgi_limit_release(Cgi_Limiter *lim, int fd)
+{
+    for (int i = 0; i < lim->max; ++i)
+    {
+        if (lim->slots[i].fd == fd)
+        {
+            free(lim->slots[i].script);
+            lim->slots[i].fd = -1;
+            lim->running--;
+            return;
+        }
+    }
+
+    Cgi_Waiter *prev = NULL;
+    for (Cgi_Waiter *waiter = lim->head; waiter != NULL; waiter = waiter->next)
+    {
+        if (waiter->fd == fd)
+        {
+            unlink_waiter(lim, prev, waiter);
+            free(waiter->script);
+            free(waiter->request);
+            free(waiter);
+            return;
+        }
+        prev = waiter;
+    }
+}
+
+void cgi_limit_digest(Cgi_Limiter *lim, char *buf, size_t size)
+{
+    int n = snprintf(buf, size, "CGI scripts running: %d (max %d), admitted: %lu, queued: %d, "
+                                "rejected: %lu, expired in queue: %lu\n",
+                     lim->running, lim->max, lim->admitted, lim->queued, lim->rejected, lim->expired);
+    if (n > 0 && (size_t)n < size)
+    {
+        histogram_digest(&lim->queue_length, "CGI queue length", buf + n, size - n);
+        n += strlen(buf + n);
+    }
+    if (n > 0 && (size_t)n < size)
+        histogram_digest(&lim->wait_ms, "CGI queue wait ms", buf + n, size - n);
+}
+
+void destroy_cgi_limiter(Cgi_Limiter *lim)
+{
+    for (int i = 0; i < lim->max; ++i)
+    {
+        if (lim->slots[i].fd >= 0)
+            free(lim->slots[i].script);
+    }
+    while (lim->head != NULL)
+    {
+        Cgi_Waiter *next = lim->head->next;
+        free(lim->head->script);
+        free(lim->head->request);
+        free(lim->head);
+        lim->head = next;
+    }
+    free(lim->slots);
+    free(lim);
+}
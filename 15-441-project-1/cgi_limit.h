@@ -0,0 +1,65 @@
+#ifndef _CGI_LIMIT_H_
+#define _CGI_LIMIT_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+
+// what cgi_limit_acquire() decided
+enum
+{
+    CGI_RUN = 0,  // a slot is taken, start the script
+    CGI_QUEUED,   // wait for cgi_limit_next() to hand it out
+    CGI_REJECTED  // queue full, answer 503
+};
+
+typedef struct
+{
+    int fd; // client, -1 if the slot is free
+    char *script;
+} Cgi_Slot;
+
+typedef struct Cgi_Waiter
+{
+    int fd;
+    char *script;
+    char *request; // header block, parsed again once it may run
+    int len;
+    unsigned long since; // ms
+    struct Cgi_Waiter *next;
+} Cgi_Waiter;
+
+typedef struct
+{
+    int max;        // scripts running at once
+    int per_script; // of which running the same script, 0 no limit
+    int queue_max;  // requests waiting for a slot
+    Cgi_Slot *slots;
+    int running;
+    Cgi_Waiter *head; // FIFO
+    Cgi_Waiter *tail;
+    int queued;
+    unsigned long admitted;
+    unsigned long rejected;
+    unsigned long expired;
+    Histogram queue_length; // seen by each request that had to wait
+    Histogram wait_ms;
+} Cgi_Limiter;
+
+Cgi_Limiter *create_cgi_limiter(int max, int per_script, int queue_max);
+
+int cgi_limit_acquire(Cgi_Limiter *lim, int fd, const char *script, const char *request, int len);
+
+int cgi_limit_next(Cgi_Limiter *lim, char **request, int *len);
+
+int cgi_limit_queued(Cgi_Limiter *lim, int fd);
+
+void cgi_limit_release(Cgi_Limiter *lim, int fd);
+
+void cgi_limit_digest(Cgi_Limiter *lim, char *buf, size_t size);
+
+void destroy_cgi_limiter(Cgi_Limiter *lim);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stddef.h>
+#include <limits.h>
+
+#include "config.h"
+
+Config config;
+
+typedef struct
+{
+    const char *name;
+    size_t offset;
+    int type;
+} Config_Option;
+
+static const Config_Option OPTIONS[] = {
+    {"handshake_timeout", offsetof(Config, handshake_timeout), CONFIG_POSITIVE},
+    {"header_timeout", offsetof(Config, header_timeout), CONFIG_POSITIVE},
+    {"body_timeout", offsetof(Config, body_timeout), CONFIG_POSITIVE},
+    {"send_timeout", offsetof(Config, send_timeout), CONFIG_POSITIVE},
+    {"max_body_size", offsetof(Config, max_body_size)},
+    {"keepalive_timeout", offsetof(Config, keepalive_timeout), CONFIG_POSITIVE},
+    {"cgi_timeout", offsetof(Config, cgi_timeout), CONFIG_POSITIVE},
+    {"keepalive_requests", offsetof(Config, keepalive_requests)},
+    {"keepalive_idle_max", offsetof(Config, keepalive_idle_max)},
+    {"fd_reserve", offsetof(Config, fd_reserve)},
+    {"tls_session_cache_size", offsetof(Config, tls_session_cache_size)},
+    {"tls_session_lifetime", offsetof(Config, tls_session_lifetime), CONFIG_POSITIVE},
+    {"tls_ticket_rotate", offsetof(Config, tls_ticket_rotate)},
+    {"ktls", offsetof(Config, ktls)},
+    {"tls_workers", offsetof(Config, tls_workers)},
+    {"tls_record_size", offsetof(Config, tls_record_size)},
+    {"tls_boost_bytes", offsetof(Config, tls_boost_bytes)},
+    {"tls_boost_time", offsetof(Config, tls_boost_time)},
+    {"tls_idle_reset", offsetof(Config, tls_idle_reset)},
+    {"fcgi_app", offsetof(Config, fcgi_app), CONFIG_STRING},
+    {"cgi_classic", offsetof(Config, cgi_classic), CONFIG_STRING},
+    {"fcgi_min", offsetof(Config, fcgi_min)},
+    {"fcgi_max", offsetof(Config, fcgi_max), CONFIG_POSITIVE},
+    {"fcgi_mpx", offsetof(Config, fcgi_mpx), CONFIG_POSITIVE},
+    {"fcgi_idle_timeout", offsetof(Config, fcgi_idle_timeout), CONFIG_POSITIVE},
+    {"fcgi_abort_timeout", offsetof(Config, fcgi_abort_timeout), CONFIG_POSITIVE},
+    {"cgi_zygote", offsetof(Config, cgi_zygote)},
+    {"cgi_output_buffer", offsetof(Config, cgi_output_buffer), CONFIG_POSITIVE},
+    {"cgi_max", offsetof(Config, cgi_max), CONFIG_POSITIVE},
+    {"cgi_max_per_script", offsetof(Config, cgi_max_per_script)},
+    {"cgi_backlog", offsetof(Config, cgi_backlog)},
+    {"cgi_backlog_timeout", offsetof(Config, cgi_backlog_timeout), CONFIG_POSITIVE},
+    {"cgi_retry_after", offsetof(Config, cgi_retry_after)},
+    {"cgi_cache_size", offsetof(Config, cgi_cache_size)},
+    {"cgi_cache_vary", offsetof(Config, cgi_cache_vary), CONFIG_STRING},
+    {"cgi_cache_pass", offsetof(Config, cgi_cache_pass)},
+    {"plugins", offsetof(Config, plugins), CONFIG_STRING},
+    {"plugin_workers", offsetof(Config, plugin_workers), CONFIG_POSITIVE},
+    {"proxy", offsetof(Config, proxy), CONFIG_STRING},
+    {"proxy_balance", offsetof(Config, proxy_balance), CONFIG_STRING},
+    {"proxy_keepalive", offsetof(Config, proxy_keepalive)},
+    {"proxy_idle_timeout", offsetof(Config, proxy_idle_timeout), CONFIG_POSITIVE},
+    {"proxy_timeout", offsetof(Config, proxy_timeout), CONFIG_POSITIVE},
+    {"metrics_uri", offsetof(Config, metrics_uri), CONFIG_STRING},
+    {"log_phases", offsetof(Config, log_phases)},
+    {"trace_file", offsetof(Config, trace_file), CONFIG_STRING},
+    {"trace_sample", offsetof(Config, trace_sample)},
+    {"stats_shm", offsetof(Config, stats_shm), CONFIG_STRING},
+    {"stall_threshold", offsetof(Config, stall_threshold)},
+    {"stall_backtrace", offsetof(Config, stall_backtrace)},
+    {NULL, 0}};
+
+void config_init_default(Config *config)
+{
+    config->handshake_timeout = 5000;
+    config->header_timeout = 10000;
+    config->body_timeout = 30000;
+    config->send_timeout = 30000;
+    config->max_body_size = 16 * 1024 * 1024;
+    config->keepalive_timeout = 15000;
+    config->cgi_timeout = 30000;
+    config->keepalive_requests = 100;
+    config->keepalive_idle_max = 256;
+    config->fd_reserve = 32;
+    config->tls_session_cache_size = 20480;
+    config->tls_session_lifetime = 300000;
+    config->tls_ticket_rotate = 3600000;
+    config->ktls = 1;
+    config->tls_workers = 2;
+    config->tls_record_size = 1400; // fits one segment with TLS overhead
+    config->tls_boost_bytes = 65536;
+    config->tls_boost_time = 1000;
+    config->tls_idle_reset = 1000;
+    config->fcgi_app = NULL;
+    config->cgi_classic = NULL;
+    config->fcgi_min = 1;
+    config->fcgi_max = 8;
+    config->fcgi_mpx = 4;
+    config->fcgi_idle_timeout = 60000;
+    config->fcgi_abort_timeout = 5000;
+    config->cgi_zygote = 1;
+    config->cgi_output_buffer = 65536;
+    config->cgi_max = 32;
+    config->cgi_max_per_script = 8;
+    config->cgi_backlog = 64;
+    config->cgi_backlog_timeout = 5000;
+    config->cgi_retry_after = 1;
+    config->cgi_cache_size = 0;
+    config->cgi_cache_vary = NULL;
+    config->cgi_cache_pass = 5000;
+    config->plugins = NULL;
+    config->plugin_workers = 4;
+    config->proxy = NULL;
+    config->proxy_balance = NULL;
+    config->proxy_keepalive = 8;
+    config->proxy_idle_timeout = 30000;
+    config->proxy_timeout = 30000;
+    config->metrics_uri = NULL;
+    config->log_phases = 0;
+    config->trace_file = NULL;
+    config->trace_sample = 100;
+    config->stats_shm = NULL;
+    config->stall_threshold = 0;
+    config->stall_backtrace = 0;
+}
+
+/**
+ * apply one "name=value" command line option. String values point into
+ * the option itself, which lives as long as argv.
+ */
+int config_parse_option(Config *config, const char *option)
+{
+    const char *eq = strchr(option, '=');
+    if (eq == NULL)
+    {
+        fprintf(stderr, "Option %s is not of the form name=value.\n", option);
+        return CONFIG_FAILURE;
+    }
+
+    for (int i = 0; OPTIONS[i].name != NULL; ++i)
+    {
+        if (strlen(OPTIONS[i].name) == (size_t)(eq - option) &&
+            strncmp(OPTIONS[i].name, option, eq - option) == 0)
+        {
+            if (OPTIONS[i].type == CONFIG_STRING)
+            {
+                *(const char **)((char *)config + OPTIONS[i].offset) = eq + 1;
+                return 0;
+            }
+
+            char *end;
+            long val = strtol(eq + 1, &end, 10);
+            if (*(eq + 1) == '\0' || *end != '\0' || val < 0 || val > INT_MAX)
+            {
+                fprintf(stderr, "Bad value for option %s.\n", OPTIONS[i].name);
+                return CONFIG_FAILURE;
+            }
+            if (val == 0 && OPTIONS[i].type == CONFIG_POSITIVE)
+            {
+                fprintf(stderr, "Option %s must be at least 1.\n", OPTIONS[i].name);
+                return CONFIG_FAILURE;
+            }
+            *(int *)((char *)config + OPTIONS[i].offset) = (int)val;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Unknown option %s.\n", option);
+    return CONFIG_FAILURE;
+}
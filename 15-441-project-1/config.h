@@ -0,0 +1,78 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONFIG_FAILURE 2
+
+enum
+{
+    CONFIG_INT = 0,
+    CONFIG_POSITIVE, // an int for which 0 makes no sense
+    CONFIG_STRING
+};
+
+// tunables, all times in milliseconds
+typedef struct
+{
+    int handshake_timeout;  // to complete the TLS handshake
+    int header_timeout;     // to receive the request line and all headers
+    int body_timeout;       // to receive the rest of a Content-Length body
+    int send_timeout;       // a client may go without taking more of a reply
+    int max_body_size;      // bytes, larger request bodies get a 413
+    int keepalive_timeout;  // a persistent connection may sit idle
+    int cgi_timeout;        // a CGI script may run before it is killed
+    int keepalive_requests; // requests served per connection, 0 no limit
+    int keepalive_idle_max; // idle persistent connections kept server-wide
+    int fd_reserve;         // free fds below which idle connections are shed
+    int tls_session_cache_size; // TLS sessions remembered by id
+    int tls_session_lifetime;   // a cached session or ticket stays valid
+    int tls_ticket_rotate;      // ticket key lifetime, 0 disables tickets
+    int ktls;                   // 1 to let the kernel encrypt if it can
+    int tls_workers;            // handshake threads, 0 runs them in the loop
+    int tls_record_size;        // TLS record payload while a connection ramps up
+    int tls_boost_bytes;        // bytes after which records grow to 16 KB
+    int tls_boost_time;         // or time after which they do
+    int tls_idle_reset;         // idle time that goes back to small records
+    const char *fcgi_app;       // FastCGI program serving /cgi/, NULL for classic CGI
+    const char *cgi_classic;    // comma separated URI prefixes kept on classic CGI
+    int fcgi_min;               // FastCGI workers kept running
+    int fcgi_max;               // FastCGI workers at most
+    int fcgi_mpx;               // requests multiplexed on one worker connection
+    int fcgi_idle_timeout;      // idle workers above fcgi_min are stopped after
+    int fcgi_abort_timeout;     // a worker that has not ended an aborted request is replaced after
+    int cgi_zygote;             // 1 to spawn classic CGI from a small helper process
+    int cgi_output_buffer;      // CGI output bytes held for a slow client
+    int cgi_max;                // classic CGI scripts running at once
+    int cgi_max_per_script;     // of which running the same script, 0 no limit
+    int cgi_backlog;            // CGI requests waiting for a slot, 503 beyond
+    int cgi_backlog_timeout;    // a waiting CGI request gets a 503 after
+    int cgi_retry_after;        // seconds, advertised with a 503
+    int cgi_cache_size;         // bytes of CGI responses kept for reuse, 0 no cache
+    const char *cgi_cache_vary; // comma separated request headers a cached response may vary on
+    int cgi_cache_pass;         // an uncacheable response is not waited for again for
+    const char *plugins;        // native handlers, comma separated prefix=path.so[:args]
+    int plugin_workers;         // threads running handlers that may block
+    const char *proxy;          // upstreams, comma separated prefix=host:port|unix:/path|...
+    const char *proxy_balance;  // least_conn, round robin otherwise
+    int proxy_keepalive;        // idle connections kept per upstream
+    int proxy_idle_timeout;     // an idle upstream connection is closed after
+    int proxy_timeout;          // an upstream gets a 504 after this long without a byte
+    const char *metrics_uri;    // answered with Prometheus metrics, NULL for none
+    int log_phases;             // 1 to add each request's phase durations to the access log
+    const char *trace_file;     // sampled requests as trace events, NULL for none
+    int trace_sample;           // one request in this many is traced
+    const char *stats_shm;      // POSIX shared memory name for lisod_top ("/lisod"), NULL for none
+    int stall_threshold;        // event loop rounds longer than this are logged, 0 not watched
+    int stall_backtrace;        // 1 to log where a stalled loop is
+} Config;
+
+extern Config config;
+
+void config_init_default(Config *config);
+
+int config_parse_option(Config *config, const char *option);
+
+#endif
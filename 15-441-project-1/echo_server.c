@@ -499,7 +499,7 @@ int send_reply(int socket_num, int main_socket_num, Response *response, Log *log
     }
 
     // TODO log correctly the request!
-    access_log(log, addr, "", response->buf, response->size, strlen(response->buf));
+    access_log(log, addr, "", response->buf, response->size, strlen(response->buf), NULL);
 
     // close socket
     // 1. When connection closes
@@ -0,0 +1,650 @@
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "fastcgi.h"
+#include "timer_wheel.h"
+
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+typedef struct
+{
+    char *buf;
+    int len;
+    int cap;
+} Fcgi_Buffer;
+
+static void buffer_append(Fcgi_Buffer *b, const void *data, int len)
+{
+    if (b->len + len > b->cap)
+    {
+        while (b->len + len > b->cap)
+            b->cap = b->cap == 0 ? 1024 : b->cap * 2;
+        b->buf = realloc(b->buf, b->cap);
+    }
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+}
+
+static void append_header(Fcgi_Buffer *b, int type, int id, int content_len)
+{
+    unsigned char h[FCGI_HEADER_LEN] = {FCGI_VERSION_1, type, (id >> 8) & 0xff, id & 0xff,
+                                        (content_len >> 8) & 0xff, content_len & 0xff, 0, 0};
+    buffer_append(b, h, FCGI_HEADER_LEN);
+}
+
+// a stream is split into records and closed by an empty one
+static void append_stream(Fcgi_Buffer *b, int type, const char *data, int len)
+{
+    int offset = 0;
+    while (offset < len)
+    {
+        int n = len - offset > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len - offset;
+        append_header(b, type, 0, n);
+        buffer_append(b, data + offset, n);
+        offset += n;
+    }
+    append_header(b, type, 0, 0);
+}
+
+static void append_length(Fcgi_Buffer *b, int len)
+{
+    if (len < 128)
+    {
+        unsigned char c = len;
+        buffer_append(b, &c, 1);
+    }
+    else
+    {
+        unsigned char c[4] = {((len >> 24) & 0x7f) | 0x80, (len >> 16) & 0xff, (len >> 8) & 0xff, len & 0xff};
+        buffer_append(b, c, 4);
+    }
+}
+
+/**
+ * BEGIN_REQUEST, the environment as PARAMS and the body as STDIN, with
+ * request id 0 until a worker is picked
+ */
+static Fcgi_Buffer encode_request(char **envp, const char *body, int body_len)
+{
+    Fcgi_Buffer msg = {NULL, 0, 0};
+    Fcgi_Buffer params = {NULL, 0, 0};
+
+    unsigned char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    append_header(&msg, FCGI_BEGIN_REQUEST, 0, sizeof(begin));
+    buffer_append(&msg, begin, sizeof(begin));
+
+    for (int i = 0; envp[i] != NULL; ++i)
+    {
+        char *eq = strchr(envp[i], '=');
+        if (eq == NULL)
+            continue;
+        int name_len = eq - envp[i];
+        int value_len = strlen(eq + 1);
+        append_length(&params, name_len);
+        append_length(&params, value_len);
+        buffer_append(&params, envp[i], name_len);
+        buffer_append(&params, eq + 1, value_len);
+    }
+    append_stream(&msg, FCGI_PARAMS, params.buf, params.len);
+    append_stream(&msg, FCGI_STDIN, body, body_len);
+    free(params.buf);
+    return msg;
+}
+
+static void set_request_id(char *msg, int len, int id)
+{
+    int offset = 0;
+    while (offset + FCGI_HEADER_LEN <= len)
+    {
+        unsigned char *h = (unsigned char *)msg + offset;
+        h[2] = (id >> 8) & 0xff;
+        h[3] = id & 0xff;
+        offset += FCGI_HEADER_LEN + ((h[4] << 8) | h[5]) + h[6];
+    }
+}
+
+/**
+ * send records to a worker without waiting on it: what it does not take
+ * now waits in out_buf for fcgi_write()
+ */
+static int queue_records(Fcgi_Pool *pool, Fcgi_Worker *worker, const char *buf, int len)
+{
+    int offset = 0;
+    while (worker->out_len == 0 && offset < len)
+    {
+        int n = send(worker->fd, buf + offset, len - offset, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return FCGI_FAILURE;
+        offset += n;
+    }
+    if (offset < len)
+    {
+        worker->out_buf = realloc(worker->out_buf, worker->out_len + len - offset);
+        memcpy(worker->out_buf + worker->out_len, buf + offset, len - offset);
+        worker->out_len += len - offset;
+        FD_SET(worker->fd, pool->watch_write);
+    }
+    return 0;
+}
+
+/**
+ * start one worker: it gets a listening Unix socket as fd 0, the way
+ * FastCGI applications expect, and we keep a single connection to it
+ */
+static int spawn_worker(Fcgi_Pool *pool, Fcgi_Worker *worker)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    // abstract namespace, nothing to clean up on disk
+    snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "lisod-fcgi-%d-%d", getpid(), pool->spawned);
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr.sun_path + 1);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+        return FCGI_FAILURE;
+    if (bind(listen_fd, (struct sockaddr *)&addr, addr_len) < 0 || listen(listen_fd, FCGI_MPX_MAX) < 0)
+    {
+        close(listen_fd);
+        return FCGI_FAILURE;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(listen_fd);
+        return FCGI_FAILURE;
+    }
+    if (pid == 0)
+    {
+        // lisod blocks SIGCHLD to read it from a signalfd, workers should not
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+        dup2(listen_fd, 0);
+        for (int fd = 3; fd < FD_SETSIZE; ++fd)
+            close(fd);
+        char *argv[] = {(char *)pool->app, NULL};
+        execv(pool->app, argv);
+        fprintf(stderr, "Error executing FastCGI application %s.\n", pool->app);
+        _exit(EXIT_FAILURE);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, addr_len) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        close(listen_fd);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return FCGI_FAILURE;
+    }
+    close(listen_fd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    memset(worker, 0, sizeof(Fcgi_Worker));
+    worker->pid = pid;
+    worker->fd = fd;
+    worker->idle_since = timer_now_ms();
+    FD_SET(fd, pool->watch);
+    if (fd > pool->max_fd)
+        pool->max_fd = fd;
+    pool->live++;
+    pool->spawned++;
+    printf("FastCGI worker %d started on fd %d\n", pid, fd);
+    return 0;
+}
+
+/**
+ * stop sending work to a worker. Requests still on it are failed, its
+ * exit comes back through fcgi_exited().
+ */
+static void retire_worker(Fcgi_Pool *pool, Fcgi_Worker *worker, int fail)
+{
+    FD_CLR(worker->fd, pool->watch);
+    FD_CLR(worker->fd, pool->watch_write);
+    close(worker->fd);
+    worker->fd = -1;
+    if (!worker->exited)
+        kill(worker->pid, SIGTERM);
+    pool->live--;
+
+    for (int i = 0; i < FCGI_MPX_MAX; ++i)
+    {
+        Fcgi_Request *request = &worker->requests[i];
+        if (!request->in_use)
+            continue;
+        if (fail && request->client_fd >= 0)
+            pool->done(request->client_fd, NULL, 0, pool->arg);
+        free(request->out);
+        request->out = NULL;
+        request->in_use = 0;
+    }
+    worker->active = 0;
+    free(worker->in_buf);
+    worker->in_buf = NULL;
+    worker->in_len = 0;
+    free(worker->out_buf);
+    worker->out_buf = NULL;
+    worker->out_len = 0;
+}
+
+// least loaded worker with room for one more request, NULL if none
+static Fcgi_Worker *pick_worker(Fcgi_Pool *pool)
+{
+    Fcgi_Worker *best = NULL;
+    for (int i = 0; i < pool->max; ++i)
+    {
+        Fcgi_Worker *worker = &pool->workers[i];
+        if (worker->pid == 0 || worker->fd < 0 || worker->active >= pool->mpx)
+            continue;
+        if (best == NULL || worker->active < best->active)
+            best = worker;
+    }
+    if (best != NULL && best->active == 0)
+        return best;
+
+    // everyone is busy, grow the pool before multiplexing further
+    if (pool->live < pool->max)
+    {
+        for (int i = 0; i < pool->max; ++i)
+        {
+            if (pool->workers[i].pid == 0)
+            {
+                if (spawn_worker(pool, &pool->workers[i]) == 0)
+                    return &pool->workers[i];
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+static void dispatch(Fcgi_Pool *pool)
+{
+    while (pool->pending_head != NULL)
+    {
+        Fcgi_Worker *worker = pick_worker(pool);
+        if (worker == NULL)
+            return;
+
+        int slot = 0;
+        while (worker->requests[slot].in_use)
+            slot++;
+
+        Fcgi_Pending *pending = pool->pending_head;
+        set_request_id(pending->msg, pending->len, slot + 1);
+        if (queue_records(pool, worker, pending->msg, pending->len) != 0)
+        {
+            // try the next worker with the same request
+            retire_worker(pool, worker, 1);
+            continue;
+        }
+
+        pool->pending_head = pending->next;
+        if (pool->pending_head == NULL)
+            pool->pending_tail = NULL;
+        pool->pending--;
+
+        Fcgi_Request *request = &worker->requests[slot];
+        request->client_fd = pending->client_fd;
+        request->in_use = 1;
+        request->out = NULL;
+        request->out_len = 0;
+        request->aborted = 0;
+        worker->active++;
+        free(pending->msg);
+        free(pending);
+    }
+}
+
+Fcgi_Pool *create_fcgi_pool(const char *app, int min, int max, int mpx, int idle_timeout, int abort_timeout,
+                            fd_set *watch, fd_set *watch_write, fcgi_callback done, void *arg)
+{
+    Fcgi_Pool *pool = (Fcgi_Pool *)malloc(sizeof(Fcgi_Pool));
+    memset(pool, 0, sizeof(Fcgi_Pool));
+    pool->app = app;
+    pool->max = max < 1 ? 1 : max;
+    pool->min = min > pool->max ? pool->max : min;
+    pool->mpx = mpx < 1 ? 1 : (mpx > FCGI_MPX_MAX ? FCGI_MPX_MAX : mpx);
+    pool->idle_timeout = idle_timeout;
+    pool->abort_timeout = abort_timeout;
+    pool->workers = (Fcgi_Worker *)calloc(pool->max, sizeof(Fcgi_Worker));
+    pool->max_fd = -1;
+    pool->watch = watch;
+    pool->watch_write = watch_write;
+    pool->done = done;
+    pool->arg = arg;
+    fcgi_maintain(pool);
+    return pool;
+}
+
+/**
+ * hand a request to the pool. The answer comes back through the done
+ * callback, from fcgi_read(). Fails only if no worker can be started.
+ */
+int fcgi_submit(Fcgi_Pool *pool, int client_fd, char **envp, const char *body, int body_len)
+{
+    Fcgi_Buffer msg = encode_request(envp, body, body_len);
+
+    Fcgi_Pending *pending = (Fcgi_Pending *)malloc(sizeof(Fcgi_Pending));
+    pending->client_fd = client_fd;
+    pending->msg = msg.buf;
+    pending->len = msg.len;
+    pending->next = NULL;
+    if (pool->pending_tail != NULL)
+        pool->pending_tail->next = pending;
+    else
+        pool->pending_head = pending;
+    pool->pending_tail = pending;
+    pool->pending++;
+
+    dispatch(pool);
+
+    if (pool->live == 0 && pool->pending_tail == pending)
+    {
+        // nobody to queue for
+        fcgi_abort(pool, client_fd);
+        return FCGI_FAILURE;
+    }
+    return 0;
+}
+
+static Fcgi_Worker *worker_of(Fcgi_Pool *pool, int fd)
+{
+    for (int i = 0; i < pool->max; ++i)
+        if (pool->workers[i].pid != 0 && pool->workers[i].fd == fd)
+            return &pool->workers[i];
+    return NULL;
+}
+
+int fcgi_is_worker(Fcgi_Pool *pool, int fd)
+{
+    return worker_of(pool, fd) != NULL;
+}
+
+static void handle_record(Fcgi_Pool *pool, Fcgi_Worker *worker, int type, int id, char *content, int len)
+{
+    if (id < 1 || id > FCGI_MPX_MAX || !worker->requests[id - 1].in_use)
+        return;
+    Fcgi_Request *request = &worker->requests[id - 1];
+
+    switch (type)
+    {
+    case FCGI_STDOUT:
+        if (request->client_fd < 0)
+            break;
+        request->out = realloc(request->out, request->out_len + len + 1);
+        memcpy(request->out + request->out_len, content, len);
+        request->out_len += len;
+        request->out[request->out_len] = 0;
+        break;
+    case FCGI_STDERR:
+        fwrite(content, 1, len, stderr);
+        break;
+    case FCGI_END_REQUEST:
+        if (request->client_fd >= 0)
+        {
+            pool->served++;
+            pool->done(request->client_fd, request->out, request->out_len, pool->arg);
+        }
+        free(request->out);
+        request->out = NULL;
+        request->in_use = 0;
+        if (--worker->active == 0)
+            worker->idle_since = timer_now_ms();
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * the worker connection on fd is readable: take in whatever records are
+ * complete and finish the requests that ended
+ */
+void fcgi_read(Fcgi_Pool *pool, int fd)
+{
+    Fcgi_Worker *worker = worker_of(pool, fd);
+    if (worker == NULL)
+        return;
+
+    char buf[BUFSIZ];
+    int n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        printf("FastCGI worker %d went away\n", worker->pid);
+        retire_worker(pool, worker, 1);
+        dispatch(pool);
+        return;
+    }
+    worker->in_buf = realloc(worker->in_buf, worker->in_len + n);
+    memcpy(worker->in_buf + worker->in_len, buf, n);
+    worker->in_len += n;
+
+    int offset = 0;
+    while (worker->in_len - offset >= FCGI_HEADER_LEN)
+    {
+        unsigned char *h = (unsigned char *)worker->in_buf + offset;
+        int content_len = (h[4] << 8) | h[5];
+        int total = FCGI_HEADER_LEN + content_len + h[6];
+        if (worker->in_len - offset < total)
+            break;
+        handle_record(pool, worker, h[1], (h[2] << 8) | h[3], (char *)h + FCGI_HEADER_LEN, content_len);
+        offset += total;
+        // the callback may have retired this worker
+        if (worker->fd != fd)
+            return;
+    }
+    worker->in_len -= offset;
+    memmove(worker->in_buf, worker->in_buf + offset, worker->in_len);
+
+    dispatch(pool);
+}
+
+/**
+ * the worker connection on fd takes more: pass on the records queued for
+ * it, and stop watching once there are none left
+ */
+void fcgi_write(Fcgi_Pool *pool, int fd)
+{
+    Fcgi_Worker *worker = worker_of(pool, fd);
+    if (worker == NULL)
+    {
+        FD_CLR(fd, pool->watch_write);
+        return;
+    }
+
+    int sent = 0;
+    while (sent < worker->out_len)
+    {
+        int n = send(fd, worker->out_buf + sent, worker->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            printf("FastCGI worker %d stopped taking requests\n", worker->pid);
+            retire_worker(pool, worker, 1);
+            dispatch(pool);
+            return;
+        }
+        sent += n;
+    }
+    worker->out_len -= sent;
+    memmove(worker->out_buf, worker->out_buf + sent, worker->out_len);
+    if (worker->out_len == 0)
+        FD_CLR(fd, pool->watch_write);
+}
+
+/**
+ * the client of a request is gone: drop the request if it is still
+ * queued, otherwise tell the worker and throw away its answer
+ */
+void fcgi_abort(Fcgi_Pool *pool, int client_fd)
+{
+    Fcgi_Pending **prev = &pool->pending_head;
+    Fcgi_Pending *last = NULL;
+    while (*prev != NULL)
+    {
+        Fcgi_Pending *pending = *prev;
+        if (pending->client_fd == client_fd)
+        {
+            *prev = pending->next;
+            free(pending->msg);
+            free(pending);
+            pool->pending--;
+            continue;
+        }
+        last = pending;
+        prev = &pending->next;
+    }
+    pool->pending_tail = last;
+
+    for (int i = 0; i < pool->max; ++i)
+    {
+        Fcgi_Worker *worker = &pool->workers[i];
+        if (worker->pid == 0 || worker->fd < 0)
+            continue;
+        for (int j = 0; j < FCGI_MPX_MAX; ++j)
+        {
+            Fcgi_Request *request = &worker->requests[j];
+            if (!request->in_use || request->client_fd != client_fd)
+                continue;
+            request->client_fd = -1;
+            request->aborted = timer_now_ms();
+            Fcgi_Buffer msg = {NULL, 0, 0};
+            append_header(&msg, FCGI_ABORT_REQUEST, j + 1, 0);
+            int failed = queue_records(pool, worker, msg.buf, msg.len) != 0;
+            free(msg.buf);
+            if (failed)
+            {
+                retire_worker(pool, worker, 1);
+                break;
+            }
+        }
+    }
+}
+
+// a request the worker was told to abort still holds its slot after abort_timeout
+static int abort_overdue(Fcgi_Pool *pool, Fcgi_Worker *worker, unsigned long now)
+{
+    if (pool->abort_timeout <= 0)
+        return 0;
+    for (int j = 0; j < FCGI_MPX_MAX; ++j)
+    {
+        Fcgi_Request *request = &worker->requests[j];
+        if (request->in_use && request->aborted != 0 && now - request->aborted >= (unsigned long)pool->abort_timeout)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * the child pid was reaped: if it was one of our workers, fail what it
+ * still had and free its slot. 1 if it was.
+ */
+int fcgi_exited(Fcgi_Pool *pool, pid_t pid)
+{
+    for (int i = 0; i < pool->max; ++i)
+    {
+        Fcgi_Worker *worker = &pool->workers[i];
+        if (worker->pid == 0 || worker->pid != pid)
+            continue;
+        worker->exited = 1;
+        if (worker->fd >= 0)
+        {
+            printf("FastCGI worker %d exited\n", pid);
+            retire_worker(pool, worker, 1);
+        }
+        worker->pid = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * replace the workers sitting on an aborted request, stop the ones idle
+ * for too long while the pool is above its minimum and start new ones up
+ * to it. Cheap enough to run every loop iteration.
+ */
+void fcgi_maintain(Fcgi_Pool *pool)
+{
+    unsigned long now = timer_now_ms();
+
+    for (int i = 0; i < pool->max; ++i)
+    {
+        Fcgi_Worker *worker = &pool->workers[i];
+        if (worker->pid == 0)
+            continue;
+        // a retired one keeps its slot until fcgi_exited() hears of it
+        if (worker->fd < 0)
+            continue;
+        if (abort_overdue(pool, worker, now))
+        {
+            // the slot is only freed with the connection it is multiplexed on
+            printf("FastCGI worker %d did not end an aborted request, retiring it\n", worker->pid);
+            retire_worker(pool, worker, 1);
+            continue;
+        }
+        if (worker->active == 0 && pool->live > pool->min &&
+            pool->idle_timeout > 0 && now - worker->idle_since >= (unsigned long)pool->idle_timeout)
+        {
+            printf("Reaping idle FastCGI worker %d\n", worker->pid);
+            retire_worker(pool, worker, 0);
+        }
+    }
+
+    for (int i = 0; i < pool->max && pool->live < pool->min; ++i)
+    {
+        if (pool->workers[i].pid == 0 && spawn_worker(pool, &pool->workers[i]) != 0)
+        {
+            fprintf(stderr, "Error starting FastCGI worker.\n");
+            break;
+        }
+    }
+
+    dispatch(pool);
+}
+
+void fcgi_digest(Fcgi_Pool *pool, char *buf, size_t size)
+{
+    snprintf(buf, size, "FastCGI workers: %d (started %d), requests: %lu, queued: %d\n",
+             pool->live, pool->spawned, pool->served, pool->pending);
+}
+
+void destroy_fcgi_pool(Fcgi_Pool *pool)
+{
+    for (int i = 0; i < pool->max; ++i)
+    {
+        Fcgi_Worker *worker = &pool->workers[i];
+        if (worker->pid == 0)
+            continue;
+        if (worker->fd >= 0)
+            retire_worker(pool, worker, 0);
+    }
+    while (pool->pending_head != NULL)
+    {
+        Fcgi_Pending *next = pool->pending_head->next;
+        free(pool->pending_head->msg);
+        free(pool->pending_head);
+        pool->pending_head = next;
+    }
+    free(pool->workers);
+    free(pool);
+}
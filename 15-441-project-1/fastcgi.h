@@ -0,0 +1,102 @@
+#ifndef _FASTCGI_H_
+#define _FASTCGI_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#define FCGI_FAILURE 2
+#define FCGI_MPX_MAX 16 // requests in flight on one worker connection
+
+// record types, FastCGI 1.0 section 8
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+
+// out is the script's stdout (CGI headers and body), NULL if the worker died
+typedef void (*fcgi_callback)(int client_fd, char *out, int len, void *arg);
+
+typedef struct
+{
+    int client_fd; // -1 once the client gave up on it
+    int in_use;
+    char *out;
+    int out_len;
+    unsigned long aborted; // ms, ABORT_REQUEST went out, 0 if not
+} Fcgi_Request;
+
+typedef struct
+{
+    pid_t pid;    // 0 if the slot is free
+    int fd;       // connection to the worker, -1 while it exits
+    int exited;   // the process is gone, nothing left to signal
+    int active;   // requests in flight
+    unsigned long idle_since; // ms
+    char *in_buf; // partial records
+    int in_len;
+    char *out_buf; // records the worker has not taken yet
+    int out_len;
+    Fcgi_Request requests[FCGI_MPX_MAX]; // request id is index + 1
+} Fcgi_Worker;
+
+typedef struct Fcgi_Pending
+{
+    int client_fd;
+    char *msg; // encoded records, request id filled in on dispatch
+    int len;
+    struct Fcgi_Pending *next;
+} Fcgi_Pending;
+
+typedef struct
+{
+    const char *app;
+    int min;
+    int max;
+    int mpx;
+    int idle_timeout;
+    int abort_timeout;    // ms an aborted request may keep its slot before the worker goes
+    Fcgi_Worker *workers; // max of them
+    int live;             // workers accepting requests
+    int max_fd;
+    fd_set *watch;       // the event loop's read set
+    fd_set *watch_write; // and its write set
+    fcgi_callback done;
+    void *arg;
+    Fcgi_Pending *pending_head; // all workers full, FIFO
+    Fcgi_Pending *pending_tail;
+    int pending;
+    int spawned;
+    unsigned long served;
+} Fcgi_Pool;
+
+Fcgi_Pool *create_fcgi_pool(const char *app, int min, int max, int mpx, int idle_timeout, int abort_timeout,
+                            fd_set *watch, fd_set *watch_write, fcgi_callback done, void *arg);
+
+int fcgi_submit(Fcgi_Pool *pool, int client_fd, char **envp, const char *body, int body_len);
+
+int fcgi_is_worker(Fcgi_Pool *pool, int fd);
+
+void fcgi_read(Fcgi_Pool *pool, int fd);
+
+void fcgi_write(Fcgi_Pool *pool, int fd);
+
+void fcgi_abort(Fcgi_Pool *pool, int client_fd);
+
+int fcgi_exited(Fcgi_Pool *pool, pid_t pid);
+
+void fcgi_maintain(Fcgi_Pool *pool);
+
+void fcgi_digest(Fcgi_Pool *pool, char *buf, size_t size);
+
+void destroy_fcgi_pool(Fcgi_Pool *pool);
+
+#endif
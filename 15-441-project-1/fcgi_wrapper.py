@@ -0,0 +1,209 @@
+#!/usr/bin/env python
+#
+# This script serves the same Flask application as wsgi_wrapper.py, but as
+# a long running FastCGI responder: lisod starts a few of these with a
+# listening Unix socket on fd 0 and sends them requests over a kept-alive
+# connection instead of starting an interpreter for every request.
+#
+# Requests on one connection may be multiplexed; each one runs in its own
+# thread and records of different requests are written whole.
+
+import os, sys, socket, struct, threading
+from io import BytesIO
+
+# From Flask: http://flask.pocoo.org/docs/quickstart/
+############### BEGIN FLASK QUICKSTART ##############
+from flask import Flask
+
+app = Flask(__name__)
+
+@app.route('/')
+def hello_world():
+    return 'Hello World!'
+################ END FLASK QUICKSTART ###############
+
+############### BEGIN FASTCGI RESPONDER ##############
+FCGI_BEGIN_REQUEST = 1
+FCGI_ABORT_REQUEST = 2
+FCGI_END_REQUEST   = 3
+FCGI_PARAMS        = 4
+FCGI_STDIN         = 5
+FCGI_STDOUT        = 6
+FCGI_STDERR        = 7
+FCGI_GET_VALUES    = 9
+FCGI_GET_VALUES_RESULT = 10
+FCGI_UNKNOWN_TYPE  = 11
+FCGI_KEEP_CONN     = 1
+FCGI_REQUEST_COMPLETE = 0
+FCGI_UNKNOWN_ROLE  = 3
+FCGI_RESPONDER     = 1
+FCGI_MAX_CONTENT   = 65535
+
+def read_exact(conn, n):
+    data = b''
+    while len(data) < n:
+        chunk = conn.recv(n - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return data
+
+def read_record(conn):
+    header = read_exact(conn, 8)
+    if header is None:
+        return None
+    version, rtype, rid, length, padding, _ = struct.unpack('!BBHHBB', header)
+    content = read_exact(conn, length + padding)
+    if content is None:
+        return None
+    return rtype, rid, content[:length]
+
+def decode_length(data, pos):
+    n = ord(data[pos:pos + 1])
+    if n < 128:
+        return n, pos + 1
+    return struct.unpack('!I', data[pos:pos + 4])[0] & 0x7fffffff, pos + 4
+
+def decode_params(data):
+    params = {}
+    pos = 0
+    while pos < len(data):
+        name_len, pos = decode_length(data, pos)
+        value_len, pos = decode_length(data, pos)
+        name = data[pos:pos + name_len].decode('latin-1')
+        pos += name_len
+        params[name] = data[pos:pos + value_len].decode('latin-1')
+        pos += value_len
+    return params
+
+def encode_params(params):
+    data = b''
+    for name, value in params.items():
+        for s in (name, value):
+            n = len(s)
+            data += struct.pack('!B', n) if n < 128 else struct.pack('!I', n | 0x80000000)
+        data += name.encode('latin-1') + value.encode('latin-1')
+    return data
+
+class Connection(object):
+    def __init__(self, conn):
+        self.conn = conn
+        self.lock = threading.Lock()
+        self.requests = {}
+
+    def send(self, rtype, rid, content=b''):
+        with self.lock:
+            # an empty record closes a stream, so split only what has data
+            offset = 0
+            while True:
+                chunk = content[offset:offset + FCGI_MAX_CONTENT]
+                self.conn.sendall(struct.pack('!BBHHBB', 1, rtype, rid, len(chunk), 0, 0) + chunk)
+                offset += len(chunk)
+                if offset >= len(content):
+                    break
+
+    def end(self, rid, app_status=0, protocol_status=FCGI_REQUEST_COMPLETE):
+        self.send(FCGI_END_REQUEST, rid, struct.pack('!IB3x', app_status, protocol_status))
+
+    def serve(self, application):
+        while True:
+            record = read_record(self.conn)
+            if record is None:
+                return
+            rtype, rid, content = record
+
+            if rtype == FCGI_GET_VALUES:
+                self.send(FCGI_GET_VALUES_RESULT, 0,
+                          encode_params({'FCGI_MAX_CONNS': '1', 'FCGI_MAX_REQS': '16',
+                                         'FCGI_MPXS_CONNS': '1'}))
+            elif rtype == FCGI_BEGIN_REQUEST:
+                role, flags = struct.unpack('!HB5x', content)
+                if role != FCGI_RESPONDER:
+                    self.end(rid, 0, FCGI_UNKNOWN_ROLE)
+                    continue
+                self.requests[rid] = {'params': b'', 'stdin': b'', 'aborted': False}
+            elif rtype == FCGI_ABORT_REQUEST and rid in self.requests:
+                self.requests[rid]['aborted'] = True
+            elif rtype == FCGI_PARAMS and rid in self.requests:
+                self.requests[rid]['params'] += content
+            elif rtype == FCGI_STDIN and rid in self.requests:
+                if content:
+                    self.requests[rid]['stdin'] += content
+                    continue
+                request = self.requests.pop(rid)
+                worker = threading.Thread(target=self.respond, args=(application, rid, request))
+                worker.daemon = True
+                worker.start()
+            elif rtype not in (FCGI_ABORT_REQUEST, FCGI_PARAMS, FCGI_STDIN):
+                self.send(FCGI_UNKNOWN_TYPE, 0, struct.pack('!B7x', rtype))
+
+    def respond(self, application, rid, request):
+        environ = decode_params(request['params'])
+        environ['wsgi.input']        = BytesIO(request['stdin'])
+        environ['wsgi.errors']       = sys.stderr
+        environ['wsgi.version']      = (1, 0)
+        environ['wsgi.multithread']  = True
+        environ['wsgi.multiprocess'] = True
+        environ['wsgi.run_once']     = False
+        if environ.get('HTTPS', 'off') in ('on', '1'):
+            environ['wsgi.url_scheme'] = 'https'
+        else:
+            environ['wsgi.url_scheme'] = 'http'
+
+        headers_set = []
+        headers_sent = []
+
+        def write(data):
+            if request['aborted']:
+                return
+            if isinstance(data, str):
+                data = data.encode('latin-1')
+            if not headers_sent:
+                status, response_headers = headers_sent[:] = headers_set
+                head = 'Status: %s\r\n' % status
+                for header in response_headers:
+                    head += '%s: %s\r\n' % header
+                data = (head + '\r\n').encode('latin-1') + data
+            if data:
+                self.send(FCGI_STDOUT, rid, data)
+
+        def start_response(status, response_headers, exc_info=None):
+            if exc_info:
+                try:
+                    if headers_sent:
+                        raise exc_info[1]
+                finally:
+                    exc_info = None
+            elif headers_set:
+                raise AssertionError("Headers already set!")
+            headers_set[:] = [status, response_headers]
+            return write
+
+        try:
+            result = application(environ, start_response)
+            try:
+                for data in result:
+                    if data:
+                        write(data)
+                if not headers_sent:
+                    write(b'')
+            finally:
+                if hasattr(result, 'close'):
+                    result.close()
+        except Exception as e:
+            self.send(FCGI_STDERR, rid, ('%s\n' % e).encode('latin-1'))
+            if not headers_sent:
+                self.send(FCGI_STDOUT, rid, b'Status: 500 Internal Server Error\r\n\r\n')
+        self.send(FCGI_STDOUT, rid)
+        self.end(rid)
+
+def run_with_fastcgi(application):
+    listener = socket.fromfd(0, socket.AF_UNIX, socket.SOCK_STREAM)
+    while True:
+        conn, _ = listener.accept()
+        Connection(conn).serve(application)
+        conn.close()
+############### END FASTCGI RESPONDER ##############
+
+if __name__ == '__main__':
+    run_with_fastcgi(app)
@@ -1,3 +1,5 @@
+#include <unistd.h>
+
 #include "hash_table.h"
 
 Table *create_table(int size)
@@ -9,6 +11,9 @@ Table *create_table(int size)
     {
         t->list[i] = NULL;
     }
+    t->idle_head = NULL;
+    t->idle_tail = NULL;
+    t->idle_count = 0;
     return t;
 }
 
@@ -26,28 +31,22 @@ int hashCodeMap(Map *map, int key)
     return key % map->size;
 }
 
+// a connection's state with everything idle and empty
+static Node *new_node(int key, struct sockaddr *val, int connection, SSL *client_context)
+{
+    Node *node = (Node *)calloc(1, sizeof(Node));
+    node->key = key;
+    node->val = val;
+    node->connection = connection;
+    node->send_file = -1;
+    node->tls_state = client_context != NULL ? TLS_HANDSHAKE : TLS_NONE;
+    node->client_context = client_context;
+    return node;
+}
+
 void insert_table(Table *t, int key, struct sockaddr *val, int connection)
 {
-    int pos = hashCode(t, key);
-    Node *list = t->list[pos];
-    Node *temp = list;
-    while (temp)
-    {
-        if (temp->key == key)
-        {
-            temp->val = val;
-            return;
-        }
-        temp = temp->next;
-    }
-    Node *newNode = (Node *)malloc(sizeof(Node));
-    newNode->key = key;
-    newNode->val = val;
-    newNode->connection = connection;
-    newNode->next = list;
-    newNode->is_cgi = 0;
-    newNode->client_context = NULL;
-    t->list[pos] = newNode;
+    insert_table_with_context(t, key, val, connection, NULL);
 }
 
 void insert_table_with_context(Table *t, int key, struct sockaddr *val, int connection, SSL *client_context)
@@ -64,13 +63,8 @@ void insert_table_with_context(Table *t, int key, struct sockaddr *val, int conn
         }
         temp = temp->next;
     }
-    Node *newNode = (Node *)malloc(sizeof(Node));
-    newNode->key = key;
-    newNode->val = val;
-    newNode->connection = connection;
+    Node *newNode = new_node(key, val, connection, client_context);
     newNode->next = list;
-    newNode->is_cgi = 0;
-    newNode->client_context = client_context;
     t->list[pos] = newNode;
 }
 
@@ -138,6 +132,22 @@ int lookup_table_cgi(Table *t, int key)
     return -1;
 }
 
+Node *lookup_table_node(Table *t, int key)
+{
+    int pos = hashCode(t, key);
+    Node *list = t->list[pos];
+    Node *temp = list;
+    while (temp)
+    {
+        if (temp->key == key)
+        {
+            return temp;
+        }
+        temp = temp->next;
+    }
+    return NULL;
+}
+
 SSL *lookup_table_context(Table *t, int key)
 {
     int pos = hashCode(t, key);
@@ -154,6 +164,56 @@ SSL *lookup_table_context(Table *t, int key)
     return NULL;
 }
 
+static void unlink_idle(Table *t, Node *node)
+{
+    if (!node->is_idle)
+        return;
+    if (node->idle_prev != NULL)
+        node->idle_prev->idle_next = node->idle_next;
+    else
+        t->idle_head = node->idle_next;
+    if (node->idle_next != NULL)
+        node->idle_next->idle_prev = node->idle_prev;
+    else
+        t->idle_tail = node->idle_prev;
+    node->idle_prev = NULL;
+    node->idle_next = NULL;
+    node->is_idle = 0;
+    t->idle_count--;
+}
+
+void mark_idle(Table *t, int key)
+{
+    Node *node = lookup_table_node(t, key);
+    if (node == NULL)
+        return;
+    // move to the back, it is now the most recently idle one
+    unlink_idle(t, node);
+    node->idle_prev = t->idle_tail;
+    node->idle_next = NULL;
+    if (t->idle_tail != NULL)
+        t->idle_tail->idle_next = node;
+    else
+        t->idle_head = node;
+    t->idle_tail = node;
+    node->is_idle = 1;
+    t->idle_count++;
+}
+
+void mark_busy(Table *t, int key)
+{
+    Node *node = lookup_table_node(t, key);
+    if (node != NULL)
+        unlink_idle(t, node);
+}
+
+int oldest_idle(Table *t)
+{
+    if (t->idle_head == NULL)
+        return -1;
+    return t->idle_head->key;
+}
+
 void remove_table(Table *t, int key)
 {
     int pos = hashCode(t, key);
@@ -170,7 +230,16 @@ void remove_table(Table *t, int key)
                 pre_temp->next = temp->next;
             else
                 t->list[pos] = temp->next;
+            unlink_idle(t, temp);
             free(temp->val);
+            if (temp->in_buf != NULL)
+                free(temp->in_buf);
+            if (temp->out_buf != NULL)
+                free(temp->out_buf);
+            if (temp->send_file != -1)
+                close(temp->send_file);
+            if (temp->request_line != NULL)
+                free(temp->request_line);
             if (temp->client_context != NULL)
             {
                 SSL_shutdown(temp->client_context);
@@ -228,6 +297,7 @@ void insert_map(Map *map, int key, int sock)
     Map_Node *newNode = (Map_Node *)malloc(sizeof(Map_Node));
     newNode->key = key;
     newNode->sock = sock;
+    newNode->next = list;
 
     map->list[pos] = newNode;
 }
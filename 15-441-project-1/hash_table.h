@@ -5,13 +5,55 @@
 
 #include <openssl/ssl.h>
 
+#include "tls.h"
+#include "trace.h"
+
+// where an HTTPS connection is in its TLS setup
+enum
+{
+    TLS_NONE = 0, // plain HTTP
+    TLS_HANDSHAKE,
+    TLS_OFFLOADED, // a worker thread owns the SSL for now
+    TLS_ABORTED,   // timed out while offloaded, close once it is back
+    TLS_ESTABLISHED
+};
+
 typedef struct Node
 {
     int key;
     int connection; // 0 HTTP, 1 HTTPS
     int is_cgi;     // 0 false, 1 true
+    int cgi_pid;    // running CGI child, 0 if none
+    int cgi_fd;     // stdout pipe of that child, 0 if none
+    int cgi_stdin;  // stdin pipe of that child, -1 once it stopped reading
+    long body_left; // request body bytes still to pass to it
+    int cgi_relay;  // 1 once the script's headers went out
+    long cgi_left;  // body bytes the script still owes, -1 until EOF
+    int cgi_close;  // close the connection after the body
+    char *out_buf;  // output the client has not taken yet, from out_off on
+    int out_off;
+    int out_len;
+    int out_retry;  // length of an SSL_write() to repeat, 0 if none
+    int send_file;  // file of a reply still going out behind out_buf, -1 if none
+    long send_offset;
+    long send_end;
+    int send_close; // close once the reply is out
+    struct Cache_Entry *cache_fill; // cached response its script fills, NULL if none
+    struct Proxy_Conn *proxy;       // upstream connection answering it, NULL if none
+    unsigned long request_start;    // us, the request being served came in whole
+    char *request_line;             // of a request answered later, logged with its answer, NULL if none
+    Request_Phases phases;          // of the request being served
+    char *in_buf;   // bytes received but not yet served
+    int in_len;
+    int requests;   // requests served on this connection
     struct sockaddr *val;
     struct Node *next;
+    struct Node *idle_prev; // idle keep-alive connections, oldest first
+    struct Node *idle_next;
+    int is_idle;
+    int tls_state;
+    unsigned long handshake_start; // microseconds, monotonic
+    Tls_Records records;
     SSL *client_context;
 } Node;
 
@@ -19,6 +61,9 @@ typedef struct
 {
     int size;
     Node **list;
+    Node *idle_head;
+    Node *idle_tail;
+    int idle_count;
 } Table;
 
 typedef struct Map_Node
@@ -50,6 +95,14 @@ int lookup_table_cgi(Table *t, int key);
 
 SSL *lookup_table_context(Table *t, int key);
 
+Node *lookup_table_node(Table *t, int key);
+
+void mark_idle(Table *t, int key);
+
+void mark_busy(Table *t, int key);
+
+int oldest_idle(Table *t);
+
 void remove_table(Table *t, int key);
 
 void remove_all_entries_in_table(Table *t);
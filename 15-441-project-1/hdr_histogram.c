@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "hdr_histogram.h"
+
+static int bucket_of(unsigned long value)
+{
+    if (value < HDR_SUB)
+        return value;
+    if (value >> HDR_MAX_BITS)
+        value = (1UL << HDR_MAX_BITS) - 1;
+    int shift = 63 - __builtin_clzl(value) - (HDR_SUB_BITS - 1);
+    return shift * (HDR_SUB / 2) + (value >> shift);
+}
+
+// highest value counted in bucket
+unsigned long hdr_bucket_value(int bucket)
+{
+    if (bucket < HDR_SUB)
+        return bucket;
+    int shift = bucket / (HDR_SUB / 2) - 1;
+    unsigned long sub = bucket % (HDR_SUB / 2) + HDR_SUB / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hdr_init(Hdr_Histogram *h)
+{
+    memset(h, 0, sizeof(Hdr_Histogram));
+    h->min = ~0UL;
+}
+
+void hdr_record(Hdr_Histogram *h, unsigned long value)
+{
+    h->counts[bucket_of(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value < h->min)
+        h->min = value;
+    if (value > h->max)
+        h->max = value;
+}
+
+void hdr_merge(Hdr_Histogram *into, const Hdr_Histogram *from)
+{
+    for (int b = 0; b < HDR_BUCKETS; ++b)
+        into->counts[b] += from->counts[b];
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+/**
+ * hdr_record() for a histogram that other threads read, or record into, at
+ * the same time: every field is updated with a relaxed atomic
+ */
+void hdr_record_atomic(Hdr_Histogram *h, unsigned long value)
+{
+    __atomic_fetch_add(&h->counts[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+    unsigned long seen = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+    while (value < seen && !__atomic_compare_exchange_n(&h->min, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    seen = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(&h->max, &seen, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// hdr_merge() from a histogram recorded into with hdr_record_atomic()
+void hdr_merge_atomic(Hdr_Histogram *into, const Hdr_Histogram *from)
+{
+    for (int b = 0; b < HDR_BUCKETS; ++b)
+        into->counts[b] += __atomic_load_n(&from->counts[b], __ATOMIC_RELAXED);
+    into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    unsigned long min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (min < into->min)
+        into->min = min;
+    if (max > into->max)
+        into->max = max;
+}
+
+/**
+ * upper bound of the bucket holding the given percentile (0-100), never
+ * above the largest value recorded
+ */
+unsigned long hdr_percentile(const Hdr_Histogram *h, double percentile)
+{
+    if (h->count == 0)
+        return 0;
+
+    unsigned long rank = (unsigned long)(h->count * percentile / 100.0 + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    unsigned long seen = 0;
+    for (int b = 0; b < HDR_BUCKETS; ++b)
+    {
+        seen += h->counts[b];
+        if (seen >= rank)
+        {
+            unsigned long upper = hdr_bucket_value(b);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,41 @@
+#ifndef _HDR_HISTOGRAM_H_
+#define _HDR_HISTOGRAM_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * A high dynamic range histogram: values below HDR_SUB are counted exactly,
+ * above that every power of two is split into HDR_SUB / 2 linear buckets,
+ * so any percentile is within 1 / 64 of the value recorded.
+ */
+
+#define HDR_SUB_BITS 7
+#define HDR_SUB (1 << HDR_SUB_BITS)
+#define HDR_MAX_BITS 48 // larger values are counted as 2^48 - 1
+#define HDR_BUCKETS ((HDR_MAX_BITS - HDR_SUB_BITS + 2) * (HDR_SUB / 2))
+
+typedef struct
+{
+    unsigned long counts[HDR_BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+    unsigned long min;
+    unsigned long max;
+} Hdr_Histogram;
+
+void hdr_init(Hdr_Histogram *h);
+
+void hdr_record(Hdr_Histogram *h, unsigned long value);
+
+void hdr_merge(Hdr_Histogram *into, const Hdr_Histogram *from);
+
+void hdr_record_atomic(Hdr_Histogram *h, unsigned long value);
+
+void hdr_merge_atomic(Hdr_Histogram *into, const Hdr_Histogram *from);
+
+unsigned long hdr_percentile(const Hdr_Histogram *h, double percentile);
+
+unsigned long hdr_bucket_value(int bucket);
+
+#endif
@@ -0,0 +1,53 @@
+#include "histogram.h"
+
+static int bucket_of(unsigned long value)
+{
+    int b = 0;
+    while (value != 0 && b < HISTOGRAM_BUCKETS - 1)
+    {
+        value >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void histogram_record(Histogram *h, unsigned long value)
+{
+    h->buckets[bucket_of(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+/**
+ * upper bound of the bucket holding the given percentile (0-100)
+ */
+unsigned long histogram_percentile(Histogram *h, double percentile)
+{
+    if (h->count == 0)
+        return 0;
+
+    unsigned long rank = (unsigned long)(h->count * percentile / 100.0 + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    unsigned long seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+    {
+        seen += h->buckets[b];
+        if (seen >= rank)
+        {
+            unsigned long upper = b == 0 ? 0 : (1UL << b) - 1;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+void histogram_digest(Histogram *h, const char *name, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s count: %lu, mean: %lu, p50: %lu, p99: %lu, max: %lu\n",
+             name, h->count, h->count == 0 ? 0 : h->sum / h->count,
+             histogram_percentile(h, 50), histogram_percentile(h, 99), h->max);
+}
@@ -0,0 +1,23 @@
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HISTOGRAM_BUCKETS 64 // bucket i counts values in [2^(i-1), 2^i)
+
+typedef struct
+{
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+} Histogram;
+
+void histogram_record(Histogram *h, unsigned long value);
+
+unsigned long histogram_percentile(Histogram *h, double percentile);
+
+void histogram_digest(Histogram *h, const char *name, char *buf, size_t size);
+
+#endif
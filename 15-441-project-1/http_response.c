@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <strings.h>
+
+#include "http_response.h"
+
+#define MAX_HEAD 65536 // response headers larger than this are garbage
+
+/**
+ * length of the complete chunked body at the start of buf, -1 while it is
+ * incomplete
+ */
+static long chunked_length(const char *buf, long len)
+{
+    long at = 0;
+    for (;;)
+    {
+        const char *eol = memmem(buf + at, len - at, "\r\n", 2);
+        if (eol == NULL)
+            return -1;
+        long size = strtol(buf + at, NULL, 16);
+        at = eol + 2 - buf;
+        if (size == 0)
+        {
+            // trailer lines up to the blank one
+            for (;;)
+            {
+                eol = memmem(buf + at, len - at, "\r\n", 2);
+                if (eol == NULL)
+                    return -1;
+                int blank = eol == buf + at;
+                at = eol + 2 - buf;
+                if (blank)
+                    return at;
+            }
+        }
+        at += size + 2;
+        if (at > len)
+            return -1;
+    }
+}
+
+/**
+ * find where the response at the start of buf ends. head: it answers a
+ * HEAD request. eof: the server closed, which ends a body without a
+ * length. 1 with res filled in once it is complete (an interim 1xx counts
+ * as one), 0 while it is not, -1 if it is not HTTP.
+ */
+int http_response_frame(const char *buf, long len, int head, int eof, Http_Response *res)
+{
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return len > MAX_HEAD ? -1 : 0;
+    if (len < 12 || strncmp(buf, "HTTP/", 5) != 0)
+        return -1;
+    res->code = atoi(buf + 9);
+    res->head_len = end + 4 - buf;
+    res->close = 0;
+
+    long length = -1;
+    int chunked = 0;
+    // header lines after the status line
+    for (const char *line = memchr(buf, '\n', end - buf); line != NULL && line < end;
+         line = memchr(line, '\n', end + 2 - line))
+    {
+        line++;
+        const char *eol = memchr(line, '\r', end + 2 - line);
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            length = atol(line + 15);
+        else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0)
+            chunked = memmem(line, eol - line, "chunked", 7) != NULL;
+        else if (strncasecmp(line, "Connection:", 11) == 0 && memmem(line, eol - line, "close", 5) != NULL)
+            res->close = 1;
+    }
+    if (head || res->code == 204 || res->code == 304 || (res->code >= 100 && res->code < 200))
+        length = 0;
+    else if (chunked)
+    {
+        length = chunked_length(end + 4, len - res->head_len);
+        if (length < 0)
+            return 0;
+    }
+    else if (length < 0)
+    {
+        // the body runs until the server closes
+        if (!eof)
+            return 0;
+        length = len - res->head_len;
+        res->close = 1;
+    }
+    if (res->head_len + length > len)
+        return 0;
+    res->length = res->head_len + length;
+    return 1;
+}
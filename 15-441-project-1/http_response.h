@@ -0,0 +1,18 @@
+#ifndef _HTTP_RESPONSE_H_
+#define _HTTP_RESPONSE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// the first response in a client's read buffer, as the tools see it
+typedef struct
+{
+    int code;
+    long head_len; // status line and headers
+    long length;   // all of it, body included
+    int close;     // the server closes the connection after it
+} Http_Response;
+
+int http_response_frame(const char *buf, long len, int head, int eof, Http_Response *res);
+
+#endif
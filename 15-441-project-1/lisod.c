@@ -10,8 +10,11 @@
 *                                                                             *
 *******************************************************************************/
 
+#define _GNU_SOURCE
+
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,10 +28,30 @@
 #include <signal.h>
 #include <syslog.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <openssl/err.h>
 
 #include "log.h"
 #include "parse.h"
 #include "hash_table.h"
+#include "config.h"
+#include "timer_wheel.h"
+#include "tls.h"
+#include "thread_pool.h"
+#include "fastcgi.h"
+#include "zygote.h"
+#include "cgi_limit.h"
+#include "cgi_cache.h"
+#include "reaper.h"
+#include "cgi_env.h"
+#include "plugin.h"
+#include "proxy.h"
+#include "metrics.h"
+#include "trace.h"
+#include "shm_stats.h"
+#include "watchdog.h"
 
 #define HEADER_BUF_SIZE 8192
 #define TABLE_SIZE 1024
@@ -37,13 +60,39 @@
 #define MAX(x, y) x < y ? y : x
 #define WAIT 5
 #define CLOSE_SOCKET_FAILURE 2
+#define RELAY_ROUNDS 16    // CGI pipe reads per event, so one script cannot hog the loop
+#define RELAY_CHUNK 65536 // bytes spliced at a time
+#define REQUEST_TOO_LARGE -2  // request_length(): Content-Length over max_body_size
+#define REQUEST_BAD_LENGTH -3 // or one that is no length at all
+#define BUSY_REPLY "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
 
 int num_client = 0;
+int fd_limit = MAX_CLIENT;
+int spare_fd = -1; // given up to turn a client away once fds run out
 int sock = 0;
 int client_sock = 0;
 int https_sock = 0;
 Table *table;
 Map *map;
+Timer_Wheel *timers;
+Thread_Pool *tls_pool; // runs the handshake crypto, NULL if inline
+Fcgi_Pool *fcgi;       // long running CGI workers, NULL for classic CGI only
+Cgi_Limiter *cgi_limiter; // classic CGI scripts running at once
+Cgi_Cache *cgi_cache;     // NULL unless cgi_cache_size is set
+Reaper *reaper;           // collects exited children
+Cgi_Env *cgi_env;         // builds CGI environments
+Plugin_Host *plugins;     // native handlers, NULL if none are loaded
+Proxy *proxy;             // upstream app servers, NULL if none
+Metrics *metrics;         // NULL unless metrics_uri is set
+Tracer *tracer;           // NULL unless trace_file is set
+Shm_Stats *shm_stats;     // NULL unless stats_shm is set
+Shm_Worker *loop_stats;   // the event loop's slot in it
+int in_flight;            // requests read and not answered yet
+Watchdog *watchdog;       // NULL unless stall_threshold is set
+fd_set *readfds;
+fd_set *writefds;
+fd_set ready_fds; // clients with a whole request buffered, served next round
+int ready_count;
 SSL_CTX *ssl_context;
 int http_port;
 int https_port;
@@ -99,10 +148,109 @@ void lisod_cleanup()
         close_socket_main();
     if (https_sock != 0)
         close_socket_https();
+    if (spare_fd >= 0)
+    {
+        close(spare_fd);
+        spare_fd = -1;
+    }
+    if (watchdog != NULL)
+    {
+        char digest[SIZE];
+        watchdog_digest(watchdog, digest, SIZE);
+        printf("%s", digest);
+        destroy_watchdog(watchdog);
+        watchdog = NULL;
+    }
+    // workers may still be using SSL objects owned by the table
+    if (tls_pool != NULL)
+    {
+        destroy_thread_pool(tls_pool);
+        tls_pool = NULL;
+    }
+    if (fcgi != NULL)
+    {
+        char digest[SIZE];
+        fcgi_digest(fcgi, digest, SIZE);
+        printf("%s", digest);
+        destroy_fcgi_pool(fcgi);
+        fcgi = NULL;
+    }
+    if (plugins != NULL)
+    {
+        char digest[SIZE];
+        plugin_digest(plugins, digest, SIZE);
+        printf("%s", digest);
+        destroy_plugin_host(plugins);
+        plugins = NULL;
+    }
+    if (proxy != NULL)
+    {
+        char digest[SIZE];
+        proxy_digest(proxy, digest, SIZE);
+        printf("%s", digest);
+        destroy_proxy(proxy);
+        proxy = NULL;
+    }
+    if (metrics != NULL)
+    {
+        destroy_metrics(metrics);
+        metrics = NULL;
+    }
+    if (shm_stats != NULL)
+    {
+        destroy_shm_stats(shm_stats);
+        shm_stats = NULL;
+        loop_stats = NULL;
+    }
+    if (tracer != NULL)
+    {
+        char digest[SIZE];
+        tracer_digest(tracer, digest, SIZE);
+        printf("%s", digest);
+        destroy_tracer(tracer);
+        tracer = NULL;
+    }
+    if (cgi_limiter != NULL)
+    {
+        char digest[SIZE];
+        cgi_limit_digest(cgi_limiter, digest, SIZE);
+        printf("%s", digest);
+        destroy_cgi_limiter(cgi_limiter);
+        cgi_limiter = NULL;
+    }
+    if (cgi_cache != NULL)
+    {
+        char digest[SIZE];
+        cgi_cache_digest(cgi_cache, digest, SIZE);
+        printf("%s", digest);
+        destroy_cgi_cache(cgi_cache);
+        cgi_cache = NULL;
+    }
+    if (reaper != NULL)
+    {
+        char digest[SIZE];
+        reaper_digest(reaper, digest, SIZE);
+        printf("%s", digest);
+        destroy_reaper(reaper);
+        reaper = NULL;
+    }
+    if (cgi_env != NULL)
+    {
+        destroy_cgi_env(cgi_env);
+        cgi_env = NULL;
+    }
     remove_all_entries_in_table(table);
     destroy_map(map);
+    if (timers != NULL)
+    {
+        destroy_timer_wheel(timers);
+        timers = NULL;
+    }
     if (ssl_context != NULL)
     {
+        char digest[SIZE];
+        tls_stats_digest(digest, SIZE);
+        printf("%s", digest);
         SSL_CTX_free(ssl_context);
         ssl_context = NULL;
     }
@@ -150,19 +298,38 @@ void signal_handler(int sig)
     }
 }
 
-void sig_child_handler(int sig, siginfo_t *info, void *ucontext)
+/**
+ * a CGI script exited: record -1 in the cgi field of its client, the
+ * select() loop answers it if the script did not
+ */
+void cgi_exited(pid_t pid, int status)
 {
-    // TODO find the client_sock corresponding to this pid
-    // and then record -1 in table cgi field
-    int pid = info->si_pid;
+    reaper_done(reaper, pid, status);
 
     int next_sock = lookup_map(map, pid);
 
+    // its client was answered or is gone
+    if (next_sock == -1)
+        return;
+
     insert_cgi(table, next_sock, -1);
 
     remove_map(map, pid);
 }
 
+/**
+ * a child of ours was reaped: FastCGI workers and the zygote go back to
+ * their owners, everything else is a CGI script we forked
+ */
+void child_exited(pid_t pid, int status)
+{
+    if (fcgi != NULL && fcgi_exited(fcgi, pid))
+        return;
+    if (zygote_exited(pid))
+        return;
+    cgi_exited(pid, status);
+}
+
 /** 
  * internal function daemonizing the process
  */
@@ -199,7 +366,7 @@ int daemonize(char *lock_file, Log *log)
     sprintf(str, "%d\n", getpid());
     write(lfp, str, strlen(str)); /* record pid to lockfile */
 
-    signal(SIGCHLD, SIG_IGN); /* child terminate signal */
+    /* SIGCHLD stays blocked, children are collected through the reaper */
 
     signal(SIGHUP, signal_handler);  /* hangup signal */
     signal(SIGTERM, signal_handler); /* software termination signal from kill */
@@ -253,15 +420,65 @@ int check_uri(char *uri)
     return lenstr < lenpre ? 0 : memcmp(pre, uri, lenpre) == 0;
 }
 
-Response *handle_request(Request *request, int pre_assigned_code, const char *www_folder)
+/**
+ * whether a CGI URI still gets a fork()/execve() of its own, either
+ * because there is no FastCGI pool or because the route asks for it
+ */
+int classic_cgi_route(char *uri)
+{
+    if (fcgi == NULL || config.cgi_classic == NULL)
+        return fcgi == NULL;
+
+    const char *pre = config.cgi_classic;
+    while (*pre != '\0')
+    {
+        size_t lenpre = strcspn(pre, ",");
+        if (lenpre > 0 && strncmp(uri, pre, lenpre) == 0)
+            return 1;
+        pre += lenpre;
+        if (*pre == ',')
+            pre++;
+    }
+    return 0;
+}
+
+/**
+ * whether the request at the start of buf goes to a classic CGI script or
+ * an upstream, which get it as soon as the headers are in and read the
+ * body as the client sends it
+ */
+int streams_body(char *buf, int len)
+{
+    char uri[HEADER_BUF_SIZE];
+    char *start = memchr(buf, ' ', len);
+    if (start == NULL)
+        return 0;
+    start++;
+    char *end = memchr(start, ' ', buf + len - start);
+    if (end == NULL || end - start >= HEADER_BUF_SIZE)
+        return 0;
+    memcpy(uri, start, end - start);
+    uri[end - start] = 0;
+    if (plugins != NULL && plugin_route(plugins, uri) >= 0)
+        return 0;
+    if (proxy != NULL && proxy_route(proxy, uri) >= 0)
+        return 1;
+    return check_uri(uri) && classic_cgi_route(uri);
+}
+
+/**
+ * requests_left: how many more requests the connection may make after this
+ * one, -1 for no limit. At 0 the response closes the connection.
+ */
+Response *handle_request(Request *request, int pre_assigned_code, const char *www_folder, int requests_left)
 {
     printf("Parsing succeeded!\n");
 
     int code;
     int sz = 0;
     int close = 1; // default not close
+    int file_fd = -1;
     char *phrase = NULL;
-    char *content = NULL;
     char *header = malloc(BUF_SIZE);
     bzero(header, BUF_SIZE);
     struct stat *info = NULL;
@@ -282,6 +499,10 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
             code = 411;
             phrase = "Length Required";
             break;
+        case 413:
+            code = 413;
+            phrase = "Payload Too Large";
+            break;
         case 400:
             code = 400;
             phrase = "Bad Request";
@@ -289,9 +510,19 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
         case 503:
             code = 503;
             phrase = "Service Unavailable";
+            break;
         case 500:
             code = 500;
             phrase = "Internal Server Error";
+            break;
+        case 502:
+            code = 502;
+            phrase = "Bad Gateway";
+            break;
+        case 504:
+            code = 504;
+            phrase = "Gateway Timeout";
+            break;
         case 0:
             break;
         default:
@@ -311,7 +542,8 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
     }
 
     // ********** CGI ***********
-    else if (check_uri(request->http_uri))
+    else if (check_uri(request->http_uri) || (plugins != NULL && plugin_route(plugins, request->http_uri) >= 0) ||
+             (proxy != NULL && proxy_route(proxy, request->http_uri) >= 0))
     {
         free(header);
         return NULL; // pass to the other handler
@@ -383,37 +615,15 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
 
         printf("Reached point 1. code: %d\n", code);
 
-        // read the file
-
-        FILE *file = fopen(uri_buf, "r");
-
-        if (code != 404 && file == NULL)
-        {
-            code = 500;
-            phrase = "Internal Server Error";
-        }
-        // get the size of the file
+        // open the file. Its content is not read here, send_reply()
+        // hands it to the socket straight from the page cache.
+        // Do not send content while HEAD
 
         if (code == 200)
         {
-            if (fseek(file, 0L, SEEK_END) == -1)
-            {
-                code = 500;
-                phrase = "Internal Server Error";
-            }
-        }
-        if (code == 200)
-        {
-            sz = ftell(file);
-            if (sz == -1)
-            {
-                code = 500;
-                phrase = "Internal Server Error";
-            }
-        }
-        if (code == 200)
-        {
-            if (fseek(file, 0L, SEEK_SET) == -1)
+            sz = info->st_size;
+            if (strcmp(request->http_method, "GET") == 0 &&
+                (file_fd = open(uri_buf, O_RDONLY)) == -1)
             {
                 code = 500;
                 phrase = "Internal Server Error";
@@ -422,47 +632,6 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
         if (code != 200)
             sz = 0;
 
-        printf("Reached point 2. code: %d, sz: %d\n", code, sz);
-
-        // Process the request by getting the content
-        // Do not get content while HEAD
-
-        if (strcmp(request->http_method, "GET") == 0 && code == 200)
-        {
-            // create the buffer
-            content = (char *)malloc(sz + 1);
-            bzero(content, sz + 1);
-            printf("sz: %d\n", sz);
-
-            // read everything into the buffer
-            char symbol;
-            int i;
-            if (file != NULL)
-            {
-                printf("Start passing file here!");
-                for (i = 0; i < sz; i++)
-                {
-                    symbol = getc(file);
-                    content[i] = symbol;
-                    printf("%c ", symbol);
-                }
-                printf("\n");
-            }
-            if (ferror(file))
-            {
-                code = 500;
-                phrase = "Internal Server Error";
-                printf("i: %d Ferror!\n", i);
-            }
-        }
-        if (file != NULL)
-            if (fclose(file) != 0)
-            {
-                printf("I am there!\n");
-                code = 500;
-                phrase = "Internal Server Error";
-            }
-
         printf("Reached point 3. code: %d, sz: %d\n", code, sz);
     }
 
@@ -540,14 +709,6 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
         phrase = "Not Implemented";
     }
 
-    // clear up content pointer
-    if (code != 200 && content != NULL)
-    {
-        free(content);
-        content = NULL;
-        sz = 0;
-    }
-
     printf("reached point 4. code: %d\n", code);
 
     // returns: HTTP-Version SP Status-Code SP Reason-Phrase CRLF
@@ -584,11 +745,14 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
     {
         close = 1;
     }
-    else if (code == 500 || code == 505 || code == 408 || code == 503)
+    else if (code == 500 || code == 505 || code == 408 || code == 413 || code == 503 || code == 502 || code == 504)
     {
         // 500 error, close connection
         // 505 wrong version, close connection
         // 408 timeout
+        // 413 body too large, it is not read
+        // 502 FastCGI worker died
+        // 504 CGI timeout
         close = 0;
     }
     else if (request == NULL)
@@ -613,16 +777,38 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
             tmp++;
         }
     }
+    if (close == 1 && requests_left == 0)
+        close = 0;
     if (close == 0)
         strcat(header, "close");
     else
-        strcat(header, "keep-alive");
+    {
+        // advertise the policy so clients know when to stop reusing us
+        char keep_alive[64];
+        // in whole seconds, rounded up so a short timeout does not read as 0
+        int timeout = (config.keepalive_timeout + 999) / 1000;
+        if (timeout < 1)
+            timeout = 1;
+        if (requests_left > 0)
+            sprintf(keep_alive, "keep-alive\r\nKeep-Alive: timeout=%d, max=%d", timeout, requests_left);
+        else
+            sprintf(keep_alive, "keep-alive\r\nKeep-Alive: timeout=%d", timeout);
+        strcat(header, keep_alive);
+    }
 
     // 3. Server
 
     strcat(header, "\r\n");
     strcat(header, "Server: Liso/1.0\r\n");
 
+    // overloaded, tell the client when to come back
+    if (code == 503)
+    {
+        char retry_after[64];
+        sprintf(retry_after, "Retry-After: %d\r\n", config.cgi_retry_after);
+        strcat(header, retry_after);
+    }
+
     // 4. Content-Length
 
     strcat(header, "Content-Length: ");
@@ -700,27 +886,23 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
     char chr[BUF_SIZE];
     bzero(chr, BUF_SIZE);
     sprintf(chr, "HTTP/1.1 %d %s\r\n", code, phrase);
-    char *final_buf = (char *)malloc(sz + strlen(header) + strlen(chr) + 1);
-    bzero(final_buf, sz + strlen(header) + strlen(chr) + 1);
+    char *final_buf = (char *)malloc(strlen(header) + strlen(chr) + 1);
+    bzero(final_buf, strlen(header) + strlen(chr) + 1);
     strncpy(final_buf, chr, strlen(chr));
     strncat(final_buf, header, strlen(header));
 
     printf("final_buf: %s\n", final_buf);
 
-    for (int i = 0; i < sz; ++i)
-    {
-        final_buf[i + strlen(header) + strlen(chr)] = content[i];
-    }
-
+    // the body, if any, follows from file_fd
     response->buf = final_buf;
     response->size = sz;
-    response->real_size = sz + strlen(header) + strlen(chr);
+    response->real_size = strlen(header) + strlen(chr);
     response->code = code;
+    response->file_fd = file_fd;
+    response->file_size = file_fd == -1 ? 0 : sz;
     printf("response size: %ld\n", response->size);
     response->close = close;
     free(header);
-    if (content != NULL)
-        free(content);
 
     printf("Just before response\n");
 
@@ -728,6 +910,332 @@ Response *handle_request(Request *request, int pre_assigned_code, const char *ww
     return response;
 }
 
+/**
+ * count a response of code going out to client fd, and how long its
+ * request took to get there
+ */
+void count_response(int fd, int code)
+{
+    Node *node = lookup_table_node(table, fd);
+    int answered = node != NULL && node->request_start != 0;
+    if (metrics != NULL)
+    {
+        metrics_status(metrics, code);
+        if (answered)
+            metrics_observe(metrics, MET_REQUEST_US, timer_now_us() - node->request_start);
+    }
+    if (loop_stats != NULL)
+    {
+        shm_count(loop_stats, SHM_RESPONSES, 1);
+        if (code >= 400)
+            shm_count(loop_stats, code >= 500 ? SHM_RESPONSES_5XX : SHM_RESPONSES_4XX, 1);
+    }
+    if (answered)
+    {
+        node->request_start = 0;
+        in_flight--;
+    }
+}
+
+// the client of fd is gone, along with the answer it was waiting for
+void drop_request(int fd)
+{
+    Node *node = lookup_table_node(table, fd);
+    if (node != NULL && node->request_start != 0)
+    {
+        node->request_start = 0;
+        in_flight--;
+    }
+}
+
+void count_bytes_sent(long n)
+{
+    if (n <= 0)
+        return;
+    if (metrics != NULL)
+        metrics_count(metrics, MET_BYTES_SENT, n);
+    if (loop_stats != NULL)
+        shm_count(loop_stats, SHM_BYTES_SENT, n);
+}
+
+// what the loop is up to, for lisod_top
+void publish_stats(int busy)
+{
+    shm_heartbeat(loop_stats, busy, timer_now_us());
+    if (busy)
+        return;
+    shm_gauge(loop_stats, SHM_CONNECTIONS, num_client);
+    shm_gauge(loop_stats, SHM_IDLE, table->idle_count);
+    shm_gauge(loop_stats, SHM_IN_FLIGHT, in_flight);
+    shm_gauge(loop_stats, SHM_CGI_RUNNING, cgi_limiter->running);
+    shm_gauge(loop_stats, SHM_CGI_QUEUED, cgi_limiter->queued);
+    shm_gauge(loop_stats, SHM_TLS_QUEUED, tls_stats.queue_depth);
+    shm_gauge(loop_stats, SHM_FCGI_QUEUED, fcgi != NULL ? fcgi->pending : 0);
+}
+
+/**
+ * a line from the watchdog for the error log, stamped like error_log()
+ * does. It runs on the watchdog's thread, while the loop may be in
+ * localtime() itself.
+ */
+void stall_report(const char *msg, void *arg)
+{
+    char stamp[64];
+    char line[WATCHDOG_MSG + 128];
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    snprintf(line, sizeof(line), "[%s] [error] [watchdog] %s\n", stamp, msg);
+    write_log((Log *)arg, line);
+}
+
+// what the loop is doing, for the watchdog to tell when it stalls
+void loop_phase(const char *phase)
+{
+    if (watchdog != NULL)
+        watchdog_phase(watchdog, phase);
+}
+
+/**
+ * record that phase of the request of client fd ran from start until now.
+ * Returns now, where the next phase starts.
+ */
+unsigned long phase_mark(int fd, int phase, unsigned long start)
+{
+    unsigned long now = timer_now_us();
+    Node *node = lookup_table_node(table, fd);
+    if (node != NULL)
+        phase_done(&node->phases, phase, start, now);
+    return now;
+}
+
+/**
+ * the request of node is answered with code: put its phases in fields for
+ * the access log if they go there, trace it if it is sampled, and start
+ * over for the next request
+ */
+void finish_phases(Node *node, const char *request, int code, char *fields, size_t size)
+{
+    fields[0] = 0;
+    if (config.log_phases)
+        phases_format(&node->phases, fields, size);
+    if (tracer != NULL && trace_sampled(tracer))
+        trace_request(tracer, node->key, request, code, &node->phases);
+    memset(&node->phases, 0, sizeof(node->phases));
+    // a pipelined request is in already
+    if (node->in_len > 0)
+        node->phases.at[PHASE_READ] = timer_now_us();
+}
+
+/**
+ * write as much of the client's queued output as its socket takes without
+ * blocking. -1 once the client is gone.
+ */
+int flush_output(Node *node)
+{
+    while (node->out_len > 0)
+    {
+        int n;
+        char *out = node->out_buf + node->out_off;
+        if (node->client_context == NULL)
+        {
+            n = write(node->key, out, node->out_len);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+        }
+        else
+        {
+            // a record that had to wait is written again the same size
+            int size = node->out_retry > 0 ? node->out_retry : tls_record_size(&node->records);
+            if (size > node->out_len)
+                size = node->out_len;
+            ERR_clear_error();
+            n = SSL_write(node->client_context, out, size);
+            if (n <= 0)
+            {
+                int err = SSL_get_error(node->client_context, n);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                {
+                    node->out_retry = size;
+                    return 0;
+                }
+            }
+            else
+            {
+                node->out_retry = 0;
+                node->records.sent += n;
+                node->records.records++;
+            }
+        }
+        if (n <= 0)
+            return -1;
+        count_bytes_sent(n);
+        // what went out is skipped, not moved, or a big reply written in
+        // small records would be copied over and over
+        node->out_off += n;
+        node->out_len -= n;
+    }
+    node->out_off = 0;
+    return 0;
+}
+
+// add to what the client is still to be sent
+void queue_output(Node *node, const char *buf, int len)
+{
+    // compacted once more has gone out than is left, which keeps the copying
+    // linear in what is sent
+    if (node->out_off > 0 && node->out_off >= node->out_len)
+    {
+        memmove(node->out_buf, node->out_buf + node->out_off, node->out_len);
+        node->out_off = 0;
+    }
+    node->out_buf = realloc(node->out_buf, node->out_off + node->out_len + len);
+    memcpy(node->out_buf + node->out_off + node->out_len, buf, len);
+    node->out_len += len;
+}
+
+/**
+ * send more of the file behind a static reply. Plain HTTP uses sendfile(),
+ * and so does HTTPS once the kernel does the encryption (kTLS); otherwise
+ * the file goes through the output queue in chunks. Returns 1 while the
+ * socket takes no more, 0 once the file is out and -1 if the client is
+ * gone.
+ */
+int send_file_body(Node *node)
+{
+    SSL *client_context = node->client_context;
+
+    while (node->send_offset < node->send_end || node->out_len > 0)
+    {
+        size_t left = node->send_end - node->send_offset;
+        ssize_t num;
+        if (client_context == NULL)
+        {
+            off_t offset = node->send_offset;
+            num = sendfile(node->key, node->send_file, &offset, left);
+            if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 1;
+        }
+        else if (BIO_get_ktls_send(SSL_get_wbio(client_context)))
+        {
+            ERR_clear_error();
+            num = SSL_sendfile(client_context, node->send_file, node->send_offset, left, 0);
+            if (num < 0 && SSL_get_error(client_context, num) == SSL_ERROR_WANT_WRITE)
+                return 1;
+        }
+        else
+        {
+            // user space fallback, a chunk is only read once the last is out
+            if (flush_output(node) != 0)
+                return -1;
+            if (node->out_len > 0)
+                return 1;
+            if (left == 0)
+                break;
+            char chunk[2 * BUF_SIZE];
+            num = pread(node->send_file, chunk, left < sizeof(chunk) ? left : sizeof(chunk), node->send_offset);
+            if (num > 0)
+            {
+                queue_output(node, chunk, num);
+                node->send_offset += num;
+                continue;
+            }
+        }
+        if (num <= 0)
+            return -1;
+        node->send_offset += num;
+        count_bytes_sent(num);
+    }
+    close(node->send_file);
+    node->send_file = -1;
+    return 0;
+}
+
+/**
+ * send more of a reply start_reply() could not get out at once. Returns as
+ * start_reply() does.
+ */
+int continue_reply(Node *node)
+{
+    if (flush_output(node) != 0)
+        return -1;
+    if (node->out_len > 0)
+        return 1;
+    if (node->send_file != -1)
+        return send_file_body(node);
+    return 0;
+}
+
+/**
+ * send a reply to client node as far as its socket takes it without
+ * blocking. The rest of the headers waits in out_buf and the rest of the
+ * file in send_file, which takes over response->file_fd. Returns 1 while
+ * some of it waits for continue_reply(), 0 once it is all out and -1 if
+ * the client is gone.
+ */
+int start_reply(Node *node, Response *response)
+{
+    int num = 0;
+    if (node->client_context == NULL)
+    {
+        num = write(node->key, response->buf, response->real_size);
+        if (num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            num = 0;
+        if (num < 0)
+            return -1;
+        count_bytes_sent(num);
+    }
+    if (num < response->real_size)
+        queue_output(node, response->buf + num, response->real_size - num);
+    if (response->file_fd != -1)
+    {
+        node->send_file = response->file_fd;
+        node->send_offset = 0;
+        node->send_end = response->file_size;
+        response->file_fd = -1;
+    }
+    return continue_reply(node);
+}
+
+// a reply is out whole
+void end_reply(Node *node)
+{
+    if (node->client_context != NULL)
+        tls_response_done(&node->records);
+    // it had a file, so it was corked
+    if (node->send_end > 0)
+    {
+        int cork = 0;
+        setsockopt(node->key, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        node->send_end = 0;
+    }
+}
+
+// 1 while a reply to client node waits for its socket
+int reply_pending(Node *node)
+{
+    return !node->cgi_relay && (node->out_len > 0 || node->send_file != -1);
+}
+
+/**
+ * close a client socket and forget everything about it
+ */
+void close_connection(int fd)
+{
+    client_sock = fd;
+    if (close_socket_client())
+    {
+        lisod_shutdown(EXIT_FAILURE);
+    }
+    FD_CLR(fd, readfds);
+    drop_request(fd);
+    remove_table(table, fd);
+    timer_cancel(timers, fd);
+    FD_CLR(fd, writefds);
+    num_client--;
+}
+
 int send_reply(Request *request, Response *response, Log *log, Table *table, fd_set **readfds, int mode)
 {
     // TODO put request digest generation out of send_reply()!
@@ -743,78 +1251,130 @@ int send_reply(Request *request, Response *response, Log *log, Table *table, fd_
 
     // log correctly the request!
 
+    Node *node = lookup_table_node(table, socket_num);
     char *request_digest = malloc(BUF_SIZE);
     bzero(request_digest, BUF_SIZE);
     if (request != NULL)
         sprintf(request_digest, "%s %s %s", request->http_method, request->http_uri, request->http_version);
+    else if (node != NULL && node->request_line != NULL)
+        snprintf(request_digest, BUF_SIZE, "%s", node->request_line);
     else
         sprintf(request_digest, "CANNOT RECOGNIZE THIS REQUEST");
 
-    access_log(log, addr, "", request_digest, response->code, response->size);
-
-    free(request_digest);
-
     // send depending on the mode
-    int num;
-    if (mode == 0)
+    loop_phase("send_reply");
+    unsigned long send_start = timer_now_us();
+    int sent = 0;
+    int replied = node != NULL && (response->real_size > 0 || response->file_fd != -1);
+    if (replied)
     {
-        num = write(socket_num, response->buf, response->real_size);
+        // headers and file go out as separate writes; cork them so Nagle does
+        // not hold the file back for the client's delayed ACK
+        int cork = response->file_fd != -1 && response->file_size > 0;
+        if (cork)
+            setsockopt(socket_num, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        sent = start_reply(node, response);
     }
-    else if (mode == 1)
+    if (response->file_fd != -1)
     {
-        printf("real size: %ld\n", response->real_size);
-        num = SSL_write(lookup_table_context(table, client_sock), response->buf, response->real_size);
+        close(response->file_fd);
+        response->file_fd = -1;
     }
+    if (sent >= 0 && response->code != -1)
+        count_response(socket_num, response->code);
 
-    if (num != response->real_size)
+    // logged once sent or queued, with how long that took
+    char fields[PHASE_FIELDS_SIZE] = "";
+    if (node != NULL && response->code != -1)
     {
-        //  securely delete context
-        printf("send num: %d, errno: %d, mode: %d\n", num, errno, mode);
-        if (mode == 1)
-            printf("Error indicator:%d\n", SSL_get_error(lookup_table_context(table, client_sock), num));
-        error_log(log, addr, "Error sending to client.\n");
-        lisod_shutdown(EXIT_FAILURE);
-        return EXIT_FAILURE;
+        phase_done(&node->phases, PHASE_SEND, send_start, timer_now_us());
+        finish_phases(node, request_digest, response->code, fields, sizeof(fields));
     }
-
-    // close socket
-    // 1. When connection closes
-    // 2. When the server errors
-    // 3. When client timed out after establishing connection
-    // While the third happens, we would send client a close notice
-    if (response->close == 0)
+    if (response->code == -1)
     {
-        if (close_socket_client())
+        // answered later, logged then with the status it gets
+        if (node != NULL)
         {
-            lisod_shutdown(EXIT_FAILURE);
+            free(node->request_line);
+            node->request_line = request_digest;
+            request_digest = NULL;
         }
-        FD_CLR(socket_num, *readfds);
-        remove_table(table, socket_num);
-        num_client--;
     }
-    printf("Successfully sent reply! Close: %d\n", response->close);
-
-    // free up the request
-    if (request != NULL)
+    else
     {
-        if (request->buf != NULL)
-            free(request->buf);
-        if (request->headers != NULL)
+        loop_phase("access_log");
+        access_log(log, addr, "", request_digest, response->code, response->size, fields);
+        if (node != NULL && node->request_line != NULL)
         {
-            free(request->headers);
+            free(node->request_line);
+            node->request_line = NULL;
         }
-        free(request);
     }
+    free(request_digest);
 
-    return SUCCESS;
-}
+    if (sent < 0)
+    {
+        // only this client is lost
+        printf("send errno: %d, mode: %d\n", errno, mode);
+        error_log(log, addr, "Error sending to client.\n");
+        close_connection(socket_num);
+    }
+    else if (sent > 0)
+    {
+        // the rest goes out as the client takes it, see flush_reply()
+        node->send_close = response->close == 0;
+        FD_CLR(socket_num, *readfds);
+        FD_SET(socket_num, writefds);
+        timer_set(timers, socket_num, TIMER_SEND, config.send_timeout);
+    }
+    else
+    {
+        if (replied)
+            end_reply(node);
+        // close socket
+        // 1. When connection closes
+        // 2. When the server errors
+        // 3. When client timed out after establishing connection
+        // While the third happens, we would send client a close notice
+        if (response->close == 0)
+            close_connection(socket_num);
+    }
+    printf("Successfully sent reply! Close: %d\n", response->close);
+
+    // free up the request
+    if (request != NULL)
+    {
+        if (request->buf != NULL)
+            free(request->buf);
+        if (request->headers != NULL)
+        {
+            free(request->headers);
+        }
+        free(request);
+    }
+
+    return sent < 0 ? CLOSE_SOCKET_FAILURE : SUCCESS;
+}
 
 int receive(int i, char *buf, SSL *client_context)
 {
     if (client_context == NULL)
         return read(i, buf, BUF_SIZE);
-    else
-        return SSL_read(client_context, buf, BUF_SIZE);
+    // SSL_get_error() reads the error queue, so another connection's
+    // failure left on it must not be taken for this one's
+    ERR_clear_error();
+    return SSL_read(client_context, buf, BUF_SIZE);
+}
+
+// receive() returned n only because the socket has nothing for now
+int would_block(int n, SSL *client_context)
+{
+    if (n > 0)
+        return 0;
+    if (client_context == NULL)
+        return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    int err = SSL_get_error(client_context, n);
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
 }
 
 /* error messages stolen from: http://linux.die.net/man/2/execve */
@@ -898,191 +1458,13 @@ processes.\n");
     }
 }
 
-char *ENVP[] = {
-    "CONTENT_LENGTH=",
-    "CONTENT-TYPE=",
-    "GATEWAY_INTERFACE=CGI/1.1",
-    "QUERY_STRING=",
-    "REMOTE_ADDR=",
-    "REMOTE_HOST=", // ?
-    "REQUEST_METHOD=",
-    "SCRIPT_NAME=/cgi",
-    "HOST_NAME=", // ?
-    "SERVER_PORT=80",
-    "SERVER_PROTOCOL=HTTP/1.1",
-    "SERVER_SOFTWARE=Liso/1.0",
-    "HTTP_ACCEPT=",
-    "HTTP_REFERER=",
-    "HTTP_ACCEPT_ENCODING=",
-    "HTTP_ACCEPT_LANGUAGE=",
-    "HTTP_ACCEPT_CHARSET=",
-    "HTTP_COOKIE=",
-    "HTTP_USER_AGENT=",
-    "HTTP_CONNECTION=",
-    "HTTP_HOST=",
-    "REQUEST_URI=",
-    "PATH_INFO=",
-    NULL};
-
+/**
+ * the CGI environment of request, valid until the next one is built.
+ * my_sock is the listening socket it came in on.
+ */
 char **get_env_ptrs(Request *request, int my_sock, char *addr)
 {
-
-    /*************** BEGIN ENVIRONMENT VARIABLES **************/
-
-    // parse URI
-    char *uri = malloc(strlen(request->http_uri) + sizeof(char));
-    bzero(uri, strlen(request->http_uri) + sizeof(char));
-
-    strcpy(uri, request->http_uri);
-
-    char *ptr = strchr(uri, '?') + 1;
-
-    char *query = malloc(strlen(ptr) + sizeof(char));
-    bzero(query, strlen(ptr) + sizeof(char));
-    bzero(query, strlen(ptr));
-    memcpy(query, ptr, strlen(ptr));
-    bzero(ptr - 1, strlen(query) + sizeof(char));
-
-    printf("uri: %s, query: %s\n", uri, query);
-
-    // QUERY_STRING
-    ENVP[3] = malloc(BUF_SIZE);
-    bzero(ENVP[3], BUF_SIZE);
-    sprintf(ENVP[3], "QUERY_STRING=%s", query);
-    free(query);
-
-    // REQUEST URI
-    ENVP[21] = malloc(BUF_SIZE);
-    bzero(ENVP[21], BUF_SIZE);
-    sprintf(ENVP[21], "REQUEST_URI=%s", uri);
-
-    // PATH INFO
-    ENVP[22] = malloc(BUF_SIZE);
-    bzero(ENVP[22], BUF_SIZE);
-    sprintf(ENVP[22], "REQUEST_URI=%s", uri + 4);
-    free(uri);
-
-    // REMOTE_ADDR
-    ENVP[4] = malloc(BUF_SIZE);
-    bzero(ENVP[4], BUF_SIZE);
-    sprintf(ENVP[4], "REMOTE_ADDR=%s", addr);
-
-    // REQUEST_METHOD
-    ENVP[6] = malloc(BUF_SIZE);
-    bzero(ENVP[6], BUF_SIZE);
-    sprintf(ENVP[6], "REQUEST_METHOD=%s", request->http_method);
-
-    // SERVER PORT: decide whether it is HTTP or HTTPS
-    ENVP[9] = malloc(BUF_SIZE);
-    bzero(ENVP[9], BUF_SIZE);
-    sprintf(ENVP[9], "SERVER_PORT=%d", my_sock);
-
-    int k;
-    for (k = 0; k < request->header_count; ++k)
-    {
-        Request_header header = request->headers[k];
-        // CONTENT_LENGTH
-        if (strcmp(header.header_name, "Content-Length") == 0)
-        {
-            ENVP[0] = malloc(BUF_SIZE);
-            bzero(ENVP[0], BUF_SIZE);
-            sprintf(ENVP[0], "CONTENT_LENGTH=%s", header.header_value);
-            break;
-        }
-
-        // CONTENT_TYPE
-        else if (strcmp(header.header_name, "Content-Type") == 0)
-        {
-            ENVP[1] = malloc(BUF_SIZE);
-            bzero(ENVP[1], BUF_SIZE);
-            sprintf(ENVP[1], "CONTENT-TYPE=%s", header.header_value);
-            break;
-        }
-        // HTTP_ACCEPT
-        else if (strcmp(header.header_name, "Accept") == 0)
-        {
-
-            ENVP[12] = malloc(BUF_SIZE);
-            bzero(ENVP[12], BUF_SIZE);
-            sprintf(ENVP[12], "HTTP_ACCEPT=%s", header.header_value);
-            break;
-        }
-        // HTTP_REFERER
-        else if (strcmp(header.header_name, "Referer") == 0)
-        {
-
-            ENVP[13] = malloc(BUF_SIZE);
-            bzero(ENVP[13], BUF_SIZE);
-            sprintf(ENVP[13], "HTTP_REFERER=%s", header.header_value);
-            break;
-        }
-        // HTTP_ACCEPT_ENCODING
-        else if (strcmp(header.header_name, "Accept-Encoding") == 0)
-        {
-
-            ENVP[14] = malloc(BUF_SIZE);
-            bzero(ENVP[14], BUF_SIZE);
-            sprintf(ENVP[14], "HTTP_ACCEPT_ENCODING=%s", header.header_value);
-            break;
-        }
-        // HTTP_ACCEPT_LANGUAGE
-        else if (strcmp(header.header_name, "Accept-Language") == 0)
-        {
-
-            ENVP[15] = malloc(BUF_SIZE);
-            bzero(ENVP[15], BUF_SIZE);
-            sprintf(ENVP[15], "HTTP_ACCEPT_LANGUAGE=%s", header.header_value);
-            break;
-        }
-        // HTTP_ACCEPT_CHARSET
-        else if (strcmp(header.header_name, "Accept-Charset") == 0)
-        {
-
-            ENVP[16] = malloc(BUF_SIZE);
-            bzero(ENVP[16], BUF_SIZE);
-            sprintf(ENVP[16], "HTTP_ACCEPT_CHARSET=%s", header.header_value);
-            break;
-        }
-        // COOKIE
-        else if (strcmp(header.header_name, "Cookie") == 0)
-        {
-
-            ENVP[17] = malloc(BUF_SIZE);
-            bzero(ENVP[17], BUF_SIZE);
-            sprintf(ENVP[17], "HTTP_COOKIE=%s", header.header_value);
-            break;
-        }
-        // USER-AGENT
-        else if (strcmp(header.header_name, "User-Agent") == 0)
-        {
-
-            ENVP[18] = malloc(BUF_SIZE);
-            bzero(ENVP[18], BUF_SIZE);
-            sprintf(ENVP[18], "HTTP_USER_AGENT=%s", header.header_value);
-            break;
-        }
-        // CONNECTION
-        else if (strcmp(header.header_name, "Connection") == 0)
-        {
-
-            ENVP[19] = malloc(BUF_SIZE);
-            bzero(ENVP[19], BUF_SIZE);
-            sprintf(ENVP[19], "HTTP_CONNECTION=%s", header.header_value);
-            break;
-        }
-        // HOST
-        else if (strcmp(header.header_name, "Host") == 0)
-        {
-
-            ENVP[20] = malloc(BUF_SIZE);
-            bzero(ENVP[20], BUF_SIZE);
-            sprintf(ENVP[20], "HTTP_HOST=%s", header.header_value);
-            break;
-        }
-    }
-    return ENVP;
-
-    /*************** END ENVIRONMENT VARIABLES **************/
+    return cgi_env_build(cgi_env, request, addr, my_sock == https_sock);
 }
 
 int handle_cgi_request(Request *request, Log *log, char *addr, char *cgi_folder, int my_sock)
@@ -1101,6 +1483,28 @@ int handle_cgi_request(Request *request, Log *log, char *addr, char *cgi_folder,
     int readret;
     /*************** END VARIABLE DECLARATIONS **************/
 
+    /*************** BEGIN ZYGOTE **************/
+    /* the zygote forks from its own small address space, not ours */
+    if (zygote_fd() >= 0)
+    {
+        int stdin_fd, stdout_fd;
+        pid = zygote_spawn(cgi_folder, ENVP, &stdin_fd, &stdout_fd);
+        if (pid < 0)
+        {
+            fprintf(stderr, "Error spawning CGI script through the zygote.\n");
+            return EXIT_FAILURE;
+        }
+
+        insert_map(map, pid, client_sock);
+        reaper_track(reaper, pid, client_sock);
+        lookup_table_node(table, client_sock)->cgi_pid = pid;
+
+        // write the request to the script's stdin, listen on its stdout
+        client_sock = stdin_fd;
+        return stdout_fd;
+    }
+    /*************** END ZYGOTE **************/
+
     /*************** BEGIN PIPE **************/
     /* 0 can be read from, 1 can be written to */
     if (pipe(stdin_pipe) < 0)
@@ -1131,6 +1535,10 @@ int handle_cgi_request(Request *request, Log *log, char *addr, char *cgi_folder,
         /*************** BEGIN EXECVE ****************/
         close(stdout_pipe[0]);
         close(stdin_pipe[1]);
+        /* lisod keeps SIGCHLD blocked, the script should not inherit that */
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
         dup2(stdout_pipe[1], fileno(stdout));
         dup2(stdin_pipe[0], fileno(stdin));
         /* you should probably do something with stderr */
@@ -1147,76 +1555,1566 @@ int handle_cgi_request(Request *request, Log *log, char *addr, char *cgi_folder,
 
     if (pid > 0)
     {
-        fprintf(stdout, "Parent: Heading to select() loop.\n");
-        close(stdout_pipe[1]);
-        close(stdin_pipe[0]);
-
-        // TODO: register pid in a pid->client_sock(current) map
+        fprintf(stdout, "Parent: Heading to select() loop.\n");
+        close(stdout_pipe[1]);
+        close(stdin_pipe[0]);
+
+        // TODO: register pid in a pid->client_sock(current) map
+
+        insert_map(map, pid, client_sock);
+        reaper_track(reaper, pid, client_sock);
+        lookup_table_node(table, client_sock)->cgi_pid = pid;
+
+        // then change client_sock to stdin_pipe[1], the place to write
+
+        client_sock = stdin_pipe[1];
+        printf("client_sock: %d\n", stdin_pipe[1]);
+
+        // its exit is read from the reaper's signalfd in the select() loop
+
+        // return the other fd for log
+
+        return stdout_pipe[0];
+    }
+    /*************** END FORK **************/
+
+    fprintf(stderr, "Process exiting, badly...how did we get here!?\n");
+    return EXIT_FAILURE;
+}
+
+// Content-Length of a parsed request, 0 without one
+int request_body_length(Request *request)
+{
+    for (int k = 0; k < request->header_count; ++k)
+    {
+        if (strcmp(request->headers[k].header_name, "Content-Length") == 0)
+            return strtol(request->headers[k].header_value, NULL, 10);
+    }
+    return 0;
+}
+
+/**
+ * placeholder response for a request handed to a CGI script: nothing is
+ * written, the request is only logged and the client marked as waiting
+ */
+Response *forward_cgi_request(Request *request)
+{
+    Response *ret = malloc(sizeof(Response));
+    ret->buf = request->buf;
+    ret->file_fd = -1;
+    ret->real_size = 0;
+    ret->size = -1;
+    ret->close = -1;
+    ret->code = -1;
+
+    return ret;
+}
+
+Response *forward_cgi_response(char *new_buf, int len, int i)
+{
+    Response *ret = malloc(sizeof(Response));
+    ret->buf = new_buf;
+    ret->file_fd = -1;
+    ret->real_size = len;
+    ret->size = -1;
+    ret->close = 0;
+    ret->code = -1;
+    return ret;
+}
+
+/**
+ * turn the header block at the start of a CGI script's output into HTTP
+ * response headers. A block that already starts with a status line, as the
+ * NPH scripts here print, is kept as is; otherwise the status line is built
+ * from Status:. Content-Length is added if the script sent none and
+ * body_len is known (not -1). *used is set to the bytes of out the block
+ * took, blank line included. NULL while the block is incomplete.
+ */
+char *cgi_http_header(char *out, int len, long body_len, int *used, int *http_len)
+{
+    char *end = memmem(out, len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return NULL;
+    int header_length = end - out + 2; // keep the last header's CRLF
+    *used = header_length + 2;
+
+    if (len >= 5 && strncmp(out, "HTTP/", 5) == 0)
+    {
+        char *copy = malloc(*used + 1);
+        memcpy(copy, out, *used);
+        copy[*used] = 0;
+        *http_len = *used;
+        return copy;
+    }
+
+    // the status line is built from Status:, so find it first
+    char status[128] = "200 OK";
+    int has_length = 0;
+    char *line = out;
+    while (line < out + header_length)
+    {
+        char *eol = memmem(line, out + header_length - line, "\r\n", 2);
+        if (strncasecmp(line, "Status:", 7) == 0)
+        {
+            char *value = line + 7;
+            while (*value == ' ')
+                value++;
+            snprintf(status, sizeof(status), "%.*s", (int)(eol - value), value);
+        }
+        else if (strncasecmp(line, "Content-Length:", 15) == 0)
+            has_length = 1;
+        line = eol + 2;
+    }
+
+    char *http = malloc(header_length + 256);
+    int offset = sprintf(http, "HTTP/1.1 %s\r\n", status);
+    line = out;
+    while (line < out + header_length)
+    {
+        char *eol = memmem(line, out + header_length - line, "\r\n", 2);
+        if (strncasecmp(line, "Status:", 7) != 0)
+        {
+            memcpy(http + offset, line, eol - line + 2);
+            offset += eol - line + 2;
+        }
+        line = eol + 2;
+    }
+    if (!has_length && body_len >= 0)
+        offset += sprintf(http + offset, "Content-Length: %ld\r\n", body_len);
+    memcpy(http + offset, "\r\n", 2);
+    offset += 2;
+    http[offset] = 0;
+    *http_len = offset;
+    return http;
+}
+
+/**
+ * turn what a FastCGI responder printed into a full HTTP response. Output
+ * that already starts with a status line is kept as is.
+ */
+char *fcgi_http_response(char *out, int len, int *http_len)
+{
+    if (len >= 5 && strncmp(out, "HTTP/", 5) == 0)
+    {
+        char *copy = malloc(len + 1);
+        memcpy(copy, out, len);
+        copy[len] = 0;
+        *http_len = len;
+        return copy;
+    }
+
+    char *end = memmem(out, len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return NULL;
+    int body_len = len - (end + 4 - out);
+
+    int used, header_len;
+    char *http = cgi_http_header(out, len, body_len, &used, &header_len);
+    http = realloc(http, header_len + body_len + 1);
+    memcpy(http + header_len, out + used, body_len);
+    http[header_len + body_len] = 0;
+    *http_len = header_len + body_len;
+    return http;
+}
+
+/**
+ * total bytes of the first request in buf, headers plus Content-Length
+ * body. -1 while the header block is still incomplete, REQUEST_TOO_LARGE
+ * for a body over max_body_size and REQUEST_BAD_LENGTH if Content-Length
+ * is not a number.
+ */
+int request_length(char *buf, int len)
+{
+    char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (end == NULL)
+    {
+        // oversized header block, let the parser reject it
+        return len >= HEADER_BUF_SIZE ? len : -1;
+    }
+
+    int header_length = end - buf + 4;
+    long val = 0;
+    char *line = memmem(buf, end - buf, "\r\n", 2);
+    while (line != NULL && line < end)
+    {
+        line += 2;
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+        {
+            char *rest;
+            errno = 0;
+            val = strtol(line + 15, &rest, 10);
+            rest += strspn(rest, " \t");
+            if (errno != 0 || rest == line + 15 || val < 0 || strncmp(rest, "\r\n", 2) != 0)
+                return REQUEST_BAD_LENGTH;
+            break;
+        }
+        line = memmem(line, end - line, "\r\n", 2);
+    }
+    if (val > config.max_body_size)
+        return REQUEST_TOO_LARGE;
+    return header_length + val;
+}
+
+/**
+ * whether the loop can go on with what node has buffered without reading:
+ * a whole request, one to refuse, or headers a CGI script starts on
+ */
+int request_ready(Node *node)
+{
+    if (node->in_len == 0)
+        return 0;
+    int need = request_length(node->in_buf, node->in_len);
+    if (need == REQUEST_TOO_LARGE || need == REQUEST_BAD_LENGTH)
+        return 1;
+    if (need < 0)
+        return 0;
+    return node->in_len >= need || streams_body(node->in_buf, node->in_len);
+}
+
+/**
+ * hand a client's upstream connection back to its pool, which keeps it
+ * only if the whole answer was read and the whole request sent
+ */
+void release_upstream(Node *node)
+{
+    int reusable = node->cgi_relay && node->cgi_left == 0 && node->cgi_stdin == 0 && node->body_left == 0;
+    FD_CLR(node->cgi_fd, readfds);
+    FD_CLR(node->cgi_fd, writefds);
+    remove_table(table, node->cgi_fd);
+    num_client--;
+    proxy_release(proxy, node->proxy, reusable);
+    node->proxy = NULL;
+    node->cgi_fd = 0;
+    // the rest of the body has nowhere to go
+    if (node->cgi_stdin > 0)
+        node->cgi_stdin = -1;
+}
+
+/**
+ * the upstream of a client could not be connected to: move the request to
+ * the next upstream of the same route, under the same fd. -1 once every
+ * upstream of the route was tried, the relay answers 502 then.
+ */
+int retry_upstream(Node *node)
+{
+    Proxy_Conn *c = node->proxy;
+    if (c->tries + 1 >= proxy->routes[c->route].count)
+        return -1;
+    Proxy_Conn *next = proxy_connect(proxy, c->route);
+    if (next == NULL)
+        return -1;
+
+    printf("Upstream %s refused socket %d, trying %s\n", c->upstream->name, node->key, next->upstream->name);
+    // the new connection takes the number of the old one, which goes
+    dup3(next->fd, c->fd, O_CLOEXEC);
+    int fd = c->fd;
+    c->fd = next->fd;
+    next->fd = fd;
+    next->tries = c->tries + 1;
+    next->head = c->head;
+    c->upstream->failures++;
+    proxy_release(proxy, c, 0);
+    node->proxy = next;
+    return 0;
+}
+
+// stop listening to a client's CGI stdout pipe
+void close_cgi_pipe(Node *node)
+{
+    if (node->cgi_fd <= 0)
+        return;
+    if (node->proxy != NULL)
+    {
+        release_upstream(node);
+        return;
+    }
+    close(node->cgi_fd);
+    FD_CLR(node->cgi_fd, readfds);
+    remove_table(table, node->cgi_fd);
+    num_client--;
+    node->cgi_fd = 0;
+}
+
+/**
+ * the script has all of the body it is going to get. The client is not
+ * read again until its response is out.
+ */
+void close_cgi_stdin(Node *node)
+{
+    // an upstream connection stays open for the answer
+    if (node->cgi_stdin > 0 && node->proxy != NULL)
+        FD_CLR(node->cgi_stdin, writefds);
+    else if (node->cgi_stdin > 0)
+    {
+        close(node->cgi_stdin);
+        FD_CLR(node->cgi_stdin, writefds);
+        remove_table(table, node->cgi_stdin);
+        num_client--;
+    }
+    node->cgi_stdin = 0;
+    FD_CLR(node->key, readfds);
+}
+
+/**
+ * forget a client's CGI script, the rest of its request body and whatever
+ * of its output is still queued
+ */
+void end_cgi_relay(Node *node)
+{
+    cgi_limit_release(cgi_limiter, node->key);
+    if (cgi_cache != NULL)
+    {
+        // whoever waited on an unfinished fill runs the script itself
+        if (node->cache_fill != NULL)
+            cgi_cache_finish(cgi_cache, node->cache_fill, -1);
+        node->cache_fill = NULL;
+        cgi_cache_forget(cgi_cache, node->key);
+    }
+    close_cgi_pipe(node);
+    close_cgi_stdin(node);
+    if (node->cgi_pid > 0)
+    {
+        remove_map(map, node->cgi_pid);
+        node->cgi_pid = 0;
+    }
+    if (node->cgi_relay)
+        FD_CLR(node->key, writefds);
+    node->cgi_relay = 0;
+    node->cgi_left = 0;
+    node->cgi_close = 0;
+    node->body_left = 0;
+    node->out_len = 0;
+    node->out_off = 0;
+    node->out_retry = 0;
+    node->is_cgi = 0;
+}
+
+/**
+ * kill the CGI script working for a client and stop listening to it
+ */
+void abort_cgi(Node *node)
+{
+    if (node->cgi_pid > 0)
+    {
+        remove_map(map, node->cgi_pid);
+        reaper_kill(reaper, node->cgi_pid);
+        node->cgi_pid = 0;
+    }
+    if (fcgi != NULL)
+        fcgi_abort(fcgi, node->key);
+    if (plugins != NULL)
+        plugin_abort(plugins, node->key);
+    end_cgi_relay(node);
+}
+
+// one step of a handshake handed to the TLS pool
+typedef struct
+{
+    int fd;
+    SSL *client_context;
+    int ret;   // of SSL_accept()
+    int error; // SSL_get_error() has to be asked on the same thread
+} Handshake_Job;
+
+/**
+ * act on the outcome of one SSL_accept() step, wherever it ran
+ */
+void finish_handshake(int fd, int ret, int error, Log *log)
+{
+    Node *node = lookup_table_node(table, fd);
+
+    if (ret == 1)
+    {
+        // handshake done, the socket stays non-blocking like every client's
+        node->tls_state = TLS_ESTABLISHED;
+        tls_count_handshake(node->client_context, node->handshake_start);
+        phase_done(&node->phases, PHASE_TLS, node->handshake_start, timer_now_us());
+        if (BIO_get_ktls_send(SSL_get_wbio(node->client_context)))
+            printf("kTLS send offload on socket %d\n", fd);
+        if (tls_stats.handshakes % 1000 == 0)
+        {
+            char digest[SIZE];
+            tls_stats_digest(digest, SIZE);
+            write_log(log, digest);
+        }
+        FD_SET(fd, readfds);
+        FD_CLR(fd, writefds);
+        timer_set(timers, fd, TIMER_HEADER, config.header_timeout);
+        return;
+    }
+
+    switch (error)
+    {
+    case SSL_ERROR_WANT_READ:
+        FD_SET(fd, readfds);
+        FD_CLR(fd, writefds);
+        return;
+    case SSL_ERROR_WANT_WRITE:
+        FD_CLR(fd, readfds);
+        FD_SET(fd, writefds);
+        return;
+    default:
+    {
+        // only this client is lost
+        struct sockaddr_in *addr = (struct sockaddr_in *)node->val;
+        error_log(log, inet_ntoa(addr->sin_addr), "Error accepting (handshake) client SSL context.\n");
+        close_connection(fd);
+        return;
+    }
+    }
+}
+
+// worker thread: the key exchange and signature work happen in here
+void handshake_work(void *data)
+{
+    Handshake_Job *job = (Handshake_Job *)data;
+    Shm_Worker *stats = shm_stats == NULL ? NULL : shm_stats_worker(shm_stats, "tls");
+    if (stats != NULL)
+        shm_heartbeat(stats, 1, timer_now_us());
+    ERR_clear_error();
+    job->ret = SSL_accept(job->client_context);
+    job->error = job->ret == 1 ? SSL_ERROR_NONE : SSL_get_error(job->client_context, job->ret);
+    if (stats != NULL)
+    {
+        shm_count(stats, SHM_HANDSHAKES, 1);
+        shm_heartbeat(stats, 0, timer_now_us());
+    }
+}
+
+// event loop: the worker is done with the connection
+void handshake_done(void *data, void *arg)
+{
+    Handshake_Job *job = (Handshake_Job *)data;
+    Node *node = lookup_table_node(table, job->fd);
+
+    tls_stats.queue_depth = thread_pool_depth(tls_pool);
+    if (node != NULL && node->tls_state == TLS_ABORTED)
+        close_connection(job->fd);
+    else if (node != NULL)
+    {
+        node->tls_state = TLS_HANDSHAKE;
+        finish_handshake(job->fd, job->ret, job->error, (Log *)arg);
+    }
+    free(job);
+}
+
+/**
+ * drive the TLS handshake of an HTTPS client one step further. Called
+ * whenever its socket is ready for what OpenSSL last asked for. With a
+ * TLS pool the step runs on a worker and the socket is left out of
+ * select() until it comes back.
+ */
+void continue_handshake(int fd, Log *log)
+{
+    Node *node = lookup_table_node(table, fd);
+
+    if (tls_pool != NULL)
+    {
+        Handshake_Job *job = (Handshake_Job *)malloc(sizeof(Handshake_Job));
+        job->fd = fd;
+        job->client_context = node->client_context;
+        node->tls_state = TLS_OFFLOADED;
+        FD_CLR(fd, readfds);
+        FD_CLR(fd, writefds);
+        if (thread_pool_submit(tls_pool, handshake_work, handshake_done, job) == 0)
+        {
+            tls_stats.queue_depth = thread_pool_depth(tls_pool);
+            if (tls_stats.queue_depth > tls_stats.queue_max)
+                tls_stats.queue_max = tls_stats.queue_depth;
+            return;
+        }
+        // could not queue it, do it here
+        free(job);
+        node->tls_state = TLS_HANDSHAKE;
+    }
+
+    ERR_clear_error();
+    int ret = SSL_accept(node->client_context);
+    finish_handshake(fd, ret, ret == 1 ? SSL_ERROR_NONE : SSL_get_error(node->client_context, ret), log);
+}
+
+/**
+ * requests a connection may still make after the current one, -1 if
+ * there is no limit
+ */
+int requests_left(int fd)
+{
+    Node *node = lookup_table_node(table, fd);
+    if (node == NULL)
+        return 0;
+    if (config.keepalive_requests == 0)
+        return -1;
+    if (node->requests >= config.keepalive_requests)
+        return 0;
+    return config.keepalive_requests - node->requests;
+}
+
+/**
+ * close idle keep-alive connections, oldest first, until at most keep of
+ * them are left
+ */
+void shed_idle_connections(int keep)
+{
+    while (table->idle_count > keep)
+    {
+        int fd = oldest_idle(table);
+        printf("Shedding idle socket %d\n", fd);
+        close_connection(fd);
+    }
+}
+
+/**
+ * close a client we cannot take, after a 503 if it speaks plain HTTP. Best
+ * effort: the socket is not kept around to wait until it takes the reply.
+ */
+void turn_away(int fd, int listener)
+{
+    if (listener == sock && write(fd, BUSY_REPLY, strlen(BUSY_REPLY)) < 0)
+        printf("Socket %d did not take its 503\n", fd);
+    close(fd);
+}
+
+/**
+ * out of fds: accept the next client of listener with the fd kept spare
+ * and turn it away, or it stays in the backlog and select() keeps waking
+ * the loop up for it
+ */
+void turn_away_pending(int listener)
+{
+    if (spare_fd < 0)
+        return;
+    close(spare_fd);
+    int fd = accept(listener, NULL, NULL);
+    if (fd >= 0)
+        turn_away(fd, listener);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * after a response went out on a connection that stays open, serve the
+ * next pipelined request if it is in already, otherwise wait either for
+ * the rest of a started request or for the next one
+ */
+void arm_idle_timer(int fd)
+{
+    Node *node = lookup_table_node(table, fd);
+    // a reply still going out has its own deadline
+    if (node == NULL || node->val == NULL || node->is_cgi != 0 || reply_pending(node))
+        return;
+    FD_SET(fd, readfds);
+    if (request_ready(node))
+    {
+        // next round, so one client's pipeline does not starve the others
+        timer_cancel(timers, fd);
+        if (!FD_ISSET(fd, &ready_fds))
+        {
+            FD_SET(fd, &ready_fds);
+            ready_count++;
+        }
+    }
+    else if (node->in_len > 0)
+        timer_set(timers, fd, TIMER_HEADER, config.header_timeout);
+    else
+    {
+        timer_set(timers, fd, TIMER_KEEPALIVE, config.keepalive_timeout);
+        mark_idle(table, fd);
+        shed_idle_connections(config.keepalive_idle_max);
+    }
+}
+
+/**
+ * the client of a reply that did not go out whole is ready for more. The
+ * client is not read until it is all out, so replies to pipelined requests
+ * keep their order.
+ */
+void flush_reply(Node *node)
+{
+    int fd = node->key;
+    int ret = continue_reply(node);
+    if (ret > 0)
+    {
+        timer_set(timers, fd, TIMER_SEND, config.send_timeout);
+        return;
+    }
+    if (ret < 0)
+        printf("Client %d left during a reply\n", fd);
+    else
+        end_reply(node);
+    if (ret < 0 || node->send_close)
+    {
+        close_connection(fd);
+        return;
+    }
+    FD_CLR(fd, writefds);
+    arm_idle_timer(fd);
+}
+
+/**
+ * a copy of a cached CGI response for client fd
+ */
+Response *cached_response(Cache_Entry *entry, int fd)
+{
+    Response *ret = malloc(sizeof(Response));
+    ret->buf = malloc(entry->len);
+    memcpy(ret->buf, entry->response, entry->len);
+    ret->file_fd = -1;
+    ret->real_size = entry->len;
+    ret->size = entry->len;
+    ret->close = requests_left(fd) == 0 ? 0 : 1;
+    ret->code = 200;
+    return ret;
+}
+
+/**
+ * a native handler's whole HTTP response for client fd
+ */
+Response *plugin_reply(int fd, int code, char *http, int len)
+{
+    Response *ret = malloc(sizeof(Response));
+    ret->buf = http;
+    ret->file_fd = -1;
+    ret->real_size = len;
+    ret->size = len;
+    ret->close = requests_left(fd) == 0 ? 0 : 1;
+    ret->code = code;
+    return ret;
+}
+
+/**
+ * a native handler finished the request of client_fd after its dispatch
+ * returned. Answer the client like a FastCGI reply.
+ */
+void plugin_response(int client_fd, int code, char *http, int len, void *arg)
+{
+    Log *log = (Log *)arg;
+    Node *node = lookup_table_node(table, client_fd);
+    if (node == NULL || node->val == NULL)
+    {
+        free(http);
+        return;
+    }
+
+    insert_cgi(table, client_fd, 0);
+    Response *response = plugin_reply(client_fd, code, http, len);
+    client_sock = client_fd;
+    if (send_reply(NULL, response, log, table, &readfds, node->connection == https_sock ? 1 : 0) == SUCCESS)
+        arm_idle_timer(client_fd);
+    free(response->buf);
+    free(response);
+}
+
+/**
+ * the script filling node's cache entry is done, ttl as for
+ * cgi_cache_finish(). Clients that waited for the same request get the
+ * stored response; if nothing was stored they run it themselves later.
+ */
+void cache_filled(Node *node, int ttl, Log *log)
+{
+    Cache_Entry *entry = node->cache_fill;
+    node->cache_fill = NULL;
+    Cache_Waiter *waiter = cgi_cache_finish(cgi_cache, entry, ttl);
+
+    int saved = client_sock;
+    while (waiter != NULL)
+    {
+        Cache_Waiter *next = waiter->next;
+        Node *client = lookup_table_node(table, waiter->fd);
+        if (client != NULL && client->val != NULL && client->is_cgi)
+        {
+            client->is_cgi = 0;
+            Response *response = cached_response(entry, waiter->fd);
+            client_sock = waiter->fd;
+            printf("Socket %d shares the response of socket %d\n", waiter->fd, node->key);
+            if (send_reply(NULL, response, log, table, &readfds, client->connection == https_sock ? 1 : 0) == SUCCESS)
+                arm_idle_timer(waiter->fd);
+            free(response->buf);
+            free(response);
+        }
+        free(waiter->request);
+        free(waiter);
+        waiter = next;
+    }
+    client_sock = saved;
+}
+
+/**
+ * a FastCGI worker finished the request of client_fd, or died on it
+ * (out is NULL). Answer the client the way a classic CGI reply is.
+ */
+void fcgi_response(int client_fd, char *out, int len, void *arg)
+{
+    Log *log = (Log *)arg;
+    Node *node = lookup_table_node(table, client_fd);
+    if (node == NULL || node->val == NULL)
+        return;
+
+    insert_cgi(table, client_fd, 0);
+
+    Response *response = NULL;
+    int http_len;
+    char *http = out == NULL ? NULL : fcgi_http_response(out, len, &http_len);
+    if (http != NULL)
+    {
+        response = parse_response(http, http_len, client_fd);
+        if (response == NULL)
+            response = forward_cgi_response(http, http_len, client_fd);
+    }
+    else
+        response = handle_request(NULL, 502, www_file, 0);
+
+    if (node->cache_fill != NULL)
+    {
+        // only whole 200 answers that leave the connection open are kept
+        int ttl = -1;
+        if (http != NULL && response->code == 200 && response->close != 0)
+        {
+            ttl = cgi_cache_ttl(cgi_cache, http, http_len);
+            cgi_cache_append(cgi_cache, node->cache_fill, http, http_len);
+        }
+        else if (http != NULL)
+            ttl = 0;
+        cache_filled(node, ttl, log);
+    }
+
+    if (requests_left(client_fd) == 0)
+        response->close = 0;
+
+    client_sock = client_fd;
+    int mode = node->connection == https_sock ? 1 : 0;
+    if (send_reply(NULL, response, log, table, &readfds, mode) == SUCCESS)
+        arm_idle_timer(client_fd);
+    free(response->buf);
+    free(response);
+}
+
+/**
+ * the script's output went out whole: keep the connection for the next
+ * request unless the response could only be ended by closing it
+ */
+void complete_cgi_relay(Node *node, Log *log)
+{
+    int fd = node->key;
+    // body bytes the script never read would pass for the next request
+    int close_after = node->cgi_close || node->body_left > 0;
+    if (node->client_context != NULL)
+        tls_response_done(&node->records);
+    // a body cut short is no response to hand out again
+    if (node->cache_fill != NULL)
+        cache_filled(node, node->cgi_left == 0 ? node->cache_fill->ttl : -1, log);
+    end_cgi_relay(node);
+    if (close_after)
+        close_connection(fd);
+    else
+        arm_idle_timer(fd);
+}
+
+// add CGI output to what the client is still to be sent
+void queue_cgi_output(Node *node, const char *buf, int len)
+{
+    queue_output(node, buf, len);
+    if (node->cache_fill != NULL)
+        cgi_cache_append(cgi_cache, node->cache_fill, buf, len);
+}
+
+/**
+ * collect the header block of a script's output in its pipe's buffer. Once
+ * it is whole (or the script is done, eof) it is queued as HTTP headers
+ * along with the body bytes read with it. Returns 0 while waiting for more
+ * and -1 if the script printed nothing at all.
+ */
+int start_cgi_relay(Node *node, int eof, Log *log)
+{
+    Node *pipe_node = lookup_table_node(table, node->cgi_fd);
+    int used, http_len;
+    long length = -1;
+    char *http = NULL;
+    if (node->proxy != NULL)
+    {
+        http = proxy_response_head(node->proxy, pipe_node->in_buf, pipe_node->in_len, &used, &http_len, &length);
+        // an upstream that does not answer in HTTP gets no say
+        if (http == NULL && (eof || used < 0 || pipe_node->in_len >= HEADER_BUF_SIZE))
+            return -1;
+    }
+    else if (pipe_node->in_len > 0)
+        http = cgi_http_header(pipe_node->in_buf, pipe_node->in_len, -1, &used, &http_len);
+    if (http == NULL && !eof && pipe_node->in_len < HEADER_BUF_SIZE)
+        return 0;
+    if (http == NULL && pipe_node->in_len == 0)
+        return -1;
+
+    int close_after;
+    Response *response = NULL;
+    if (http != NULL)
+    {
+        // only the header block goes through the parser
+        response = parse_response(http, http_len, node->key);
+        char *line = http;
+        while (node->proxy == NULL && (line = memmem(line, http + http_len - line, "\r\n", 2)) != NULL)
+        {
+            line += 2;
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+            {
+                length = atol(line + 15);
+                break;
+            }
+        }
+        // without a length the body ends where the connection does,
+        // unless it comes in chunks
+        int chunked = node->proxy != NULL && node->proxy->chunked;
+        close_after = (length < 0 && !chunked) || response == NULL || response->close == 0;
+        if (node->cache_fill != NULL)
+        {
+            int ttl = close_after || response->code != 200 ? 0 : cgi_cache_ttl(cgi_cache, http, http_len);
+            if (ttl > 0)
+                node->cache_fill->ttl = ttl;
+            else
+                cache_filled(node, 0, log);
+        }
+        queue_cgi_output(node, http, http_len);
+        free(http);
+    }
+    else
+    {
+        // no header block in sight, pass the output on as it is
+        used = 0;
+        close_after = 1;
+        if (node->cache_fill != NULL)
+            cache_filled(node, 0, log);
+    }
+    if (requests_left(node->key) == 0)
+        close_after = 1;
+
+    const char *digest = node->request_line;
+    if (digest == NULL)
+        digest = node->proxy != NULL ? "PROXY RESPONSE" : "CGI RESPONSE";
+    char fields[PHASE_FIELDS_SIZE];
+    phase_mark(node->key, PHASE_SEND, phases_end(&node->phases));
+    finish_phases(node, digest, response == NULL ? -1 : response->code, fields, sizeof(fields));
+    struct sockaddr_in *addr = (struct sockaddr_in *)node->val;
+    access_log(log, inet_ntoa(addr->sin_addr), "", digest, response == NULL ? -1 : response->code, length, fields);
+    free(node->request_line);
+    node->request_line = NULL;
+    if (response != NULL)
+        count_response(node->key, response->code);
+    free(response);
+
+    // the script answered, its exit notice is no news
+    if (node->cgi_pid > 0)
+        remove_map(map, node->cgi_pid);
+
+    int body = pipe_node->in_len - used;
+    if (length >= 0 && body > length)
+        body = length;
+    if (node->proxy != NULL)
+    {
+        int framed = proxy_framed(node->proxy, pipe_node->in_buf + used, body);
+        // whatever follows the answer leaves the connection in no known state
+        if (used + framed < pipe_node->in_len)
+            node->proxy->keep_alive = 0;
+        body = framed;
+    }
+    queue_cgi_output(node, pipe_node->in_buf + used, body);
+    node->cgi_left = length < 0 ? -1 : length - body;
+    if (node->proxy != NULL && node->proxy->done)
+        node->cgi_left = 0;
+    node->cgi_close = close_after;
+    node->cgi_relay = 1;
+    pipe_node->in_len = 0;
+    return 1;
+}
+
+/**
+ * move a CGI script's output to its client until the pipe runs dry or the
+ * client stops taking it. The header block is read whole first, then the
+ * body streams through as it comes: spliced from the pipe straight into
+ * sockets the kernel writes for us (plain HTTP, kTLS), queued for the rest.
+ * While cgi_output_buffer bytes wait for a slow client the pipe is not
+ * read, which stalls the script once the pipe fills up as well.
+ */
+void relay_cgi_output(Node *node, Log *log)
+{
+    int fd = node->key;
+    char buf[BUF_SIZE];
+
+    for (int round = 0;; ++round)
+    {
+        if (flush_output(node) != 0)
+        {
+            printf("Client %d left during a CGI response\n", fd);
+            abort_cgi(node);
+            close_connection(fd);
+            return;
+        }
+        if (node->out_len > 0)
+            FD_SET(fd, writefds);
+        else
+            FD_CLR(fd, writefds);
+
+        if (node->cgi_relay && node->cgi_left == 0)
+            close_cgi_pipe(node);
+        if (node->cgi_fd <= 0)
+        {
+            if (node->out_len == 0)
+                complete_cgi_relay(node, log);
+            return;
+        }
+
+        int pipe_fd = node->cgi_fd;
+        if (node->out_len >= config.cgi_output_buffer)
+        {
+            FD_CLR(pipe_fd, readfds);
+            return;
+        }
+        FD_SET(pipe_fd, readfds);
+        if (round == RELAY_ROUNDS)
+            return;
+
+        int n;
+        int spliced = 0;
+        if (!node->cgi_relay)
+        {
+            n = read(pipe_fd, buf, BUF_SIZE);
+            if (n > 0)
+            {
+                Node *pipe_node = lookup_table_node(table, pipe_fd);
+                pipe_node->in_buf = realloc(pipe_node->in_buf, pipe_node->in_len + n);
+                memcpy(pipe_node->in_buf + pipe_node->in_len, buf, n);
+                pipe_node->in_len += n;
+                if (start_cgi_relay(node, 0, log) >= 0)
+                    continue;
+                // an upstream's answer that is no HTTP ends it like EOF
+                n = 0;
+            }
+        }
+        else if (node->out_len == 0 && node->cache_fill == NULL && node->proxy == NULL &&
+                 (node->client_context == NULL || BIO_get_ktls_send(SSL_get_wbio(node->client_context))))
+        {
+            size_t want = node->cgi_left < 0 || node->cgi_left > RELAY_CHUNK ? RELAY_CHUNK : node->cgi_left;
+            n = splice(pipe_fd, NULL, fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && errno == EAGAIN)
+            {
+                // either the pipe ran dry or the socket is full
+                struct pollfd out = {fd, POLLOUT, 0};
+                if (poll(&out, 1, 0) == 1)
+                    return;
+                FD_CLR(pipe_fd, readfds);
+                FD_SET(fd, writefds);
+                return;
+            }
+            spliced = 1;
+            count_bytes_sent(n);
+        }
+        else
+        {
+            int room = config.cgi_output_buffer - node->out_len;
+            if (room > BUF_SIZE)
+                room = BUF_SIZE;
+            if (node->cgi_left >= 0 && room > node->cgi_left)
+                room = node->cgi_left;
+            n = read(pipe_fd, buf, room);
+            if (n > 0 && node->proxy != NULL)
+            {
+                int framed = proxy_framed(node->proxy, buf, n);
+                if (framed < n)
+                    node->proxy->keep_alive = 0;
+                n = framed;
+            }
+            if (n > 0)
+                queue_cgi_output(node, buf, n);
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n < 0 && spliced)
+        {
+            printf("Client %d left during a CGI response\n", fd);
+            abort_cgi(node);
+            close_connection(fd);
+            return;
+        }
+        if (n <= 0)
+        {
+            // the script is done
+            if (!node->cgi_relay && start_cgi_relay(node, 1, log) < 0)
+            {
+                int code = 500;
+                if (node->proxy != NULL)
+                {
+                    printf("Upstream for socket %d did not answer\n", fd);
+                    node->proxy->upstream->failures++;
+                    code = 502;
+                }
+                else
+                    printf("CGI script for socket %d printed nothing\n", fd);
+                int mode = node->connection == https_sock ? 1 : 0;
+                end_cgi_relay(node);
+                client_sock = fd;
+                Response *response = handle_request(NULL, code, www_file, 0);
+                if (send_reply(NULL, response, log, table, &readfds, mode) == SUCCESS)
+                    arm_idle_timer(fd);
+                free(response->buf);
+                free(response);
+                return;
+            }
+            // a body cut short can only be ended by closing
+            if (node->cgi_left > 0)
+                node->cgi_close = 1;
+            close_cgi_pipe(node);
+            continue;
+        }
+        if (node->cgi_left > 0)
+            node->cgi_left -= n;
+        // a chunked answer ends with its last chunk
+        if (node->proxy != NULL && node->proxy->done)
+            node->cgi_left = 0;
+        // a script that keeps talking keeps its time
+        timer_set(timers, fd, TIMER_CGI, node->proxy != NULL ? config.proxy_timeout : config.cgi_timeout);
+    }
+}
+
+/**
+ * pass request body bytes on to a client's CGI script as far as its stdin
+ * pipe takes them: what was read along with the headers first, then
+ * straight from the socket, spliced on plain HTTP. While the pipe is full
+ * the client is not read, so a script slow to read slows down the upload
+ * instead of filling our memory. The pipe is closed once Content-Length
+ * bytes went through; a script that exits early has the rest dropped.
+ * -1 once the client is gone.
+ */
+int feed_cgi_stdin(Node *node)
+{
+    int fd = node->key;
+
+    for (int round = 0; node->body_left > 0; ++round)
+    {
+        if (round == RELAY_ROUNDS)
+        {
+            // come back once the pipe takes more, also covers bytes
+            // SSL already holds where select() cannot see them
+            if (node->cgi_stdin > 0)
+                FD_SET(node->cgi_stdin, writefds);
+            return 0;
+        }
+
+        int n;
+        if (node->in_len > 0)
+        {
+            int size = node->in_len < node->body_left ? node->in_len : node->body_left;
+            n = node->cgi_stdin < 0 ? size : write(node->cgi_stdin, node->in_buf, size);
+            if (n < 0 && errno == EAGAIN)
+            {
+                FD_CLR(fd, readfds);
+                FD_SET(node->cgi_stdin, writefds);
+                return 0;
+            }
+            // a refused connection got none of it, another upstream may take it
+            if (n < 0 && node->proxy != NULL && !node->proxy->sent && retry_upstream(node) == 0)
+                continue;
+            if (n < 0)
+            {
+                // the script stopped reading
+                close_cgi_stdin(node);
+                node->cgi_stdin = -1;
+                continue;
+            }
+            node->in_len -= n;
+            memmove(node->in_buf, node->in_buf + n, node->in_len);
+            node->body_left -= n;
+            if (node->proxy != NULL)
+                node->proxy->sent = 1;
+            continue;
+        }
+
+        FD_SET(fd, readfds);
+        if (node->cgi_stdin > 0)
+            FD_CLR(node->cgi_stdin, writefds);
+
+        // splice() needs a pipe on one end, an upstream socket has none
+        if (node->client_context == NULL && node->cgi_stdin > 0 && node->proxy == NULL)
+        {
+            size_t want = node->body_left < RELAY_CHUNK ? node->body_left : RELAY_CHUNK;
+            n = splice(fd, NULL, node->cgi_stdin, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                node->body_left -= n;
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN)
+            {
+                // either the client sent nothing new or the pipe is full
+                struct pollfd in = {node->cgi_stdin, POLLOUT, 0};
+                if (poll(&in, 1, 0) == 1)
+                    return 0;
+                FD_CLR(fd, readfds);
+                FD_SET(node->cgi_stdin, writefds);
+                return 0;
+            }
+            if (n < 0 && errno == EPIPE)
+            {
+                close_cgi_stdin(node);
+                node->cgi_stdin = -1;
+                continue;
+            }
+        }
+        else
+        {
+            char buf[BUF_SIZE];
+            n = receive(fd, buf, node->client_context);
+            if (n > 0)
+            {
+                node->in_buf = realloc(node->in_buf, node->in_len + n + 1);
+                memcpy(node->in_buf + node->in_len, buf, n);
+                node->in_len += n;
+                node->in_buf[node->in_len] = 0;
+                continue;
+            }
+            if (n < 0 && node->client_context != NULL)
+            {
+                int err = SSL_get_error(node->client_context, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                    return 0;
+            }
+            else if (n < 0 && errno == EAGAIN)
+                return 0;
+        }
+
+        // the client went away halfway through its body
+        return -1;
+    }
+
+    if (node->cgi_stdin != 0)
+        close_cgi_stdin(node);
+    return 0;
+}
+
+/**
+ * start the script of a classic CGI request that holds a slot and wire its
+ * pipes up to the client. Returns the placeholder response, or a 500 if
+ * the script could not be started.
+ */
+Response *start_classic_cgi(int fd, Request *request, Log *log, int *max_sd)
+{
+    Node *node = lookup_table_node(table, fd);
+    char *new_addr = inet_ntoa(((struct sockaddr_in *)node->val)->sin_addr);
+
+    printf("handling CGI! connection: %d, uri: %s\n", node->connection, request->http_uri);
+
+    client_sock = fd;
+    int socket_num = handle_cgi_request(request, log, new_addr, cgi_file, node->connection);
+    if (socket_num == EXIT_FAILURE)
+    {
+        cgi_limit_release(cgi_limiter, fd);
+        client_sock = fd;
+        printf("Handling CGI request failed!\n");
+        return handle_request(NULL, 500, www_file, 0);
+    }
+
+    printf("Ready\n");
+    int stdin_fd = client_sock;
+    client_sock = fd;
+
+    // set max socket, increase num_client
+    *max_sd = MAX(*max_sd, socket_num);
+    *max_sd = MAX(*max_sd, stdin_fd);
+    num_client += 2;
+
+    // log both pipes in the hash table, stdout_pipe[0] in the fd_set
+    insert_table(table, socket_num, NULL, fd);
+    FD_SET(socket_num, readfds);
+    fcntl(socket_num, F_SETFL, fcntl(socket_num, F_GETFL) | O_NONBLOCK);
+    node->cgi_fd = socket_num;
+    insert_table(table, stdin_fd, NULL, fd);
+    fcntl(stdin_fd, F_SETFL, fcntl(stdin_fd, F_GETFL) | O_NONBLOCK);
+    node->cgi_stdin = stdin_fd;
+
+    // the body follows as it arrives, behind the headers
+    node->body_left = request_body_length(request);
+    feed_cgi_stdin(node);
+
+    return forward_cgi_request(request);
+}
+
+/**
+ * finish a CGI request taken up again outside of its client's read event,
+ * it was logged when it came in
+ */
+void resume_cgi(int fd, Request *request, Response *response, Log *log)
+{
+    Node *node = lookup_table_node(table, fd);
+    if (response->code == -1)
+    {
+        timer_set(timers, fd, TIMER_CGI,
+                  cgi_limit_queued(cgi_limiter, fd) ? config.cgi_backlog_timeout : config.cgi_timeout);
+        free(request->headers);
+        free(request->buf);
+        free(request);
+    }
+    else
+    {
+        node->is_cgi = 0;
+        client_sock = fd;
+        if (send_reply(request, response, log, table, &readfds, node->connection == https_sock ? 1 : 0) == SUCCESS)
+            arm_idle_timer(fd);
+        free(response->buf);
+    }
+    free(response);
+}
+
+/**
+ * start the CGI requests that waited for a slot and may have one now
+ */
+void start_queued_cgi(Log *log, int *max_sd)
+{
+    char *buf;
+    int len, fd;
+    while ((fd = cgi_limit_next(cgi_limiter, &buf, &len)) >= 0)
+    {
+        Node *node = lookup_table_node(table, fd);
+        Request *request = node == NULL ? NULL : parse(buf, len, fd);
+        if (request == NULL)
+        {
+            cgi_limit_release(cgi_limiter, fd);
+            free(buf);
+            continue;
+        }
+
+        resume_cgi(fd, request, start_classic_cgi(fd, request, log, max_sd), log);
+    }
+}
+
+/**
+ * hand a CGI request to whoever answers it: the response cache, a FastCGI
+ * worker or a classic script. Returns the response to send now, or the
+ * placeholder (code -1) if the answer comes later. use_cache is 0 for a
+ * request that waited on the cache in vain already.
+ */
+Response *handle_cgi(int fd, Request *request, int len, Log *log, int *max_sd, int use_cache)
+{
+    Node *node = lookup_table_node(table, fd);
+    Response *response;
+
+    int https = node->connection == https_sock;
+    char *key = use_cache && cgi_cache != NULL ? cgi_cache_key(cgi_cache, request, https) : NULL;
+    if (key != NULL)
+    {
+        Cache_Entry *entry;
+        int found = cgi_cache_lookup(cgi_cache, key, fd, request->buf, request->header_length, &entry);
+        free(key);
+        if (found == CACHE_HIT)
+            return cached_response(entry, fd);
+        if (found == CACHE_WAIT)
+        {
+            printf("CGI request of socket %d waits for the same one to finish\n", fd);
+            return forward_cgi_request(request);
+        }
+        if (found == CACHE_MISS)
+            node->cache_fill = entry;
+    }
+
+    if (!classic_cgi_route(request->http_uri))
+    {
+        // a FastCGI worker takes it, the answer comes back through
+        // fcgi_response()
+        char *new_addr = inet_ntoa(((struct sockaddr_in *)node->val)->sin_addr);
+        char **envp = get_env_ptrs(request, node->connection, new_addr);
+        // the buffer holds exactly this request, the rest is body
+        int val = len - request->header_length;
+
+        if (fcgi_submit(fcgi, fd, envp, request->buf + request->header_length, val) != 0)
+        {
+            response = handle_request(NULL, 500, www_file, 0);
+            printf("Handling FastCGI request failed!\n");
+        }
+        else
+            response = forward_cgi_request(request);
+    }
+    else
+    {
+        // classic CGI, as many at once as the limits allow
+        char script[HEADER_BUF_SIZE];
+        snprintf(script, sizeof(script), "%.*s",
+                 (int)strcspn(request->http_uri, "?"), request->http_uri);
 
-        insert_map(map, pid, client_sock);
+        switch (cgi_limit_acquire(cgi_limiter, fd, script, request->buf, request->header_length))
+        {
+        case CGI_RUN:
+            response = start_classic_cgi(fd, request, log, max_sd);
+            break;
+        case CGI_QUEUED:
+            printf("CGI request of socket %d waits for a slot\n", fd);
+            response = forward_cgi_request(request);
+            break;
+        default:
+            response = handle_request(NULL, 503, www_file, 0);
+            break;
+        }
+    }
 
-        // then change client_sock to stdin_pipe[1], the place to write
+    // nobody is going to fill the entry after all
+    if (response->code != -1 && node->cache_fill != NULL)
+        cache_filled(node, -1, log);
+    return response;
+}
 
-        client_sock = stdin_pipe[1];
-        printf("client_sock: %d\n", stdin_pipe[1]);
+/**
+ * run the native handler of route for the request of client fd. Returns
+ * its response, or the placeholder if it answers through plugin_response()
+ */
+Response *handle_plugin(int fd, Request *request, int len, int route)
+{
+    Node *node = lookup_table_node(table, fd);
+    char *addr = inet_ntoa(((struct sockaddr_in *)node->val)->sin_addr);
+    char *http;
+    int http_len, code;
+
+    printf("handling plugin request! uri: %s\n", request->http_uri);
+    if (plugin_dispatch(plugins, route, fd, request, request->buf + request->header_length,
+                        len - request->header_length, addr, node->connection == https_sock,
+                        &http, &http_len, &code) == PLUGIN_PENDING)
+        return forward_cgi_request(request);
+    return plugin_reply(fd, code, http, http_len);
+}
 
-        // tell server how to handle sigchild
-        struct sigaction sa;
-        sa.sa_sigaction = &sig_child_handler;
-        sa.sa_flags = SA_SIGINFO;
+/**
+ * answer client fd with the metrics, plus the counters other parts of the
+ * server keep for their digests
+ */
+Response *handle_metrics(int fd)
+{
+    Metrics_Value values[] = {
+        {"lisod_connections_active", "Open client and upstream connections.", "gauge", num_client},
+        {"lisod_cgi_spawns_total", "CGI scripts and FastCGI workers started.", "counter",
+         reaper->spawned + (fcgi != NULL ? fcgi->spawned : 0)},
+        {"lisod_cgi_cache_hits_total", "CGI responses served from the cache.", "counter",
+         cgi_cache != NULL ? cgi_cache->hits : 0},
+        {"lisod_cgi_cache_misses_total", "Cacheable CGI requests the cache could not answer.", "counter",
+         cgi_cache != NULL ? cgi_cache->misses : 0},
+        {"lisod_tls_handshakes_total", "TLS handshakes completed.", "counter", tls_stats.handshakes},
+        {"lisod_tls_resumed_total", "TLS handshakes that resumed a session.", "counter", tls_stats.resumed},
+        {"lisod_loop_stalls_total", "Event loop rounds longer than stall_threshold.", "counter",
+         watchdog != NULL ? __atomic_load_n(&watchdog->stalls, __ATOMIC_RELAXED) : 0},
+        {"lisod_tls_handshake_queue_depth", "TLS handshakes waiting for a worker thread.", "gauge",
+         tls_stats.queue_depth},
+        {"lisod_tls_handshake_queue_max", "Most TLS handshakes ever waiting for a worker thread.", "gauge",
+         tls_stats.queue_max},
+        {"lisod_tls_handshake_duration_seconds", "From accept() to TLS handshake done.", "summary", 1e-6, NULL,
+         &tls_stats.handshake_us},
+    };
+    int fixed = sizeof(values) / sizeof(values[0]);
+    int upstreams = 0;
+    for (int r = 0; proxy != NULL && r < proxy->count; ++r)
+        upstreams += proxy->routes[r].count;
+    Metrics_Value *all = calloc(fixed + 8 + 7 * upstreams, sizeof(Metrics_Value));
+    memcpy(all, values, sizeof(values));
+    int count = fixed;
+
+    if (cgi_limiter != NULL)
+    {
+        Metrics_Value cgi[] = {
+            {"lisod_cgi_running", "CGI scripts holding a slot.", "gauge", cgi_limiter->running},
+            {"lisod_cgi_queued", "CGI requests waiting for a slot.", "gauge", cgi_limiter->queued},
+            {"lisod_cgi_admitted_total", "CGI requests given a slot.", "counter", cgi_limiter->admitted},
+            {"lisod_cgi_rejected_total", "CGI requests turned away with a full queue.", "counter",
+             cgi_limiter->rejected},
+            {"lisod_cgi_expired_total", "CGI requests that gave up waiting for a slot.", "counter",
+             cgi_limiter->expired},
+            {"lisod_cgi_queue_length", "CGI queue length seen by requests that had to wait.", "summary", 1, NULL,
+             &cgi_limiter->queue_length},
+            {"lisod_cgi_queue_wait_seconds", "Time CGI requests waited for a slot.", "summary", 1e-3, NULL,
+             &cgi_limiter->wait_ms},
+        };
+        memcpy(all + count, cgi, sizeof(cgi));
+        count += sizeof(cgi) / sizeof(cgi[0]);
+    }
 
-        sigemptyset(&sa.sa_mask);
-        if (sigaction(SIGCHLD, &sa, 0) == -1)
+    // one series per upstream, those of a name next to each other
+    char **labels = calloc(upstreams + 1, sizeof(char *));
+    Upstream **servers = calloc(upstreams + 1, sizeof(Upstream *));
+    int u = 0;
+    for (int r = 0; proxy != NULL && r < proxy->count; ++r)
+    {
+        for (int k = 0; k < proxy->routes[r].count; ++k, ++u)
         {
-            perror(0);
-            exit(1);
+            servers[u] = &proxy->routes[r].servers[k];
+            labels[u] = malloc(strlen(servers[u]->name) + strlen(proxy->routes[r].prefix) + 32);
+            sprintf(labels[u], "route=\"%s\",upstream=\"%s\"", proxy->routes[r].prefix, servers[u]->name);
         }
+    }
+    for (u = 0; u < upstreams; ++u)
+        all[count++] = (Metrics_Value){"lisod_upstream_requests_total", "Requests handed to an upstream.",
+                                       "counter", servers[u]->requests, labels[u]};
+    for (u = 0; u < upstreams; ++u)
+        all[count++] = (Metrics_Value){"lisod_upstream_connects_total", "New connections made to an upstream.",
+                                       "counter", servers[u]->connects, labels[u]};
+    for (u = 0; u < upstreams; ++u)
+        all[count++] = (Metrics_Value){"lisod_upstream_reused_total",
+                                       "Requests sent on a kept alive upstream connection.", "counter",
+                                       servers[u]->reused, labels[u]};
+    for (u = 0; u < upstreams; ++u)
+        all[count++] = (Metrics_Value){"lisod_upstream_failures_total", "Upstream connects or answers that failed.",
+                                       "counter", servers[u]->failures, labels[u]};
+    for (u = 0; u < upstreams; ++u)
+        all[count++] = (Metrics_Value){"lisod_upstream_active", "Upstream connections answering a request.",
+                                       "gauge", servers[u]->active, labels[u]};
+    for (u = 0; u < upstreams; ++u)
+        all[count++] = (Metrics_Value){"lisod_upstream_idle", "Upstream connections kept alive for reuse.", "gauge",
+                                       servers[u]->idle_count, labels[u]};
+    for (u = 0; u < upstreams; ++u)
+        all[count++] = (Metrics_Value){"lisod_upstream_duration_seconds",
+                                       "Request handed to an upstream to its response headers in.", "summary",
+                                       1e-6, labels[u], &servers[u]->latency_us};
+
+    int body_len;
+    char *body = metrics_render(metrics, all, count, &body_len);
+    for (u = 0; u < upstreams; ++u)
+        free(labels[u]);
+    free(labels);
+    free(servers);
+    free(all);
+
+    char head[256];
+    int head_len = snprintf(head, sizeof(head),
+                            "HTTP/1.1 200 OK\r\nServer: Liso/1.0\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n"
+                            "Connection: %s\r\n\r\n",
+                            body_len, requests_left(fd) == 0 ? "close" : "keep-alive");
+    char *http = malloc(head_len + body_len);
+    memcpy(http, head, head_len);
+    memcpy(http + head_len, body, body_len);
+    free(body);
+    return plugin_reply(fd, 200, http, head_len + body_len);
+}
 
-        // return the other fd for log
+/**
+ * pass the request of client fd on to an upstream of route. Its connection
+ * stands in for a CGI script's pipes: the head and the body go out through
+ * feed_cgi_stdin(), the answer streams back through relay_cgi_output().
+ * Returns the placeholder, or a 502 if no upstream could be reached.
+ */
+Response *handle_proxy(int fd, Request *request, int route, int *max_sd)
+{
+    Node *node = lookup_table_node(table, fd);
+    char *addr = inet_ntoa(((struct sockaddr_in *)node->val)->sin_addr);
 
-        return stdout_pipe[0];
+    printf("handling proxy request! uri: %s\n", request->http_uri);
+    Proxy_Conn *c = proxy_connect(proxy, route);
+    if (c == NULL)
+    {
+        printf("No upstream reachable for socket %d\n", fd);
+        return handle_request(NULL, 502, www_file, 0);
     }
-    /*************** END FORK **************/
 
-    fprintf(stderr, "Process exiting, badly...how did we get here!?\n");
-    return EXIT_FAILURE;
+    *max_sd = MAX(*max_sd, c->fd);
+    num_client++;
+    insert_table(table, c->fd, NULL, fd);
+    FD_SET(c->fd, readfds);
+    node->proxy = c;
+    node->cgi_fd = c->fd;
+    node->cgi_stdin = c->fd;
+
+    // the head goes out ahead of the body bytes read along with it
+    int head_len;
+    char *head = proxy_request_head(c, request, addr, node->connection == https_sock, &head_len);
+    node->in_buf = realloc(node->in_buf, node->in_len + head_len + 1);
+    memmove(node->in_buf + head_len, node->in_buf, node->in_len);
+    memcpy(node->in_buf, head, head_len);
+    node->in_len += head_len;
+    node->in_buf[node->in_len] = 0;
+    free(head);
+
+    node->body_left = head_len + request_body_length(request);
+    feed_cgi_stdin(node);
+
+    return forward_cgi_request(request);
 }
 
-Response *forward_cgi_request(Request *request)
+/**
+ * run the requests that waited for an identical one in vain, its response
+ * could not be shared
+ */
+void run_cache_retries(Log *log, int *max_sd)
 {
-    Response *ret = malloc(sizeof(Response));
-    int val = 0;
+    while (cgi_cache != NULL && cgi_cache->retry != NULL)
+    {
+        Cache_Waiter *waiter = cgi_cache->retry;
+        cgi_cache->retry = waiter->next;
+        int fd = waiter->fd;
+        Node *node = lookup_table_node(table, fd);
+        Request *request = node == NULL || !node->is_cgi ? NULL : parse(waiter->request, waiter->len, fd);
+        if (request == NULL)
+            free(waiter->request);
+        free(waiter);
+        if (request != NULL)
+            resume_cgi(fd, request, handle_cgi(fd, request, request->header_length, log, max_sd, 0), log);
+    }
+}
 
-    for (int k = 0; k < request->header_count; ++k)
+void handle_timeout(int fd, int type, void *arg)
+{
+    Log *log = (Log *)arg;
+    Response *response;
+    Node *node = lookup_table_node(table, fd);
+
+    // not a client (anymore)
+    if (node == NULL || node->val == NULL)
+        return;
+
+    int mode = node->connection == https_sock ? 1 : 0;
+
+    switch (type)
     {
-        Request_header header = request->headers[k];
-        if (strcmp(header.header_name, "Content-Length") == 0)
+    case TIMER_HEADER:
+    case TIMER_BODY:
+        printf("Request timed out on socket %d\n", fd);
+        response = handle_request(NULL, 408, www_file, 0);
+        break;
+    case TIMER_CGI:
+        if (cgi_limit_queued(cgi_limiter, fd))
         {
-            val = atoi(header.header_value);
+            printf("CGI request of socket %d got no slot in time\n", fd);
+            cgi_limiter->expired++;
+            abort_cgi(node);
+            response = handle_request(NULL, 503, www_file, 0);
             break;
         }
+        // kill the script and stop listening to its output
+        printf("CGI timed out for socket %d\n", fd);
+        if (node->proxy != NULL)
+            node->proxy->upstream->failures++;
+        if (node->cgi_relay)
+        {
+            // part of the response is out, all we can do is cut it off
+            abort_cgi(node);
+            close_connection(fd);
+            return;
+        }
+        abort_cgi(node);
+        response = handle_request(NULL, 504, www_file, 0);
+        break;
+    case TIMER_HANDSHAKE:
+        printf("TLS handshake timed out on socket %d\n", fd);
+        // a worker still holds the SSL, close when it hands it back
+        if (node->tls_state == TLS_OFFLOADED)
+            node->tls_state = TLS_ABORTED;
+        else
+            close_connection(fd);
+        return;
+    case TIMER_SEND:
+        // too late for anything but cutting the reply off
+        printf("Socket %d stopped taking its reply\n", fd);
+        close_connection(fd);
+        return;
+    case TIMER_KEEPALIVE:
+    default:
+        printf("Closing idle socket %d\n", fd);
+        close_connection(fd);
+        return;
     }
 
-    // val should never be 0 at this point
-
-    ret->buf = request->buf;
-    ret->real_size = request->header_length + val;
-    ret->size = -1;
-    ret->close = -1;
-    ret->code = -1;
-
-    return ret;
-}
-
-Response *forward_cgi_response(char *new_buf, int len, int i)
-{
-    Response *ret = malloc(sizeof(Response));
-    ret->buf = new_buf;
-    ret->real_size = len;
-    ret->size = -1;
-    ret->close = 0;
-    ret->code = -1;
-    return ret;
+    client_sock = fd;
+    send_reply(NULL, response, log, table, &readfds, mode);
+    free(response->buf);
+    free(response);
 }
 
 int lisod_start()
@@ -1230,6 +3128,13 @@ int lisod_start()
 
     Log *log = log_init_default(log_file);
 
+    /* a script or client that went away shows up as EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* classic CGI scripts are spawned by a helper forked while we are small */
+    if (config.cgi_zygote && zygote_start() != 0)
+        error_log(log, "", "Error starting the CGI zygote, falling back to fork().\n");
+
     // daemonize(lock_file, log);
 
     log_refresh(log);
@@ -1261,6 +3166,22 @@ int lisod_start()
         error_log(log, "", "Error associating certificate.\n");
         return EXIT_FAILURE;
     }
+
+    /* let the kernel encrypt when it can, so HTTPS can use sendfile() */
+    if (config.ktls)
+        SSL_CTX_set_options(ssl_context, SSL_OP_ENABLE_KTLS);
+
+    /* CGI output may move in its queue while a record waits to be resent */
+    SSL_CTX_set_mode(ssl_context, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    /* session cache and tickets for resumed handshakes */
+    if (tls_setup_sessions(ssl_context) != 0)
+    {
+        SSL_CTX_free(ssl_context);
+        ssl_context = NULL;
+        error_log(log, "", "Error setting up TLS session resumption.\n");
+        return EXIT_FAILURE;
+    }
     /************ END SSL INIT ************/
 
     fprintf(stdout, "----- Liso Server v1.0 -----\n");
@@ -1336,37 +3257,151 @@ int lisod_start()
 
     /************ END CREATE HTTPS SERVER ************/
 
+    // one fd in hand for when accept() runs out of them
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
     /************ MAIN LOOP ************/
     table = create_table(TABLE_SIZE);
     map = create_map(TABLE_SIZE);
+    timers = create_timer_wheel(MAX_CLIENT);
 
-    fd_set *readfds = malloc(sizeof(fd_set));
+    readfds = malloc(sizeof(fd_set));
+    writefds = malloc(sizeof(fd_set));
     int max_sd = MAX(sock, https_sock);
 
     FD_ZERO(readfds);
+    FD_ZERO(writefds);
+    FD_ZERO(&ready_fds);
+    ready_count = 0;
     FD_SET(sock, readfds);
     FD_SET(https_sock, readfds);
 
+    if (zygote_fd() >= 0)
+    {
+        FD_SET(zygote_fd(), readfds);
+        max_sd = MAX(max_sd, zygote_fd());
+    }
+
+    // before any thread or worker is started, they inherit the blocked SIGCHLD
+    reaper = create_reaper();
+    if (reaper->fd >= 0)
+    {
+        FD_SET(reaper->fd, readfds);
+        max_sd = MAX(max_sd, reaper->fd);
+    }
+
+    cgi_env = create_cgi_env(http_port, https_port);
+    cgi_limiter = create_cgi_limiter(config.cgi_max, config.cgi_max_per_script, config.cgi_backlog);
+    if (config.cgi_cache_size > 0)
+        cgi_cache = create_cgi_cache(config.cgi_cache_size, config.cgi_cache_vary, config.cgi_cache_pass);
+
+    if (config.fcgi_app != NULL)
+        fcgi = create_fcgi_pool(config.fcgi_app, config.fcgi_min, config.fcgi_max, config.fcgi_mpx,
+                                config.fcgi_idle_timeout, config.fcgi_abort_timeout, readfds, writefds,
+                                fcgi_response, log);
+
+    if (config.metrics_uri != NULL)
+        metrics = create_metrics(config.metrics_uri);
+    if (config.trace_file != NULL && (tracer = create_tracer(config.trace_file, config.trace_sample)) == NULL)
+        fprintf(stderr, "Cannot open trace file %s.\n", config.trace_file);
+    if (config.stats_shm != NULL)
+    {
+        if ((shm_stats = create_shm_stats(config.stats_shm)) != NULL)
+            loop_stats = shm_stats_worker(shm_stats, "loop");
+        else
+            fprintf(stderr, "Cannot create shared memory stats %s.\n", config.stats_shm);
+    }
+    if (config.stall_threshold > 0 &&
+        (watchdog = create_watchdog(config.stall_threshold, config.stall_backtrace, stall_report, log)) == NULL)
+        fprintf(stderr, "Cannot start the event loop watchdog.\n");
+
+    if (config.proxy != NULL)
+        proxy = create_proxy(config.proxy, config.proxy_balance, config.proxy_keepalive, config.proxy_idle_timeout);
+
+    if (config.plugins != NULL)
+        plugins = create_plugin_host(config.plugins, config.plugin_workers, plugin_response, log);
+    if (plugins != NULL)
+    {
+        // finished asynchronous and blocking handlers wake the loop
+        FD_SET(plugins->notify_fd[0], readfds);
+        max_sd = MAX(max_sd, plugins->notify_fd[0]);
+        if (plugins->workers != NULL)
+        {
+            FD_SET(plugins->workers->notify_fd[0], readfds);
+            max_sd = MAX(max_sd, plugins->workers->notify_fd[0]);
+        }
+    }
+
+    // workers wake the loop through a pipe when a handshake step is done
+    if (config.tls_workers > 0 && (tls_pool = create_thread_pool(config.tls_workers)) != NULL)
+    {
+        FD_SET(tls_pool->notify_fd[0], readfds);
+        max_sd = MAX(max_sd, tls_pool->notify_fd[0]);
+    }
+
     /* finally, loop waiting for input and then write it back */
     while (1)
     {
         printf("Potato...%d\n", max_sd);
 
+        loop_phase("maintenance");
+        if (fcgi != NULL)
+        {
+            fcgi_maintain(fcgi);
+            max_sd = MAX(max_sd, fcgi->max_fd);
+        }
+
+        if (proxy != NULL)
+            proxy_maintain(proxy);
+
+        // without a signalfd, look for exited children every round
+        if (reaper->fd < 0)
+            reaper_read(reaper, child_exited);
+
+        // CGI slots freed up last round
+        loop_phase("queued CGI");
+        start_queued_cgi(log, &max_sd);
+        run_cache_retries(log, &max_sd);
+
         fd_set newfds = *readfds;
+        fd_set new_writefds = *writefds;
+
+        // set timeout value: the nearest connection deadline, but wake up
+        // at least every WAIT seconds to look after finished CGI scripts
 
-        // set timeout value
+        int wait_ms = timer_next_timeout(timers);
+        if (wait_ms < 0 || wait_ms > WAIT * 1000)
+            wait_ms = WAIT * 1000;
+        // buffered requests are served right away
+        if (ready_count > 0)
+            wait_ms = 0;
 
         struct timeval *timeout = malloc(sizeof(struct timeval));
-        timeout->tv_sec = WAIT;
-        timeout->tv_usec = 0;
+        timeout->tv_sec = wait_ms / 1000;
+        timeout->tv_usec = (wait_ms % 1000) * 1000;
 
         int select_val;
 
         // select
         printf("max sd: %d\n", max_sd);
 
-        if ((select_val = select(max_sd + 1, &newfds, NULL, NULL, timeout)) < 0)
+        if (loop_stats != NULL)
+            publish_stats(0);
+        if (watchdog != NULL)
+            watchdog_idle(watchdog);
+        select_val = select(max_sd + 1, &newfds, &new_writefds, NULL, timeout);
+        if (watchdog != NULL)
+            watchdog_busy(watchdog, timer_now_us());
+        if (loop_stats != NULL)
+            publish_stats(1);
+        if (select_val < 0)
         {
+            // a signal we handle, e.g. SIGHUP, is no reason to stop
+            if (errno == EINTR)
+            {
+                free(timeout);
+                continue;
+            }
             printf("Select error! Errno: %d\n", errno);
             error_log(log, "", "Error select.\n");
             lisod_shutdown(EXIT_FAILURE);
@@ -1375,40 +3410,35 @@ int lisod_start()
 
         free(timeout);
 
-        // handling timeout
-
-        if (select_val == 0)
+        // clients whose next request was buffered already count as readable,
+        // they are served from in_buf without another receive()
+        fd_set was_ready;
+        FD_ZERO(&was_ready);
+        if (ready_count > 0)
         {
             for (int i = 0; i < max_sd + 1; i++)
             {
-                // TODO do NOT send a timeout response to the CGI script!
-                if (i != sock && lookup_table(table, i) != NULL && lookup_table_cgi(table, i) == 0)
+                Node *node = FD_ISSET(i, &ready_fds) ? lookup_table_node(table, i) : NULL;
+                if (node == NULL || node->val == NULL || node->is_cgi != 0 || reply_pending(node) ||
+                    !request_ready(node))
+                    continue;
+                FD_SET(i, &was_ready);
+                if (!FD_ISSET(i, &newfds))
                 {
-                    printf("Send a timeout response!\n");
-                    // send to that client that we have timed out!
-                    client_sock = i;
-                    Response *response = handle_request(NULL, 408, www_file);
-                    int k = send_reply(NULL, response, log, table, &readfds, 0);
-                    if (k == EXIT_FAILURE)
-                    {
-                        printf("1\n");
-                        free(response->buf);
-                        free(response);
-                        printf("In 657\n");
-                        return EXIT_FAILURE;
-                    }
-                    else if (k == CLOSE_SOCKET_FAILURE)
-                    {
-                        printf("2\n");
-                        free(response->buf);
-                        free(response);
-                        printf("In 657\n");
-                    }
-                    free(response->buf);
-                    free(response);
-                    printf("In 662\n");
+                    FD_SET(i, &newfds);
+                    select_val++;
                 }
+            }
+            FD_ZERO(&ready_fds);
+            ready_count = 0;
+        }
+
+        // handling CGI clients whose scripts are gone
 
+        if (select_val == 0)
+        {
+            for (int i = 0; i < max_sd + 1; i++)
+            {
                 // handling CGI clients whose requests are closed!
 
                 if (i != sock && lookup_table(table, i) != NULL && lookup_table_cgi(table, i) == -1)
@@ -1416,80 +3446,162 @@ int lisod_start()
                     printf("Send a close response!\n");
                     // send to that client that we have timed out!
                     client_sock = i;
-                    Response *response = handle_request(NULL, 500, www_file);
-                    int k = send_reply(NULL, response, log, table, &readfds, 0);
-                    if (k == EXIT_FAILURE)
-                    {
-                        printf("1\n");
-                        free(response->buf);
-                        free(response);
-                        printf("In 1423\n");
-                        return EXIT_FAILURE;
-                    }
-                    else if (k == CLOSE_SOCKET_FAILURE)
-                    {
-                        printf("2\n");
-                        free(response->buf);
-                        free(response);
-                        printf("In 1431\n");
-                    }
+                    Response *response = handle_request(NULL, 500, www_file, 0);
+                    send_reply(NULL, response, log, table, &readfds, 0);
                     free(response->buf);
                     free(response);
                     printf("In 1435\n");
                 }
             }
-            printf("Finished sending timeout responses!\n");
+            printf("Finished sending close responses!\n");
+            loop_phase("timers");
+            timer_expire(timers, handle_timeout, log);
             continue;
         }
 
         for (int i = 0; i < max_sd + 1; i++)
         {
-            if (FD_ISSET(i, &newfds))
+            // TLS handshakes and CGI responses waiting to write
+            if (FD_ISSET(i, &new_writefds) && FD_ISSET(i, writefds))
+            {
+                loop_phase("writable");
+                if (fcgi != NULL && fcgi_is_worker(fcgi, i))
+                {
+                    // a FastCGI worker ready for more queued records
+                    fcgi_write(fcgi, i);
+                    continue;
+                }
+                Node *node = lookup_table_node(table, i);
+                if (node != NULL && node->val == NULL)
+                {
+                    // a CGI script ready for more of its request body
+                    Node *client = lookup_table_node(table, node->connection);
+                    if (client == NULL || client->cgi_stdin != i)
+                        FD_CLR(i, writefds);
+                    else if (feed_cgi_stdin(client) != 0)
+                    {
+                        abort_cgi(client);
+                        close_connection(client->key);
+                    }
+                }
+                else if (node != NULL && node->cgi_relay)
+                    relay_cgi_output(node, log);
+                else if (node != NULL && node->tls_state != TLS_HANDSHAKE && reply_pending(node))
+                    flush_reply(node);
+                else
+                    continue_handshake(i, log);
+                continue;
+            }
+
+            // skip sockets closed earlier in this round
+            if (FD_ISSET(i, &newfds) && FD_ISSET(i, readfds))
             {
                 printf("We got one %d\n", i);
+
+                loop_phase("readable");
+                if (tls_pool != NULL && i == tls_pool->notify_fd[0])
+                {
+                    thread_pool_complete(tls_pool, log);
+                    continue;
+                }
+
+                if (plugins != NULL && plugin_is_notify(plugins, i))
+                {
+                    // native handlers that finished off the loop
+                    plugin_complete(plugins);
+                    continue;
+                }
+
+                if (i == reaper->fd)
+                {
+                    // exit notices of children we forked ourselves
+                    reaper_read(reaper, child_exited);
+                    continue;
+                }
+
+                if (i == zygote_fd())
+                {
+                    // exit notices of CGI scripts
+                    if (zygote_read(cgi_exited) != 0)
+                        FD_CLR(i, readfds);
+                    continue;
+                }
+
+                if (fcgi != NULL && fcgi_is_worker(fcgi, i))
+                {
+                    fcgi_read(fcgi, i);
+                    continue;
+                }
+
+                // output of a classic CGI script, pipes have no address
+                Node *pipe_node = lookup_table_node(table, i);
+                if (pipe_node != NULL && pipe_node->val == NULL && i != sock && i != https_sock)
+                {
+                    loop_phase("CGI relay");
+                    Node *node = lookup_table_node(table, pipe_node->connection);
+                    if (node != NULL && node->cgi_fd == i)
+                        relay_cgi_output(node, log);
+                    else
+                    {
+                        // its client is gone
+                        close(i);
+                        FD_CLR(i, readfds);
+                        remove_table(table, i);
+                        num_client--;
+                    }
+                    continue;
+                }
+
                 client_sock = i;
 
                 if (i == sock || i == https_sock)
                 {
                     // accept HTTP and HTTPS connections
+                    loop_phase("accept");
 
                     struct sockaddr *temp_addr;
                     temp_addr = (struct sockaddr *)malloc(sizeof(struct sockaddr));
                     cli_size = sizeof(temp_addr);
 
                     int new_socket;
+                    unsigned long accept_start = timer_now_us();
                     if ((new_socket = accept(i, temp_addr,
                                              &cli_size)) == -1)
                     {
+                        if (errno == EMFILE || errno == ENFILE)
+                        {
+                            // out of fds: drop the oldest idle connection so
+                            // the next client fits, and turn this one away
+                            free(temp_addr);
+                            shed_idle_connections(table->idle_count > 0 ? table->idle_count - 1 : 0);
+                            turn_away_pending(i);
+                            continue;
+                        }
                         error_log(log, "", "Error accepting connection.\n");
                         lisod_shutdown(EXIT_FAILURE);
                         return EXIT_FAILURE;
                     }
 
-                    // set sockets as non blocking
-                    // TODO: check for SSL errors like non-block early read/write returns
-                    // fcntl(i, F_SETFL, O_NONBLOCK);
-                    // fcntl(new_socket, F_SETFL, O_NONBLOCK);
+                    // replies are written whole (or corked), nothing to gain from Nagle
+                    int nodelay = 1;
+                    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-                    // return 503 code when unable to accept more connections
+                    // client sockets never block, what they do not take now
+                    // waits in their output queue
+                    fcntl(new_socket, F_SETFL, fcntl(new_socket, F_GETFL) | O_NONBLOCK);
 
-                    if (num_client == MAX_CLIENT)
+                    // fds get the lowest free number, a high one means few
+                    // are left: make room by dropping idle connections
+                    if (new_socket >= fd_limit - config.fd_reserve)
+                        shed_idle_connections(table->idle_count > 0 ? table->idle_count - 1 : 0);
+
+                    // select() and the timers only go up to FD_SETSIZE
+                    if (new_socket >= MAX_CLIENT)
                     {
-                        Response *response = handle_request(NULL, 503, www_file);
-                        insert_table(table, i, temp_addr, i);
-                        if (send_reply(NULL, response, log, table, &readfds, 0) == EXIT_FAILURE)
-                        {
-                            printf("2\n");
-                            free(response->buf);
-                            free(response);
-                            printf("In 699\n");
-                            return EXIT_FAILURE;
-                        }
-                        free(response->buf);
-                        free(response);
-                        printf("In 704\n");
+                        printf("Socket %d is past what select() takes, turning it away\n", new_socket);
+                        turn_away(new_socket, i);
+                        free(temp_addr);
                     }
-
                     else
                     {
                         if (i == sock)
@@ -1499,32 +3611,34 @@ int lisod_start()
                         else if (i == https_sock)
                         {
                             /************ WRAP SOCKET WITH SSL ************/
-                            if ((client_context = SSL_new(ssl_context)) == NULL)
-                            {
-                                error_log(log, "", "Error creating client SSL context.\n");
-                                lisod_shutdown(EXIT_FAILURE);
-                                return EXIT_FAILURE;
-                            }
-
-                            if (SSL_set_fd(client_context, new_socket) == 0)
+                            // the handshake runs from the select() loop, so a
+                            // silent client cannot hold up everyone else
+                            if ((client_context = SSL_new(ssl_context)) == NULL ||
+                                SSL_set_fd(client_context, new_socket) == 0)
                             {
                                 error_log(log, "", "Error creating client SSL context.\n");
-                                lisod_shutdown(EXIT_FAILURE);
-                                return EXIT_FAILURE;
-                            }
-
-                            if (SSL_accept(client_context) <= 0)
-                            {
-
-                                error_log(log, "", "Error accepting (handshake) client SSL context.\n");
-                                lisod_shutdown(EXIT_FAILURE);
-                                return EXIT_FAILURE;
+                                if (client_context != NULL)
+                                    SSL_free(client_context);
+                                close(new_socket);
+                                free(temp_addr);
+                                continue;
                             }
+                            SSL_set_accept_state(client_context);
                             /************ END WRAP SOCKET WITH SSL ************/
                             insert_table_with_context(table, new_socket, temp_addr, https_sock, client_context);
+                            lookup_table_node(table, new_socket)->handshake_start = timer_now_us();
                         }
                         num_client++;
+                        phase_mark(new_socket, PHASE_ACCEPT, accept_start);
+                        if (loop_stats != NULL)
+                            shm_count(loop_stats, SHM_ACCEPTED, 1);
+                        if (metrics != NULL)
+                            metrics_count(metrics, MET_ACCEPTED, 1);
                         FD_SET(new_socket, readfds);
+                        if (i == https_sock)
+                            timer_set(timers, new_socket, TIMER_HANDSHAKE, config.handshake_timeout);
+                        else
+                            timer_set(timers, new_socket, TIMER_HEADER, config.header_timeout);
                         if (new_socket > max_sd)
                         {
                             max_sd = new_socket;
@@ -1538,6 +3652,26 @@ int lisod_start()
 
                     printf("Potato*******************************\n");
 
+                    // TLS handshake still going on
+                    Node *tls_node = lookup_table_node(table, i);
+                    if (tls_node != NULL && tls_node->tls_state == TLS_HANDSHAKE)
+                    {
+                        loop_phase("TLS handshake");
+                        continue_handshake(i, log);
+                        continue;
+                    }
+
+                    // request body on its way to a CGI script
+                    if (tls_node != NULL && tls_node->cgi_stdin != 0)
+                    {
+                        if (feed_cgi_stdin(tls_node) != 0)
+                        {
+                            abort_cgi(tls_node);
+                            close_connection(i);
+                        }
+                        continue;
+                    }
+
                     // check the type of connection from table
                     int mode_sock = lookup_table_connection(table, i);
 
@@ -1558,7 +3692,16 @@ int lisod_start()
 
                     // ******** Handling HTTP and HTTPS receive ********
 
-                    if ((readret = receive(i, buf, client_context)) >= 1)
+                    // a client that sent more than a request can hold, or whose
+                    // next request is in already, is not read until that is
+                    // served, it is in its buffer already
+                    Node *reader = lookup_table_node(table, i);
+                    long in_max = HEADER_BUF_SIZE + (long)config.max_body_size;
+                    int full = (reader != NULL && reader->in_len >= in_max) || FD_ISSET(i, &was_ready);
+                    readret = 0;
+
+                    loop_phase("receive");
+                    if (full || (readret = receive(i, buf, client_context)) >= 1)
                     {
                         printf("Received!!!\n");
 
@@ -1571,12 +3714,19 @@ int lisod_start()
                         if (readret == BUF_SIZE)
                         {
                             printf("Start Reading a new line!!!\n");
-                            while (readret == BUF_SIZE)
+                            while (readret == BUF_SIZE && (reader == NULL || reader->in_len + len < in_max))
                             {
                                 printf("Reading a new line!!!\n");
                                 new_buf = realloc(new_buf, len + BUF_SIZE + 1);
                                 bzero(new_buf + len, BUF_SIZE + 1);
                                 readret = receive(i, new_buf + len, client_context);
+                                // drained for now, an EOF or error shows up
+                                // again next round
+                                if (readret <= 0)
+                                {
+                                    readret = len;
+                                    break;
+                                }
                                 len += readret;
                             }
                             // int k, val;
@@ -1593,7 +3743,7 @@ int lisod_start()
                             // {
                             //     // send a response of 411
                             //     printf("DID NOT SEE CONTENT LENGTH!\n");
-                            //     response = handle_request(NULL, 411, www_file);
+                            //     response = handle_request(NULL, 411, www_file, 0);
                             // }
                             // else
                             // {
@@ -1620,6 +3770,55 @@ int lisod_start()
                             // read more stuff from body
                         }
 
+                        // ******** Buffer until a whole request is in ********
+
+                        int refuse = 0;
+                        Node *node = lookup_table_node(table, i);
+                        if (node != NULL && node->val != NULL)
+                        {
+                            if (node->in_len == 0 && node->is_cgi == 0)
+                                node->phases.at[PHASE_READ] = timer_now_us();
+                            node->in_buf = realloc(node->in_buf, node->in_len + len + 1);
+                            memcpy(node->in_buf + node->in_len, new_buf, len);
+                            node->in_len += len;
+                            node->in_buf[node->in_len] = 0;
+                            free(new_buf);
+
+                            mark_busy(table, i);
+
+                            // the CGI deadline stays in charge until its response is out
+                            if (node->is_cgi != 0)
+                                continue;
+
+                            int need = request_length(node->in_buf, node->in_len);
+                            // what cannot be framed is refused along with the rest
+                            refuse = need == REQUEST_TOO_LARGE ? 413 : need == REQUEST_BAD_LENGTH ? 400 : 0;
+                            int take = refuse ? node->in_len : need;
+                            // a classic CGI script starts on the headers alone
+                            char *end = memmem(node->in_buf, node->in_len, "\r\n\r\n", 4);
+                            if (need >= 0 && end != NULL && streams_body(node->in_buf, node->in_len))
+                                take = end - node->in_buf + 4;
+                            if (!refuse && (need < 0 || node->in_len < take))
+                            {
+                                // deadlines are set once per phase, so trickling
+                                // bytes in does not buy a slow client more time
+                                int phase = need < 0 ? TIMER_HEADER : TIMER_BODY;
+                                if (timer_type(timers, i) != phase)
+                                    timer_set(timers, i, phase,
+                                              phase == TIMER_HEADER ? config.header_timeout : config.body_timeout);
+                                continue;
+                            }
+
+                            timer_cancel(timers, i);
+                            node->requests++;
+                            new_buf = malloc(take + 1);
+                            memcpy(new_buf, node->in_buf, take);
+                            new_buf[take] = 0;
+                            len = take;
+                            node->in_len -= take;
+                            memmove(node->in_buf, node->in_buf + take, node->in_len);
+                        }
+
                         // ******** Parsing ********
 
                         Response *response = NULL;
@@ -1630,120 +3829,83 @@ int lisod_start()
 
                         int mode = mode_sock == https_sock ? 1 : 0;
 
-                        // If the received request is from a logged CGI
-                        // socket, then this request is a response
-                        if (lookup_table(table, i) == NULL && lookup_table_connection(table, i) != -1)
+                        unsigned long mark = timer_now_us();
+                        Node *served = lookup_table_node(table, i);
+                        if (served != NULL)
                         {
-                            printf("Received a CGI response!\n");
-                            printf("Buf: %s\n", new_buf);
-                            printf("End of buf!\n");
-
-                            // pass it into a new parser and attempt to get a response
-                            response = parse_response(new_buf, len, i);
+                            if (served->request_start == 0)
+                                in_flight++;
+                            served->request_start = mark;
+                            unsigned long read_start = served->phases.at[PHASE_READ];
+                            phase_done(&served->phases, PHASE_READ, read_start != 0 ? read_start : mark, mark);
+                        }
+                        if (metrics != NULL)
+                            metrics_count(metrics, MET_REQUESTS, 1);
+                        if (loop_stats != NULL)
+                            shm_count(loop_stats, SHM_REQUESTS, 1);
 
-                            if (response != NULL)
-                            {
-                                printf("response size: %ld, response real size: %ld\n",
-                                       response->size, response->real_size);
-                            }
-                            else
-                            {
-                                // get a dummy response
-                                response = forward_cgi_response(new_buf, len, i);
-                            }
+                        loop_phase("parse");
+                        request = refuse ? NULL : parse(new_buf, len, i);
+                        mark = phase_mark(i, PHASE_PARSE, mark);
 
-                            // then set client_sock to be the original connection
-                            client_sock = lookup_table_connection(table, i);
+                        printf("result of request is %p\n", request);
 
-                            // then close the connection with stdout_pipe[0]
-                            close(i);
+                        // parsing failed
+                        if (request == NULL)
+                        {
+                            // send a response of 400, or what refused it
+                            free(new_buf);
+                            response = handle_request(NULL, refuse ? refuse : 400, www_file, 0);
+                            printf("Parsing request failed!\n");
+                        }
+                        else
+                        {
+                            // handle request
 
-                            insert_cgi(table, client_sock, 0);
+                            printf("handling the request!\n");
 
-                            // adjust mode
-                            mode = lookup_table_connection(table, client_sock) == https_sock ? 1 : 0;
+                            // pre process request for particular errors
+                            // then check URI for /cgi/
+                            unsigned long handle_start = mark;
+                            loop_phase("handle_request");
+                            if (metrics != NULL && strcmp(request->http_uri, metrics->uri) == 0)
+                                response = handle_metrics(i);
+                            else
+                                response = handle_request(request, 0, www_file, requests_left(i));
+                            mark = phase_mark(i, PHASE_HANDLE, handle_start);
 
-                            // decrease num_client, remove it from hash table,
-                            // remove it from fd_set
-                            num_client--;
-                            FD_CLR(i, readfds);
-                            remove_table(table, i);
+                            /************* HANDLE CGI **************/
 
-                            // monitoring failed
-                            // already out of date
-                            if (response == NULL)
+                            int route = plugins == NULL ? -1 : plugin_route(plugins, request->http_uri);
+                            int upstream = proxy == NULL ? -1 : proxy_route(proxy, request->http_uri);
+                            if (response == NULL && route >= 0)
                             {
-                                // send 500 to client!
-                                free(new_buf);
-                                response = handle_request(NULL, 500, www_file);
-                                printf("Parsing response from CGI failed!\n");
+                                loop_phase("plugin dispatch");
+                                response = handle_plugin(i, request, len, route);
+                                phase_mark(i, PHASE_HANDLE, handle_start);
+                                if (response->code == -1)
+                                    mode = 0;
                             }
-                        }
-                        else
-                        // the request is a normal request, parse as a request
-                        {
-                            request = parse(new_buf, len, i);
-
-                            printf("result of request is %p\n", request);
-
-                            // parsing failed
-                            if (request == NULL)
+                            else if (response == NULL && upstream >= 0)
                             {
-                                // send a response of 400
-                                response = handle_request(NULL, 400, www_file);
-                                printf("Parsing request failed!\n");
+                                loop_phase("proxy dispatch");
+                                response = handle_proxy(i, request, upstream, &max_sd);
+                                phase_mark(i, PHASE_HANDLE, handle_start);
+                                if (response->code == -1)
+                                    mode = 0;
                             }
-                            else
+                            else if (response == NULL)
                             {
-                                // handle request
-
-                                printf("handling the request!\n");
-
-                                // pre process request for particular errors
-                                // then check URI for /cgi/
-                                response = handle_request(request, 0, www_file);
-
-                                /************* HANDLE CGI **************/
-
-                                if (response == NULL)
-                                {
-                                    // if /cgi exists, handle it in a particular handler
-                                    char *new_addr = inet_ntoa(((struct sockaddr_in *)lookup_table(table, i))->sin_addr);
-
-                                    int n = lookup_table_connection(table, i);
-
-                                    printf("handling CGI! connection: %d, uri: %s\n", n, request->http_uri);
-
-                                    // handling CGI requests
-                                    int socket_num = handle_cgi_request(request, log, new_addr, cgi_file, n);
-                                    if (socket_num == EXIT_FAILURE)
-                                    {
-                                        // handling error. send a response of 500
-                                        response = handle_request(NULL, 500, www_file);
-                                        printf("Handling CGI request failed!\n");
-                                    }
-                                    else
-                                    {
-                                        printf("Ready\n");
-                                        // set max socket, increase num_client
-                                        max_sd = MAX(max_sd, socket_num);
-                                        num_client++;
-
-                                        // log stdout_pipe[0] socket in the hash table and fd_set
-                                        insert_table(table, socket_num, NULL, i);
-                                        FD_SET(socket_num, readfds);
-
-                                        mode = 0;
-
-                                        // draft a special response that forwards request to stdin_pipe[1]
-                                        response = forward_cgi_request(request);
-
-                                        printf("ready to pass response! \nBuf: %s\nSize: %zd\n", response->buf, response->real_size);
-                                    }
-                                }
-
-                                /************* END HANDLE CGI **************/
+                                loop_phase("CGI spawn");
+                                response = handle_cgi(i, request, len, log, &max_sd, 1);
+                                phase_mark(i, PHASE_CGI, mark);
+                                // nothing to write now, the request is only
+                                // logged and the client marked as waiting on CGI
+                                if (response->code == -1)
+                                    mode = 0;
                             }
+
+                            /************* END HANDLE CGI **************/
                         }
                         // printf("reaching end\n");
                         // memset(buf, 0, BUF_SIZE);
@@ -1751,27 +3913,44 @@ int lisod_start()
                         // ******** Send Reply ********
 
                         // TODO check if send_reply works properly with CGI and new logics!
-                        if (send_reply(request, response, log, table, &readfds, mode) == EXIT_FAILURE)
+                        if (send_reply(request, response, log, table, &readfds, mode) != SUCCESS)
                         {
-                            printf("3\n");
+                            // the client is gone, placeholders write nothing
                             free(response->buf);
                             free(response);
-                            printf("In 797\n");
-                            return EXIT_FAILURE;
+                            continue;
                         }
                         if (response->code == -1)
                         {
                             // indicate CGI via storing NULL as
                             insert_cgi(table, i, 1);
+                            Node *node = lookup_table_node(table, i);
+                            // not read while it waits, unless its body streams
+                            // to the script; arm_idle_timer() reads it again
+                            if (node != NULL && node->cgi_stdin == 0)
+                                FD_CLR(i, readfds);
+                            if (node != NULL && node->proxy != NULL)
+                                timer_set(timers, i, TIMER_CGI, config.proxy_timeout);
+                            // a queued request only waits so long for its turn
+                            else
+                                timer_set(timers, i, TIMER_CGI,
+                                          cgi_limit_queued(cgi_limiter, i) ? config.cgi_backlog_timeout : config.cgi_timeout);
                         }
                         else
+                        {
                             free(response->buf);
+                            arm_idle_timer(client_sock);
+                        }
                         free(response);
                         printf("In 802\n");
                     }
 
                     printf("Readret: %zd\n", readret);
 
+                    // woken for nothing, or TLS wants more of a record
+                    if (readret < 0 && would_block(readret, client_context))
+                        continue;
+
                     if (readret < 0)
                     {
                         // handling SSL read errors and normal read errors
@@ -1783,12 +3962,23 @@ int lisod_start()
                             error_log(log, "", msg);
                         }
                         error_log(log, "", "Error reading from client socket.\n");
-                        lisod_shutdown(EXIT_FAILURE);
 
-                        return EXIT_FAILURE;
+                        // drop just this client, along with its CGI script
+                        Node *node = lookup_table_node(table, i);
+                        if (node != NULL && node->val != NULL)
+                        {
+                            if (node->is_cgi != 0)
+                                abort_cgi(node);
+                            close_connection(i);
+                        }
+                        continue;
                     }
-                    if (readret == 0 && lookup_table_cgi(table, i) == 0)
+                    if (readret == 0 && !full)
                     {
+                        // the client is gone, so is the script working for it
+                        Node *node = lookup_table_node(table, i);
+                        if (node != NULL && node->is_cgi != 0)
+                            abort_cgi(node);
                         if (close_socket_client())
                         {
                             error_log(log, "", "Error closing client socket.\n");
@@ -1796,13 +3986,19 @@ int lisod_start()
                             return EXIT_FAILURE;
                         }
                         FD_CLR(i, readfds);
+                        drop_request(i);
                         remove_table(table, i);
+                        timer_cancel(timers, i);
+                        num_client--;
 
                         fprintf(stderr, "Socket reaching end %d.\n", i);
                     }
                 }
             }
         }
+
+        loop_phase("timers");
+        timer_expire(timers, handle_timeout, log);
     }
 
     printf("Token\n");
@@ -1812,13 +4008,24 @@ int lisod_start()
 
 int main(int argc, char *argv[])
 {
-    if (argc != 9)
+    if (argc < 9)
     {
         printf("Usage: ./lisod [HTTP Port] [HTTPS Port] [log file] [lock file] "
-               "[www file] [cgi file] [private key file] [certificate file]\n");
+               "[www file] [cgi file] [private key file] [certificate file] "
+               "[name=value ...]\n");
         printf("%d\n", argc);
         return -1;
     }
+    config_init_default(&config);
+    for (int i = 9; i < argc; ++i)
+    {
+        if (config_parse_option(&config, argv[i]) != 0)
+            return -1;
+    }
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < MAX_CLIENT)
+        fd_limit = limit.rlim_cur;
+
     http_port = atoi(argv[1]);
     https_port = atoi(argv[2]);
     log_file = argv[3];
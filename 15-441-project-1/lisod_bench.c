@@ -0,0 +1,829 @@
+/******************************************************************************
+* lisod_bench.c                                                               *
+*                                                                             *
+* Description: Load generator for the liso server. Threads each drive their   *
+*              share of the connections from an epoll loop, either closed     *
+*              loop (every connection keeps its pipeline full) or open loop   *
+*              (requests are due at a fixed rate whether or not the server    *
+*              keeps up, and their latency counts from when they were due).   *
+*              Requests are replayed from files such as                       *
+*              sample_request_realistic; throughput, status codes and         *
+*              latency percentiles are reported at the end. Badly behaved     *
+*              clients (adversary.c) can run alongside, or in turn against a  *
+*              baseline (-S), to see how well lisod shields the others.       *
+*                                                                             *
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "hdr_histogram.h"
+#include "adversary.h"
+#include "http_response.h"
+
+#define MAX_PIPELINE 64
+#define MAX_FILES 64
+#define READ_SIZE 65536
+#define DUE_MAX 65536     // open loop requests waiting for a connection
+#define RECONNECT_NS 10000000UL // after a failed connect
+
+// where a connection is
+enum
+{
+    CONN_CLOSED = 0,
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_READY
+};
+
+typedef struct
+{
+    char *buf;
+    int len;
+    int head; // HEAD, the answer has no body
+} Bench_Request;
+
+typedef struct
+{
+    int fd;
+    SSL *ssl;
+    int state;
+    int events; // registered with epoll
+    char *out;  // requests not written yet
+    int out_len;
+    int out_cap;
+    char *in; // response bytes not consumed yet
+    int in_len;
+    int in_cap;
+    unsigned long sent_at[MAX_PIPELINE]; // ns, when each request in flight was due
+    int sent_head[MAX_PIPELINE];
+    int first;    // oldest request in flight
+    int inflight;
+    int done;     // the server closes after the current answer
+    unsigned long retry_at; // ns, reconnect not before
+} Bench_Conn;
+
+typedef struct
+{
+    pthread_t tid;
+    int epfd;
+    Bench_Conn *conns;
+    int count;
+    double rate;            // requests per second, 0 for closed loop
+    unsigned long next_due; // ns
+    unsigned long *due;     // open loop requests waiting for a connection
+    int due_head;
+    int due_len;
+    int next_conn; // round robin for open loop
+    int next_req;
+    Hdr_Histogram latency_us;
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long status[6]; // by first digit
+    unsigned long connects;
+    unsigned long errors;    // failed connects and requests lost on a dropped connection
+    unsigned long overflow;  // open loop requests dropped, too many were waiting
+} Bench_Thread;
+
+int threads = 2;
+int connections = 10;
+int duration = 10;
+double rate = 0;
+int pipeline = 1;
+int close_each = 0;
+int https = 0;
+Bench_Request requests[MAX_FILES * 16];
+int request_count = 0;
+struct sockaddr_storage server;
+socklen_t server_len;
+SSL_CTX *ssl_context;
+unsigned long end_at;
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * add the requests in path, one after the other with Content-Length bodies,
+ * to the ones replayed
+ */
+int load_requests(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return -1;
+    }
+    char *data = NULL;
+    size_t len = 0;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    {
+        data = realloc(data, len + n);
+        memcpy(data + len, chunk, n);
+        len += n;
+    }
+    fclose(f);
+
+    size_t at = 0;
+    while (at < len && request_count < (int)(sizeof(requests) / sizeof(requests[0])))
+    {
+        while (at < len && (data[at] == '\r' || data[at] == '\n'))
+            at++;
+        char *end = memmem(data + at, len - at, "\r\n\r\n", 4);
+        if (end == NULL)
+            break;
+        size_t head_len = end + 4 - (data + at);
+        long body = 0;
+        for (char *line = data + at; line < end; line++)
+        {
+            if ((line == data + at || line[-1] == '\n') && strncasecmp(line, "Content-Length:", 15) == 0)
+                body = atol(line + 15);
+        }
+        if (at + head_len + body > len)
+            body = len - at - head_len;
+
+        Bench_Request *r = &requests[request_count++];
+        r->len = head_len + body;
+        r->buf = malloc(r->len);
+        memcpy(r->buf, data + at, r->len);
+        r->head = strncmp(r->buf, "HEAD ", 5) == 0;
+        at += r->len;
+    }
+    free(data);
+    return 0;
+}
+
+static void watch(Bench_Thread *t, Bench_Conn *c, int events)
+{
+    if (c->events == events)
+        return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(t->epfd, c->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+static void open_conn(Bench_Thread *t, Bench_Conn *c)
+{
+    c->fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+    {
+        t->errors++;
+        c->retry_at = now_ns() + RECONNECT_NS;
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server, server_len) < 0 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        t->errors++;
+        c->retry_at = now_ns() + RECONNECT_NS;
+        return;
+    }
+    c->state = CONN_CONNECTING;
+    c->events = 0;
+    c->out_len = c->in_len = 0;
+    c->first = c->inflight = 0;
+    c->done = 0;
+    t->connects++;
+    watch(t, c, EPOLLIN | EPOLLOUT);
+}
+
+// drop a connection; what was in flight on it is lost unless expected
+static void close_conn(Bench_Thread *t, Bench_Conn *c, int lost)
+{
+    if (c->ssl != NULL)
+    {
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    close(c->fd);
+    c->state = CONN_CLOSED;
+    if (lost)
+    {
+        t->errors += c->inflight > 0 ? c->inflight : 1;
+        c->retry_at = now_ns() + RECONNECT_NS;
+    }
+    else
+    {
+        c->retry_at = 0;
+        // the server closed as announced: open loop requests still on it
+        // are due again, closed loop ones are simply sent anew
+        for (int k = 0; t->rate > 0 && k < c->inflight && t->due_len < DUE_MAX; ++k)
+            t->due[(t->due_head + t->due_len++) % DUE_MAX] = c->sent_at[(c->first + k) % MAX_PIPELINE];
+    }
+    c->inflight = 0;
+}
+
+// write what is queued; -1 if the connection broke
+static int flush(Bench_Thread *t, Bench_Conn *c)
+{
+    while (c->out_len > 0)
+    {
+        int n;
+        if (c->ssl != NULL)
+        {
+            n = SSL_write(c->ssl, c->out, c->out_len);
+            if (n <= 0)
+            {
+                int err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                    break;
+                return -1;
+            }
+        }
+        else
+        {
+            n = write(c->fd, c->out, c->out_len);
+            if (n < 0 && errno == EAGAIN)
+                break;
+            if (n <= 0)
+                return -1;
+        }
+        c->out_len -= n;
+        memmove(c->out, c->out + n, c->out_len);
+    }
+    watch(t, c, c->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    return 0;
+}
+
+// queue the next request, latency counts from due (ns)
+static void send_request(Bench_Thread *t, Bench_Conn *c, unsigned long due)
+{
+    Bench_Request *r = &requests[t->next_req];
+    t->next_req = (t->next_req + 1) % request_count;
+    if (c->out_len + r->len > c->out_cap)
+    {
+        c->out_cap = c->out_len + r->len;
+        c->out = realloc(c->out, c->out_cap);
+    }
+    memcpy(c->out + c->out_len, r->buf, r->len);
+    c->out_len += r->len;
+    int slot = (c->first + c->inflight) % MAX_PIPELINE;
+    c->sent_at[slot] = due;
+    c->sent_head[slot] = r->head;
+    c->inflight++;
+}
+
+// closed loop: keep the pipeline of a ready connection full
+static void fill(Bench_Thread *t, Bench_Conn *c)
+{
+    if (t->rate > 0 || c->state != CONN_READY || c->done)
+        return;
+    int depth = close_each ? 1 : pipeline;
+    unsigned long now = now_ns();
+    if (now >= end_at)
+        return;
+    while (c->inflight < depth)
+        send_request(t, c, now);
+}
+
+/**
+ * take the complete answers off the start of the read buffer. eof: the
+ * server closed, which ends an answer without a length. -1 on garbage.
+ */
+static int take_responses(Bench_Thread *t, Bench_Conn *c, int eof)
+{
+    while (c->inflight > 0)
+    {
+        Http_Response res;
+        int framed = http_response_frame(c->in, c->in_len, c->sent_head[c->first], eof, &res);
+        if (framed <= 0)
+            return framed;
+        c->in_len -= res.length;
+        memmove(c->in, c->in + res.length, c->in_len);
+        // interim, the real answer follows
+        if (res.code >= 100 && res.code < 200)
+            continue;
+
+        hdr_record(&t->latency_us, (now_ns() - c->sent_at[c->first]) / 1000);
+        t->requests++;
+        t->bytes += res.length;
+        t->status[res.code / 100 < 6 ? res.code / 100 : 0]++;
+        c->first = (c->first + 1) % MAX_PIPELINE;
+        c->inflight--;
+        if (res.close)
+        {
+            c->done = 1;
+            break;
+        }
+    }
+    return 0;
+}
+
+// read what the server sent; -1 once the connection is gone
+static int receive(Bench_Thread *t, Bench_Conn *c)
+{
+    for (;;)
+    {
+        if (c->in_cap - c->in_len < READ_SIZE)
+        {
+            c->in_cap = c->in_len + READ_SIZE;
+            c->in = realloc(c->in, c->in_cap);
+        }
+        int n;
+        if (c->ssl != NULL)
+        {
+            n = SSL_read(c->ssl, c->in + c->in_len, READ_SIZE);
+            if (n <= 0)
+            {
+                int err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                    return take_responses(t, c, 0);
+                take_responses(t, c, 1);
+                return -1;
+            }
+        }
+        else
+        {
+            n = read(c->fd, c->in + c->in_len, READ_SIZE);
+            if (n < 0 && errno == EAGAIN)
+                return take_responses(t, c, 0);
+            if (n <= 0)
+            {
+                take_responses(t, c, 1);
+                return -1;
+            }
+        }
+        c->in_len += n;
+    }
+}
+
+static void handshake(Bench_Thread *t, Bench_Conn *c)
+{
+    int ret = SSL_do_handshake(c->ssl);
+    if (ret == 1)
+    {
+        c->state = CONN_READY;
+        watch(t, c, EPOLLIN);
+        return;
+    }
+    int err = SSL_get_error(c->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ)
+        watch(t, c, EPOLLIN);
+    else if (err == SSL_ERROR_WANT_WRITE)
+        watch(t, c, EPOLLIN | EPOLLOUT);
+    else
+        close_conn(t, c, 1);
+}
+
+static void on_event(Bench_Thread *t, Bench_Conn *c, int events)
+{
+    if (c->state == CONN_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+        {
+            close_conn(t, c, 1);
+            return;
+        }
+        if (!https)
+        {
+            c->state = CONN_READY;
+            watch(t, c, EPOLLIN);
+            return;
+        }
+        c->ssl = SSL_new(ssl_context);
+        SSL_set_fd(c->ssl, c->fd);
+        SSL_set_connect_state(c->ssl);
+        c->state = CONN_HANDSHAKE;
+    }
+    if (c->state == CONN_HANDSHAKE)
+    {
+        handshake(t, c);
+        return;
+    }
+
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && receive(t, c) != 0)
+    {
+        // closing between requests, or as announced, loses nothing
+        close_conn(t, c, !c->done && c->inflight > 0);
+        return;
+    }
+    if (c->done && c->inflight == 0)
+    {
+        close_conn(t, c, 0);
+        return;
+    }
+    if (close_each && c->inflight == 0 && c->out_len == 0)
+    {
+        close_conn(t, c, 0);
+        return;
+    }
+    if ((events & EPOLLOUT) && flush(t, c) != 0)
+        close_conn(t, c, 1);
+}
+
+// open loop: hand the requests that are due to connections with room
+static void dispatch(Bench_Thread *t, unsigned long now)
+{
+    unsigned long interval = (unsigned long)(1e9 / t->rate);
+    while (t->next_due <= now && now < end_at)
+    {
+        if (t->due_len == DUE_MAX)
+            t->overflow++;
+        else
+            t->due[(t->due_head + t->due_len++) % DUE_MAX] = t->next_due;
+        t->next_due += interval;
+    }
+
+    int depth = close_each ? 1 : pipeline;
+    for (int k = 0; k < t->count && t->due_len > 0; ++k)
+    {
+        Bench_Conn *c = &t->conns[(t->next_conn + k) % t->count];
+        if (c->state != CONN_READY || c->done)
+            continue;
+        while (c->inflight < depth && t->due_len > 0)
+        {
+            send_request(t, c, t->due[t->due_head]);
+            t->due_head = (t->due_head + 1) % DUE_MAX;
+            t->due_len--;
+        }
+        if (c->out_len > 0 && flush(t, c) != 0)
+            close_conn(t, c, 1);
+    }
+    t->next_conn = (t->next_conn + 1) % t->count;
+}
+
+void *run_thread(void *arg)
+{
+    Bench_Thread *t = (Bench_Thread *)arg;
+    struct epoll_event events[256];
+
+    t->epfd = epoll_create1(0);
+    t->next_due = now_ns();
+    if (t->rate > 0)
+        t->due = malloc(DUE_MAX * sizeof(unsigned long));
+
+    for (;;)
+    {
+        unsigned long now = now_ns();
+        if (now >= end_at)
+            break;
+
+        for (int i = 0; i < t->count; ++i)
+        {
+            Bench_Conn *c = &t->conns[i];
+            if (c->state == CONN_CLOSED && now >= c->retry_at)
+                open_conn(t, c);
+            if (c->state == CONN_READY && c->inflight == 0 && c->out_len == 0)
+            {
+                fill(t, c);
+                if (c->out_len > 0 && flush(t, c) != 0)
+                    close_conn(t, c, 1);
+            }
+        }
+        if (t->rate > 0)
+            dispatch(t, now);
+
+        int wait_ms = 100;
+        if (t->rate > 0)
+            wait_ms = t->next_due > now ? (t->next_due - now) / 1000000 : 0;
+        int n = epoll_wait(t->epfd, events, 256, wait_ms);
+        for (int i = 0; i < n; ++i)
+        {
+            Bench_Conn *c = (Bench_Conn *)events[i].data.ptr;
+            if (c->state == CONN_CLOSED)
+                continue;
+            int had = c->inflight;
+            on_event(t, c, events[i].events);
+            // answers made room for more
+            if (c->state == CONN_READY && c->inflight < had)
+            {
+                fill(t, c);
+                if (c->out_len > 0 && flush(t, c) != 0)
+                    close_conn(t, c, 1);
+            }
+        }
+    }
+
+    for (int i = 0; i < t->count; ++i)
+    {
+        if (t->conns[i].state != CONN_CLOSED)
+            close_conn(t, &t->conns[i], 0);
+        free(t->conns[i].in);
+        free(t->conns[i].out);
+    }
+    free(t->due);
+    close(t->epfd);
+    return NULL;
+}
+
+typedef struct
+{
+    unsigned long requests;
+    unsigned long bytes;
+    unsigned long connects;
+    unsigned long errors;
+    unsigned long overflow;
+    unsigned long status[6];
+    double seconds;
+    Hdr_Histogram latency_us;
+} Bench_Result;
+
+// run the measured clients for duration seconds
+void run_load(Bench_Result *r)
+{
+    Bench_Thread *pool = calloc(threads, sizeof(Bench_Thread));
+    unsigned long start = now_ns();
+    end_at = start + duration * 1000000000UL;
+    for (int i = 0; i < threads; ++i)
+    {
+        Bench_Thread *t = &pool[i];
+        t->count = connections / threads + (i < connections % threads);
+        t->conns = calloc(t->count, sizeof(Bench_Conn));
+        t->rate = rate / threads;
+        t->next_req = i % request_count;
+        hdr_init(&t->latency_us);
+        pthread_create(&t->tid, NULL, run_thread, t);
+    }
+
+    memset(r, 0, sizeof(Bench_Result));
+    hdr_init(&r->latency_us);
+    for (int i = 0; i < threads; ++i)
+    {
+        Bench_Thread *t = &pool[i];
+        pthread_join(t->tid, NULL);
+        hdr_merge(&r->latency_us, &t->latency_us);
+        r->requests += t->requests;
+        r->bytes += t->bytes;
+        r->connects += t->connects;
+        r->errors += t->errors;
+        r->overflow += t->overflow;
+        for (int k = 0; k < 6; ++k)
+            r->status[k] += t->status[k];
+        free(t->conns);
+    }
+    r->seconds = (now_ns() - start) / 1e9;
+    free(pool);
+}
+
+void print_report(Bench_Result *r)
+{
+    Hdr_Histogram *h = &r->latency_us;
+    printf("%s loop, %d threads, %d connections, pipeline %d%s%s\n",
+           rate > 0 ? "Open" : "Closed", threads, connections, pipeline,
+           close_each ? ", connection per request" : "", https ? ", HTTPS" : "");
+    printf("Requests: %lu in %.2f s, %.1f req/s, %.2f MB/s, goodput %.1f req/s\n",
+           r->requests, r->seconds, r->requests / r->seconds, r->bytes / r->seconds / 1e6,
+           r->status[2] / r->seconds);
+    printf("Connections: %lu, errors: %lu, dropped (open loop backlog full): %lu\n", r->connects, r->errors,
+           r->overflow);
+    printf("Status: 1xx %lu, 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n",
+           r->status[1], r->status[2], r->status[3], r->status[4], r->status[5], r->status[0]);
+    printf("Latency us: min %lu, mean %lu, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, p99.99 %lu, max %lu\n",
+           h->count == 0 ? 0 : h->min, h->count == 0 ? 0 : h->sum / h->count,
+           hdr_percentile(h, 50), hdr_percentile(h, 90), hdr_percentile(h, 99),
+           hdr_percentile(h, 99.9), hdr_percentile(h, 99.99), h->max);
+}
+
+/**
+ * measure with the given adversaries connected; they get a head start of
+ * one drip interval (at least a second) to pile up
+ */
+Adversaries *run_against(const int *counts, const char *uri, int drip_ms, Bench_Result *r)
+{
+    Adversaries *a = NULL;
+    int total = 0;
+    for (int k = 0; k < ADV_KINDS; ++k)
+        total += counts[k];
+    if (total > 0)
+    {
+        a = create_adversaries(counts, uri, drip_ms, (struct sockaddr *)&server, server_len);
+        usleep((drip_ms > 1000 ? drip_ms : 1000) * 1000);
+    }
+    run_load(r);
+    if (a != NULL)
+        stop_adversaries(a);
+    return a;
+}
+
+/**
+ * every kind of adversary in turn, n of each (20 n for the flood, meant to
+ * go past the server's fd limit), against a baseline without any
+ */
+void run_suite(int n, const char *uri, int drip_ms)
+{
+    char digest[1024];
+    double base = 0;
+
+    printf("%-12s %10s %8s %7s %8s %8s %9s %9s  %s\n", "scenario", "good/s", "vs base", "errors", "p50 us",
+           "p99 us", "p99.9 us", "max us", "adversaries");
+    // slow readers last, a server that blocks on them may not come back
+    int order[] = {-1, ADV_SLOW_HEADER, ADV_SLOW_BODY, ADV_HALF_OPEN, ADV_FLOOD, ADV_SLOW_READ};
+    for (int o = 0; o < (int)(sizeof(order) / sizeof(order[0])); ++o)
+    {
+        int s = order[o];
+        int counts[ADV_KINDS] = {0};
+        if (s >= 0)
+            counts[s] = s == ADV_FLOOD ? 20 * n : n;
+
+        Bench_Result r;
+        Adversaries *a = run_against(counts, uri, drip_ms, &r);
+        double good = r.status[2] / r.seconds;
+        if (s < 0)
+            base = good;
+        digest[0] = 0;
+        if (a != NULL)
+        {
+            adversary_digest(a, digest, sizeof(digest));
+            destroy_adversaries(a);
+        }
+        Hdr_Histogram *h = &r.latency_us;
+        printf("%-12s %10.1f %7.1f%% %7lu %8lu %8lu %9lu %9lu  %s", s < 0 ? "baseline" : adversary_names[s], good,
+               base > 0 ? 100 * good / base : 0, r.errors, hdr_percentile(h, 50), hdr_percentile(h, 99),
+               hdr_percentile(h, 99.9), h->max, a != NULL ? digest + strlen("Adversaries: ") : "\n");
+        fflush(stdout);
+        // let the server drop what the adversaries left before the next one
+        sleep(1);
+    }
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-t threads] [-c connections] [-d seconds] [-r requests/s] [-p depth]\n"
+            "          [-C] [-s] [-f request_file]... [-a kind:count]... [-S] [-n count]\n"
+            "          [-u uri] [-i ms] [-h] <server-ip> <port>\n"
+            "  -r  open loop at this total rate, closed loop if not given\n"
+            "  -p  requests pipelined on each connection\n"
+            "  -C  a new connection for every request\n"
+            "  -s  HTTPS\n"
+            "  -f  requests to replay in turn, e.g. sample_request_realistic\n"
+            "  -a  run count badly behaved clients alongside: slow_header, slow_body,\n"
+            "      slow_read, half_open or flood\n"
+            "  -S  suite: a baseline, then each kind of adversary in turn (-n of each,\n"
+            "      20 times that for the flood), goodput and latency compared\n"
+            "  -u  what slow readers ask for, best something large (default /)\n"
+            "  -i  slow clients send a byte this often (default 1000 ms)\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int counts[ADV_KINDS] = {0};
+    int suite = 0;
+    int suite_count = 100;
+    const char *uri = "/";
+    int drip_ms = 1000;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:r:p:Csf:a:Sn:u:i:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'p':
+            pipeline = atoi(optarg);
+            break;
+        case 'C':
+            close_each = 1;
+            break;
+        case 's':
+            https = 1;
+            break;
+        case 'f':
+            if (load_requests(optarg) != 0)
+                return EXIT_FAILURE;
+            break;
+        case 'a':
+        {
+            char *colon = strchr(optarg, ':');
+            if (colon != NULL)
+                *colon = 0;
+            int kind = adversary_kind(optarg);
+            if (kind < 0 || colon == NULL)
+            {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            counts[kind] += atoi(colon + 1);
+            break;
+        }
+        case 'S':
+            suite = 1;
+            break;
+        case 'n':
+            suite_count = atoi(optarg);
+            break;
+        case 'u':
+            uri = optarg;
+            break;
+        case 'i':
+            drip_ms = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2 || threads < 1 || connections < 1 || duration < 1 ||
+        pipeline < 1 || pipeline > MAX_PIPELINE || drip_ms < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (threads > connections)
+        threads = connections;
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &res) != 0)
+    {
+        fprintf(stderr, "Cannot resolve %s.\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    if (request_count == 0)
+    {
+        char buf[512];
+        snprintf(buf, sizeof(buf), "GET / HTTP/1.1\r\nHost: %s\r\n\r\n", argv[optind]);
+        requests[0].buf = strdup(buf);
+        requests[0].len = strlen(buf);
+        requests[0].head = 0;
+        request_count = 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    // floods need more fds than the usual soft limit
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (https)
+    {
+        SSL_library_init();
+        SSL_load_error_strings();
+        ssl_context = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_mode(ssl_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    if (suite)
+        run_suite(suite_count, uri, drip_ms);
+    else
+    {
+        Bench_Result r;
+        Adversaries *a = run_against(counts, uri, drip_ms, &r);
+        print_report(&r);
+        if (a != NULL)
+        {
+            char digest[1024];
+            adversary_digest(a, digest, sizeof(digest));
+            printf("%s", digest);
+            destroy_adversaries(a);
+        }
+    }
+
+    if (ssl_context != NULL)
+        SSL_CTX_free(ssl_context);
+    for (int i = 0; i < request_count; ++i)
+        free(requests[i].buf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#ifndef _LISOD_PLUGIN_H_
+#define _LISOD_PLUGIN_H_
+
+/*
+ * The interface between lisod and native request handlers. A handler is a
+ * shared object exporting a Lisod_Plugin named lisod_plugin; lisod loads it
+ * at startup and calls it for every request under the URI prefix it is
+ * mounted on (plugins=/prefix=/path/to/handler.so[:args],...).
+ *
+ * Handlers run on the event loop, so they must not block; those that do
+ * set LISOD_BLOCKING and are run on lisod's plugin worker threads instead.
+ * Either kind may return LISOD_ASYNC and call finish() later, from any
+ * thread. Everything else of a response is written by one thread at a time.
+ */
+
+#define LISOD_PLUGIN_ABI 1
+#define LISOD_PLUGIN_SYMBOL "lisod_plugin"
+
+// what handle() returns
+enum
+{
+    LISOD_DONE = 0, // the response is complete, finish() is implied
+    LISOD_ASYNC     // finish() follows later
+};
+
+// Lisod_Plugin flags
+#define LISOD_BLOCKING 1
+
+typedef struct
+{
+    const char *name;
+    const char *value;
+} Lisod_Header;
+
+// valid until finish()
+typedef struct
+{
+    const char *method;
+    const char *uri;  // as requested, query string included
+    const char *path; // uri below the mount prefix, without the query string
+    const char *query;
+    const Lisod_Header *headers;
+    int header_count;
+    const char *body;
+    int body_len;
+    const char *remote_addr;
+    int https;
+} Lisod_Request;
+
+typedef struct Lisod_Response Lisod_Response;
+
+struct Lisod_Response
+{
+    void (*status)(Lisod_Response *res, int code, const char *reason); // 200 OK unless set
+    void (*header)(Lisod_Response *res, const char *name, const char *value);
+    void (*write)(Lisod_Response *res, const void *buf, int len);
+    void (*finish)(Lisod_Response *res); // exactly once after LISOD_ASYNC
+    void *handler_data;                  // the handler's own
+};
+
+typedef struct
+{
+    int abi; // LISOD_PLUGIN_ABI
+    const char *name;
+    int flags;
+    void *(*init)(const char *args); // optional, returns the data handle() gets
+    int (*handle)(const Lisod_Request *req, Lisod_Response *res, void *data);
+    void (*fini)(void *data); // optional
+} Lisod_Plugin;
+
+#endif
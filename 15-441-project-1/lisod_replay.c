@@ -0,0 +1,662 @@
+/******************************************************************************
+* lisod_replay.c                                                              *
+*                                                                             *
+* Description: Replays a lisod access log against a server. Every line       *
+*              access_log() wrote becomes a request again, sent when it came  *
+*              in relative to the first one (scaled by -x), on a pool of      *
+*              keep-alive connections. The log has one second resolution, so  *
+*              the requests of one second are spread evenly over it.          *
+*              Latency counts from when a request was due. The report gives   *
+*              latency per endpoint (method and path, query left out) and    *
+*              every status code that differs from the one logged.            *
+*                                                                             *
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <search.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "hdr_histogram.h"
+#include "http_response.h"
+
+#define MAX_ENDPOINTS 4096 // beyond that they share one entry
+#define MAX_DIFFS 1024
+#define READ_SIZE 65536
+
+// where a connection is
+enum
+{
+    CONN_CLOSED = 0,
+    CONN_CONNECTING,
+    CONN_IDLE,
+    CONN_BUSY
+};
+
+typedef struct
+{
+    char *method;
+    char *uri;
+    char *version;
+    int code; // logged
+    double at; // seconds after the first request
+    int endpoint;
+} Replay_Request;
+
+typedef struct
+{
+    char *name;
+    unsigned long count;
+    unsigned long errors;
+    unsigned long diffs;
+    Hdr_Histogram *latency_us;
+} Endpoint;
+
+// a status code that came back different from the log
+typedef struct
+{
+    int endpoint;
+    int logged;
+    int replayed;
+    unsigned long count;
+} Diff;
+
+typedef struct Replay_Conn
+{
+    int fd;
+    int state;
+    Replay_Request *request;
+    unsigned long due; // ns
+    int reused;        // the request went out on a kept-alive connection
+    char *out;
+    int out_len;
+    char *in;
+    int in_len;
+    int in_cap;
+    struct Replay_Conn *next_idle;
+} Replay_Conn;
+
+double speed = 1;
+int max_connections = 64;
+int timeout_s = 30;
+const char *host = NULL;
+struct sockaddr_storage server;
+socklen_t server_len;
+int epfd;
+
+Replay_Request *requests;
+int request_count = 0;
+int skipped = 0;
+Endpoint endpoints[MAX_ENDPOINTS + 1]; // the last one takes the overflow
+int endpoint_count = 0;
+Diff diffs[MAX_DIFFS];
+int diff_count = 0;
+
+Replay_Conn *conns;
+Replay_Conn *idle = NULL;
+int open_count = 0;
+unsigned long errors = 0;
+unsigned long retried = 0;
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int endpoint_of(const char *method, const char *uri)
+{
+    char key[1024];
+    int path = strcspn(uri, "?");
+    snprintf(key, sizeof(key), "%s %.*s", method, path, uri);
+
+    ENTRY e, *found;
+    e.key = key;
+    if ((found = hsearch(e, FIND)) != NULL)
+        return (int)(long)found->data;
+
+    int id = endpoint_count < MAX_ENDPOINTS ? endpoint_count++ : MAX_ENDPOINTS;
+    if (endpoints[id].name == NULL)
+    {
+        endpoints[id].name = strdup(id < MAX_ENDPOINTS ? key : "(other endpoints)");
+        endpoints[id].latency_us = malloc(sizeof(Hdr_Histogram));
+        hdr_init(endpoints[id].latency_us);
+    }
+    if (id < MAX_ENDPOINTS)
+    {
+        e.key = endpoints[id].name;
+        e.data = (void *)(long)id;
+        hsearch(e, ENTER);
+    }
+    return id;
+}
+
+/**
+ * one access_log() line:
+ * ip - user [19/Oct/2026:10:00:00 +0000] "GET /uri HTTP/1.1" 200 1024
+ * 0 if it is not one that can be replayed
+ */
+static int parse_line(char *line, Replay_Request *r, time_t *when)
+{
+    char *open = strchr(line, '[');
+    char *close = open == NULL ? NULL : strchr(open, ']');
+    char *quote = close == NULL ? NULL : strchr(close, '"');
+    char *unquote = quote == NULL ? NULL : strrchr(quote + 1, '"');
+    if (unquote == NULL)
+        return 0;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    *close = 0;
+    if (strptime(open + 1, "%d/%b/%Y:%H:%M:%S %z", &tm) == NULL)
+        return 0;
+    *when = timegm(&tm) - tm.tm_gmtoff;
+
+    *unquote = 0;
+    char *save;
+    char *method = strtok_r(quote + 1, " ", &save);
+    char *uri = strtok_r(NULL, " ", &save);
+    char *version = strtok_r(NULL, " ", &save);
+    // "CANNOT RECOGNIZE THIS REQUEST" and the like
+    if (method == NULL || uri == NULL || version == NULL || uri[0] != '/' || strncmp(version, "HTTP/", 5) != 0)
+        return 0;
+    r->method = strdup(method);
+    r->uri = strdup(uri);
+    r->version = strdup(version);
+    r->code = atoi(unquote + 1);
+    return 1;
+}
+
+int load_log(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Cannot open %s.\n", path);
+        return -1;
+    }
+    int cap = 1024;
+    requests = malloc(cap * sizeof(Replay_Request));
+    time_t *seconds = malloc(cap * sizeof(time_t));
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, f) > 0)
+    {
+        if (request_count == cap)
+        {
+            cap *= 2;
+            requests = realloc(requests, cap * sizeof(Replay_Request));
+            seconds = realloc(seconds, cap * sizeof(time_t));
+        }
+        if (!parse_line(line, &requests[request_count], &seconds[request_count]))
+        {
+            skipped++;
+            continue;
+        }
+        requests[request_count].endpoint =
+            endpoint_of(requests[request_count].method, requests[request_count].uri);
+        request_count++;
+    }
+    free(line);
+    fclose(f);
+
+    // spread the requests of each logged second evenly over it
+    for (int i = 0; i < request_count;)
+    {
+        int j = i;
+        while (j < request_count && seconds[j] == seconds[i])
+            j++;
+        for (int k = i; k < j; ++k)
+            requests[k].at = (seconds[k] - seconds[0]) + (double)(k - i) / (j - i);
+        i = j;
+    }
+    free(seconds);
+    return 0;
+}
+
+static void record_status(Replay_Request *r, int code)
+{
+    // -1 was logged when the status was not known yet, nothing to compare
+    if (code == r->code || r->code < 0)
+        return;
+    endpoints[r->endpoint].diffs++;
+    for (int i = 0; i < diff_count; ++i)
+    {
+        if (diffs[i].endpoint == r->endpoint && diffs[i].logged == r->code && diffs[i].replayed == code)
+        {
+            diffs[i].count++;
+            return;
+        }
+    }
+    if (diff_count < MAX_DIFFS)
+        diffs[diff_count++] = (Diff){r->endpoint, r->code, code, 1};
+}
+
+static void close_conn(Replay_Conn *c)
+{
+    if (c->state == CONN_IDLE)
+    {
+        for (Replay_Conn **p = &idle; *p != NULL; p = &(*p)->next_idle)
+        {
+            if (*p == c)
+            {
+                *p = c->next_idle;
+                break;
+            }
+        }
+    }
+    close(c->fd);
+    c->state = CONN_CLOSED;
+    c->in_len = 0;
+    open_count--;
+}
+
+static void make_idle(Replay_Conn *c)
+{
+    c->state = CONN_IDLE;
+    c->request = NULL;
+    c->next_idle = idle;
+    idle = c;
+}
+
+static int open_conn(Replay_Conn *c)
+{
+    c->fd = socket(server.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server, server_len) < 0 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->state = CONN_CONNECTING;
+    open_count++;
+    return 0;
+}
+
+static int flush(Replay_Conn *c)
+{
+    while (c->out_len > 0)
+    {
+        int n = write(c->fd, c->out, c->out_len);
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            return -1;
+        c->out_len -= n;
+        memmove(c->out, c->out + n, c->out_len);
+    }
+    struct epoll_event ev;
+    ev.events = c->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+static void send_request(Replay_Conn *c)
+{
+    Replay_Request *r = c->request;
+    free(c->out);
+    c->out_len = asprintf(&c->out, "%s %s %s\r\nHost: %s\r\n%s\r\n", r->method, r->uri, r->version, host,
+                          strcmp(r->method, "POST") == 0 ? "Content-Length: 0\r\n" : "");
+    c->state = CONN_BUSY;
+    if (flush(c) != 0)
+    {
+        // a kept-alive connection the server has just dropped
+        Replay_Request *again = c->request;
+        unsigned long due = c->due;
+        int reused = c->reused;
+        close_conn(c);
+        if (!reused || open_conn(c) != 0)
+        {
+            endpoints[again->endpoint].errors++;
+            errors++;
+            return;
+        }
+        retried++;
+        c->request = again;
+        c->due = due;
+        c->reused = 0;
+    }
+}
+
+// hand a due request to a connection, 0 if none is free
+static int dispatch(Replay_Request *r, unsigned long due)
+{
+    Replay_Conn *c = idle;
+    if (c != NULL)
+    {
+        idle = c->next_idle;
+        c->request = r;
+        c->due = due;
+        c->reused = 1;
+        send_request(c);
+        return 1;
+    }
+    if (open_count >= max_connections)
+        return 0;
+    for (int i = 0; i < max_connections; ++i)
+    {
+        if (conns[i].state != CONN_CLOSED)
+            continue;
+        conns[i].request = r;
+        conns[i].due = due;
+        conns[i].reused = 0;
+        if (open_conn(&conns[i]) != 0)
+        {
+            endpoints[r->endpoint].errors++;
+            errors++;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void finish(Replay_Conn *c, int code)
+{
+    Endpoint *e = &endpoints[c->request->endpoint];
+    e->count++;
+    hdr_record(e->latency_us, (now_ns() - c->due) / 1000);
+    record_status(c->request, code);
+}
+
+// the connection broke with its request unanswered
+static void lost(Replay_Conn *c)
+{
+    Replay_Request *r = c->request;
+    unsigned long due = c->due;
+    int again = c->reused && c->in_len == 0;
+    close_conn(c);
+    if (again && open_conn(c) == 0)
+    {
+        // dropped while it sat idle, the request never got there
+        retried++;
+        c->request = r;
+        c->due = due;
+        c->reused = 0;
+        return;
+    }
+    endpoints[r->endpoint].errors++;
+    errors++;
+}
+
+static void on_event(Replay_Conn *c, int events)
+{
+    if (c->state == CONN_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+        {
+            Replay_Request *r = c->request;
+            close_conn(c);
+            endpoints[r->endpoint].errors++;
+            errors++;
+            return;
+        }
+        send_request(c);
+        return;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        int eof = 0;
+        for (;;)
+        {
+            if (c->in_cap - c->in_len < READ_SIZE)
+            {
+                c->in_cap = c->in_len + READ_SIZE;
+                c->in = realloc(c->in, c->in_cap);
+            }
+            int n = read(c->fd, c->in + c->in_len, READ_SIZE);
+            if (n < 0 && errno == EAGAIN)
+                break;
+            if (n <= 0)
+            {
+                eof = 1;
+                break;
+            }
+            c->in_len += n;
+        }
+        if (c->state == CONN_IDLE)
+        {
+            // the server let an idle connection go
+            if (eof)
+                close_conn(c);
+            return;
+        }
+
+        Http_Response res;
+        int framed;
+        while ((framed = http_response_frame(c->in, c->in_len, strcmp(c->request->method, "HEAD") == 0, eof,
+                                             &res)) == 1)
+        {
+            c->in_len -= res.length;
+            memmove(c->in, c->in + res.length, c->in_len);
+            if (res.code >= 100 && res.code < 200)
+                continue;
+            finish(c, res.code);
+            if (res.close || eof)
+                close_conn(c);
+            else
+                make_idle(c);
+            return;
+        }
+        if (framed < 0 || eof)
+        {
+            lost(c);
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && c->state == CONN_BUSY && flush(c) != 0)
+        lost(c);
+}
+
+void replay()
+{
+    struct epoll_event events[256];
+    int next = 0;    // first request not due yet
+    int waiting = 0; // first due request without a connection
+    unsigned long start = now_ns();
+
+    for (;;)
+    {
+        unsigned long now = now_ns();
+        while (next < request_count && (speed <= 0 || start + requests[next].at / speed * 1e9 <= now))
+            next++;
+        while (waiting < next &&
+               dispatch(&requests[waiting], speed <= 0 ? now : start + requests[waiting].at / speed * 1e9))
+            waiting++;
+
+        int busy = 0;
+        for (int i = 0; i < max_connections; ++i)
+        {
+            Replay_Conn *c = &conns[i];
+            if (c->state == CONN_BUSY || c->state == CONN_CONNECTING)
+            {
+                busy++;
+                if (now - c->due > timeout_s * 1000000000UL)
+                {
+                    // no answer in time
+                    Replay_Request *r = c->request;
+                    close_conn(c);
+                    endpoints[r->endpoint].errors++;
+                    errors++;
+                }
+            }
+        }
+        if (waiting == request_count && busy == 0)
+            break;
+
+        int wait_ms = 10;
+        if (next < request_count && speed > 0)
+        {
+            double due = start + requests[next].at / speed * 1e9;
+            wait_ms = due > now ? (due - now) / 1e6 : 0;
+            if (wait_ms > 10)
+                wait_ms = 10;
+        }
+        int n = epoll_wait(epfd, events, 256, wait_ms);
+        for (int i = 0; i < n; ++i)
+        {
+            Replay_Conn *c = (Replay_Conn *)events[i].data.ptr;
+            if (c->state != CONN_CLOSED)
+                on_event(c, events[i].events);
+        }
+    }
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const Endpoint *x = (const Endpoint *)a, *y = (const Endpoint *)b;
+    if (x->name == NULL || y->name == NULL)
+        return (x->name == NULL) - (y->name == NULL);
+    return x->count + x->errors < y->count + y->errors ? 1 : x->count + x->errors > y->count + y->errors ? -1 : 0;
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-x speed] [-c connections] [-T timeout_s] [-H host] <access-log> <server-ip> <port>\n"
+            "  -x  2 replays twice as fast as logged, 0 as fast as possible (default 1)\n"
+            "  -c  connections at most (default 64)\n"
+            "  -T  a request without an answer after this long is an error (default 30)\n"
+            "  -H  Host header (default the server address)\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "x:c:T:H:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'c':
+            max_connections = atoi(optarg);
+            break;
+        case 'T':
+            timeout_s = atoi(optarg);
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 3 || max_connections < 1 || timeout_s < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (host == NULL)
+        host = argv[optind + 1];
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &res) != 0)
+    {
+        fprintf(stderr, "Cannot resolve %s.\n", argv[optind + 1]);
+        return EXIT_FAILURE;
+    }
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    hcreate(2 * MAX_ENDPOINTS);
+    if (load_log(argv[optind]) != 0)
+        return EXIT_FAILURE;
+
+    signal(SIGPIPE, SIG_IGN);
+    epfd = epoll_create1(0);
+    conns = calloc(max_connections, sizeof(Replay_Conn));
+    unsigned long start = now_ns();
+    replay();
+    double seconds = (now_ns() - start) / 1e9;
+
+    unsigned long total = 0, total_diffs = 0;
+    for (int i = 0; i <= MAX_ENDPOINTS; ++i)
+    {
+        total += endpoints[i].count;
+        total_diffs += endpoints[i].diffs;
+    }
+    printf("Replayed %d requests from %s (%d lines skipped) at %gx\n", request_count, argv[optind], skipped, speed);
+    printf("Logged over %.0f s, replayed in %.2f s, %.1f req/s\n",
+           request_count > 0 ? requests[request_count - 1].at : 0.0, seconds, total / seconds);
+    printf("Answered: %lu, errors: %lu, retried on a new connection: %lu, status differences: %lu\n", total, errors,
+           retried, total_diffs);
+
+    // the diffs refer to endpoints by index, keep the names before sorting
+    char **names = malloc((MAX_ENDPOINTS + 1) * sizeof(char *));
+    for (int i = 0; i <= MAX_ENDPOINTS; ++i)
+        names[i] = endpoints[i].name;
+
+    qsort(endpoints, MAX_ENDPOINTS + 1, sizeof(Endpoint), by_count);
+    printf("%-40s %8s %8s %8s %8s %9s %8s %7s %6s\n", "endpoint", "count", "mean us", "p50 us", "p99 us",
+           "p99.9 us", "max us", "diffs", "errors");
+    for (int i = 0; i <= MAX_ENDPOINTS && endpoints[i].name != NULL; ++i)
+    {
+        Endpoint *e = &endpoints[i];
+        Hdr_Histogram *h = e->latency_us;
+        printf("%-40.40s %8lu %8lu %8lu %8lu %9lu %8lu %7lu %6lu\n", e->name, e->count,
+               h->count == 0 ? 0 : h->sum / h->count, hdr_percentile(h, 50), hdr_percentile(h, 99),
+               hdr_percentile(h, 99.9), h->max, e->diffs, e->errors);
+    }
+    if (diff_count > 0)
+    {
+        printf("Status differences (logged -> replayed):\n");
+        for (int i = 0; i < diff_count; ++i)
+            printf("  %-40.40s %d -> %d x%lu\n", names[diffs[i].endpoint], diffs[i].logged, diffs[i].replayed,
+                   diffs[i].count);
+    }
+
+    for (int i = 0; i <= MAX_ENDPOINTS; ++i)
+    {
+        free(endpoints[i].name);
+        free(endpoints[i].latency_us);
+    }
+    free(names);
+    for (int i = 0; i < request_count; ++i)
+    {
+        free(requests[i].method);
+        free(requests[i].uri);
+        free(requests[i].version);
+    }
+    free(requests);
+    for (int i = 0; i < max_connections; ++i)
+    {
+        if (conns[i].state != CONN_CLOSED)
+            close(conns[i].fd);
+        free(conns[i].in);
+        free(conns[i].out);
+    }
+    free(conns);
+    hdestroy();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/******************************************************************************
+* lisod_top.c                                                                 *
+*                                                                             *
+* Description: Shows what a lisod started with stats_shm=<name> is doing,     *
+*              from the shared memory segment it writes its counters to.      *
+*              The server's sockets are never touched, so a server too busy   *
+*              or too stuck to answer /metrics can still be looked at. Every  *
+*              interval it prints, per thread, the rates since the last one   *
+*              and how long the thread has been busy, along with the loop's   *
+*              connection and queue gauges.                                   *
+*                                                                             *
+*******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+
+#include "shm_stats.h"
+#include "timer_wheel.h"
+
+#define STUCK_US 1000000 // busy this long without a break is worth shouting about
+
+// what a thread's slot held at one moment
+typedef struct
+{
+    char name[16];
+    int tid;
+    int busy;
+    unsigned long heartbeat_us;
+    unsigned long counters[SHM_COUNTERS];
+    long gauges[SHM_GAUGES];
+} Worker_Snapshot;
+
+const char *shm_name = "/lisod";
+int interval_ms = 1000;
+int once = 0;
+
+int snapshot(Shm_Stats *s, Worker_Snapshot *snap)
+{
+    int count = __atomic_load_n(&s->workers, __ATOMIC_RELAXED);
+    if (count > SHM_STATS_WORKERS)
+        count = SHM_STATS_WORKERS;
+    for (int i = 0; i < count; ++i)
+    {
+        Shm_Worker *w = &s->worker[i];
+        memcpy(snap[i].name, w->name, sizeof(snap[i].name));
+        snap[i].name[sizeof(snap[i].name) - 1] = 0;
+        snap[i].tid = w->tid;
+        snap[i].busy = __atomic_load_n(&w->busy, __ATOMIC_RELAXED);
+        snap[i].heartbeat_us = __atomic_load_n(&w->heartbeat_us, __ATOMIC_RELAXED);
+        for (int c = 0; c < SHM_COUNTERS; ++c)
+            snap[i].counters[c] = __atomic_load_n(&w->counters[c], __ATOMIC_RELAXED);
+        for (int g = 0; g < SHM_GAUGES; ++g)
+            snap[i].gauges[g] = __atomic_load_n(&w->gauges[g], __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+static double rate(const Worker_Snapshot *now, const Worker_Snapshot *before, int counter, double seconds)
+{
+    if (before == NULL || seconds <= 0)
+        return 0;
+    return (now->counters[counter] - before->counters[counter]) / seconds;
+}
+
+void show(Shm_Stats *s, Worker_Snapshot *now, int count, Worker_Snapshot *before, int before_count,
+          double seconds)
+{
+    unsigned long at = timer_now_us();
+    long up = time(NULL) - s->started;
+    int alive = kill(s->pid, 0) == 0 || errno == EPERM;
+    printf("lisod %s, pid %d %s, up %ldh%02ldm%02lds\n\n", s->name, s->pid, alive ? "running" : "GONE", up / 3600,
+           up / 60 % 60, up % 60);
+
+    printf("%-8s %7s %-14s %9s %9s %8s %8s %9s %9s %8s\n", "thread", "tid", "state", "req/s", "resp/s", "4xx/s",
+           "5xx/s", "MB/s", "accept/s", "tls/s");
+    for (int i = 0; i < count; ++i)
+    {
+        Worker_Snapshot *w = &now[i];
+        const Worker_Snapshot *b = i < before_count ? &before[i] : NULL;
+        char state[32];
+        double busy_s = w->heartbeat_us < at ? (at - w->heartbeat_us) / 1e6 : 0;
+        if (w->heartbeat_us == 0)
+            snprintf(state, sizeof(state), "not started");
+        else if (w->busy && busy_s * 1e6 >= STUCK_US)
+            snprintf(state, sizeof(state), "STUCK %.1fs", busy_s);
+        else
+            snprintf(state, sizeof(state), "%s", w->busy ? "busy" : "waiting");
+        printf("%-8s %7d %-14s %9.0f %9.0f %8.0f %8.0f %9.2f %9.0f %8.0f\n", w->name, w->tid, state,
+               rate(w, b, SHM_REQUESTS, seconds), rate(w, b, SHM_RESPONSES, seconds),
+               rate(w, b, SHM_RESPONSES_4XX, seconds), rate(w, b, SHM_RESPONSES_5XX, seconds),
+               rate(w, b, SHM_BYTES_SENT, seconds) / 1e6, rate(w, b, SHM_ACCEPTED, seconds),
+               rate(w, b, SHM_HANDSHAKES, seconds));
+    }
+
+    // gauges are only set by the loop, counters summed over everyone
+    unsigned long totals[SHM_COUNTERS] = {0};
+    for (int i = 0; i < count; ++i)
+    {
+        for (int c = 0; c < SHM_COUNTERS; ++c)
+            totals[c] += now[i].counters[c];
+    }
+    printf("\n");
+    for (int i = 0; i < count; ++i)
+    {
+        if (strcmp(now[i].name, "loop") != 0)
+            continue;
+        for (int g = 0; g < SHM_GAUGES; ++g)
+            printf("%s %ld%s", shm_gauge_names[g], now[i].gauges[g], g + 1 < SHM_GAUGES ? ", " : "\n");
+    }
+    for (int c = 0; c < SHM_COUNTERS; ++c)
+        printf("%s %lu%s", shm_counter_names[c], totals[c], c + 1 < SHM_COUNTERS ? ", " : "\n");
+    fflush(stdout);
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-n name] [-i interval_ms] [-1]\n"
+            "  -n  shared memory name lisod got as stats_shm (default /lisod)\n"
+            "  -i  refresh every this many ms (default 1000)\n"
+            "  -1  print once, after one interval, without clearing the screen\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:i:1")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            shm_name = optarg;
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case '1':
+            once = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc || interval_ms < 1)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Shm_Stats *s = open_shm_stats(shm_name);
+    if (s == NULL)
+    {
+        fprintf(stderr, "No lisod stats at %s (is it running with stats_shm=%s?)\n", shm_name, shm_name);
+        return EXIT_FAILURE;
+    }
+
+    Worker_Snapshot snaps[2][SHM_STATS_WORKERS];
+    int counts[2] = {0, 0};
+    int cur = 0;
+    unsigned long last = 0;
+    for (;;)
+    {
+        counts[cur] = snapshot(s, snaps[cur]);
+        unsigned long at = timer_now_us();
+        // a single report still waits one interval for its rates
+        if (!once || last != 0)
+        {
+            if (!once)
+                printf("\033[H\033[J");
+            show(s, snaps[cur], counts[cur], last == 0 ? NULL : snaps[!cur], last == 0 ? 0 : counts[!cur],
+                 (at - last) / 1e6);
+            if (once)
+                break;
+        }
+        last = at;
+        cur = !cur;
+        usleep(interval_ms * 1000);
+    }
+    close_shm_stats(s);
+    return EXIT_SUCCESS;
+}
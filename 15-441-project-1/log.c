@@ -55,7 +55,7 @@ int error_log(Log *log, char *ip_buf, const char *err_msg)
     return SUCCESS;
 }
 
-int access_log(Log *log, char *ip_buf, const char *usr, const char *request, int req_num, int size)
+int access_log(Log *log, char *ip_buf, const char *usr, const char *request, int req_num, int size, const char *fields)
 {
     printf("in access log\n");
 
@@ -73,7 +73,8 @@ int access_log(Log *log, char *ip_buf, const char *usr, const char *request, int
 
     printf("in strftime\n");
 
-    sprintf(first_buf, "%s - %s [%s] \"%s\" %d %d\n", ip_buf, usr, new_time, request, req_num, size);
+    snprintf(first_buf, SIZE, "%s - %s [%s] \"%s\" %d %d%s\n", ip_buf, usr, new_time, request, req_num, size,
+             fields != NULL ? fields : "");
 
     printf("after strftime\n");
 
@@ -38,6 +38,6 @@ int write_log(Log *log, const char *buf);
 
 int error_log(Log *log, char *ip_buf, const char *err_msg);
 
-int access_log(Log *log, char *ip_buf, const char *usr, const char *request, int req_num, int size);
+int access_log(Log *log, char *ip_buf, const char *usr, const char *request, int req_num, int size, const char *fields);
 
 int close_log(Log *log);
\ No newline at end of file
@@ -0,0 +1,181 @@
+#include <string.h>
+#include <stdarg.h>
+
+#include "metrics.h"
+
+static unsigned long generations;
+static __thread unsigned long my_generation; // of the Metrics my_shard belongs to
+static __thread Metrics_Shard *my_shard;
+
+static Metrics_Shard *new_shard()
+{
+    Metrics_Shard *s = aligned_alloc(64, sizeof(Metrics_Shard));
+    memset(s->counters, 0, sizeof(s->counters));
+    for (int h = 0; h < MET_HISTOGRAMS; ++h)
+        hdr_init(&s->histograms[h]);
+    return s;
+}
+
+Metrics *create_metrics(const char *uri)
+{
+    Metrics *m = calloc(1, sizeof(Metrics));
+    m->uri = strdup(uri);
+    m->generation = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+    // threads beyond the others share the last one
+    m->shards[METRICS_SHARDS - 1] = new_shard();
+    return m;
+}
+
+/**
+ * the calling thread's shard, made on its first use
+ */
+static Metrics_Shard *shard_of(Metrics *m)
+{
+    if (my_generation == m->generation)
+        return my_shard;
+    int id = __atomic_fetch_add(&m->shard_count, 1, __ATOMIC_RELAXED);
+    if (id < METRICS_SHARDS - 1)
+    {
+        my_shard = new_shard();
+        __atomic_store_n(&m->shards[id], my_shard, __ATOMIC_RELEASE);
+    }
+    else
+        my_shard = m->shards[METRICS_SHARDS - 1];
+    my_generation = m->generation;
+    return my_shard;
+}
+
+void metrics_count(Metrics *m, int counter, unsigned long n)
+{
+    __atomic_fetch_add(&shard_of(m)->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_status(Metrics *m, int code)
+{
+    if (code >= 100 && code < 600)
+        metrics_count(m, MET_STATUS_1XX + code / 100 - 1, 1);
+}
+
+void metrics_observe(Metrics *m, int histogram, unsigned long value)
+{
+    hdr_record_atomic(&shard_of(m)->histograms[histogram], value);
+}
+
+static void append(char **buf, int *len, int *cap, const char *format, ...)
+{
+    va_list ap;
+    for (;;)
+    {
+        va_start(ap, format);
+        int n = vsnprintf(*buf + *len, *cap - *len, format, ap);
+        va_end(ap);
+        if (n < *cap - *len)
+        {
+            *len += n;
+            return;
+        }
+        *cap = 2 * *cap + n;
+        *buf = realloc(*buf, *cap);
+    }
+}
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+// one sample line, name{labels,extra} value
+static void series(char **buf, int *len, int *cap, const char *name, const char *suffix, const char *labels,
+                   const char *extra, double value)
+{
+    append(buf, len, cap, "%s%s", name, suffix);
+    if (labels != NULL || extra != NULL)
+        append(buf, len, cap, "{%s%s%s}", labels != NULL ? labels : "", labels != NULL && extra != NULL ? "," : "",
+               extra != NULL ? extra : "");
+    append(buf, len, cap, " %.15g\n", value);
+}
+
+static void render_value(char **buf, int *len, int *cap, const Metrics_Value *v)
+{
+    if (v->summary == NULL)
+    {
+        series(buf, len, cap, v->name, "", v->labels, NULL, v->value);
+        return;
+    }
+    char quantile[32];
+    for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); ++q)
+    {
+        snprintf(quantile, sizeof(quantile), "quantile=\"%g\"", quantiles[q]);
+        series(buf, len, cap, v->name, "", v->labels, quantile,
+               histogram_percentile(v->summary, quantiles[q] * 100) * v->value);
+    }
+    series(buf, len, cap, v->name, "_sum", v->labels, NULL, v->summary->sum * v->value);
+    series(buf, len, cap, v->name, "_count", v->labels, NULL, v->summary->count);
+}
+
+/**
+ * all shards summed up, followed by values, in the Prometheus text format.
+ * The caller frees what is returned.
+ */
+char *metrics_render(Metrics *m, const Metrics_Value *values, int count, int *len)
+{
+    unsigned long counters[MET_COUNTERS] = {0};
+    Hdr_Histogram *latency = malloc(sizeof(Hdr_Histogram));
+    hdr_init(latency);
+    for (int i = 0; i < METRICS_SHARDS; ++i)
+    {
+        Metrics_Shard *s = __atomic_load_n(&m->shards[i], __ATOMIC_ACQUIRE);
+        if (s == NULL)
+            continue;
+        for (int c = 0; c < MET_COUNTERS; ++c)
+            counters[c] += __atomic_load_n(&s->counters[c], __ATOMIC_RELAXED);
+        hdr_merge_atomic(latency, &s->histograms[MET_REQUEST_US]);
+    }
+
+    int cap = 4096;
+    char *buf = malloc(cap);
+    *len = 0;
+    append(&buf, len, &cap,
+           "# HELP lisod_requests_total Requests read from clients.\n"
+           "# TYPE lisod_requests_total counter\n"
+           "lisod_requests_total %lu\n"
+           "# HELP lisod_responses_total Responses by status class.\n"
+           "# TYPE lisod_responses_total counter\n",
+           counters[MET_REQUESTS]);
+    for (int c = MET_STATUS_1XX; c <= MET_STATUS_5XX; ++c)
+        append(&buf, len, &cap, "lisod_responses_total{code=\"%dxx\"} %lu\n", c - MET_STATUS_1XX + 1, counters[c]);
+    append(&buf, len, &cap,
+           "# HELP lisod_sent_bytes_total Bytes written to clients, headers included.\n"
+           "# TYPE lisod_sent_bytes_total counter\n"
+           "lisod_sent_bytes_total %lu\n"
+           "# HELP lisod_connections_accepted_total Client connections accepted.\n"
+           "# TYPE lisod_connections_accepted_total counter\n"
+           "lisod_connections_accepted_total %lu\n",
+           counters[MET_BYTES_SENT], counters[MET_ACCEPTED]);
+
+    append(&buf, len, &cap,
+           "# HELP lisod_request_duration_seconds Request complete to response headers out.\n"
+           "# TYPE lisod_request_duration_seconds summary\n");
+    for (int q = 0; q < (int)(sizeof(quantiles) / sizeof(quantiles[0])); ++q)
+        append(&buf, len, &cap, "lisod_request_duration_seconds{quantile=\"%g\"} %g\n", quantiles[q],
+               hdr_percentile(latency, quantiles[q] * 100) / 1e6);
+    append(&buf, len, &cap,
+           "lisod_request_duration_seconds_sum %g\n"
+           "lisod_request_duration_seconds_count %lu\n",
+           latency->sum / 1e6, latency->count);
+    free(latency);
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (i == 0 || strcmp(values[i].name, values[i - 1].name) != 0)
+            append(&buf, len, &cap, "# HELP %s %s\n# TYPE %s %s\n", values[i].name, values[i].help, values[i].name,
+                   values[i].type);
+        render_value(&buf, len, &cap, &values[i]);
+    }
+    return buf;
+}
+
+void destroy_metrics(Metrics *m)
+{
+    for (int i = 0; i < METRICS_SHARDS; ++i)
+        free(m->shards[i]);
+    free(m->uri);
+    free(m);
+}
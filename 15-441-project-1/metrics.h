@@ -0,0 +1,71 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hdr_histogram.h"
+#include "histogram.h"
+
+#define METRICS_SHARDS 64 // threads with their own counters, the rest share one
+
+// counters any thread can bump
+enum
+{
+    MET_REQUESTS = 0,
+    MET_STATUS_1XX, // MET_STATUS_1XX + code / 100 - 1 for the others
+    MET_STATUS_2XX,
+    MET_STATUS_3XX,
+    MET_STATUS_4XX,
+    MET_STATUS_5XX,
+    MET_BYTES_SENT,
+    MET_ACCEPTED,
+    MET_COUNTERS
+};
+
+enum
+{
+    MET_REQUEST_US = 0, // request complete to response headers out
+    MET_HISTOGRAMS
+};
+
+// one thread's share, written by it alone and summed up on read
+typedef struct
+{
+    unsigned long counters[MET_COUNTERS];
+    Hdr_Histogram histograms[MET_HISTOGRAMS];
+} __attribute__((aligned(64))) Metrics_Shard;
+
+typedef struct
+{
+    char *uri;                // answered with the metrics
+    unsigned long generation; // tells it from one made later at the same address
+    Metrics_Shard *shards[METRICS_SHARDS];
+    int shard_count;
+} Metrics;
+
+// a value kept elsewhere (the CGI cache, TLS...) that goes out along with
+// them. Series of one name follow each other and only differ in labels.
+typedef struct
+{
+    const char *name;
+    const char *help;
+    const char *type;   // counter, gauge or summary
+    double value;       // for a summary, what its samples are multiplied by
+    const char *labels; // name="value",... or NULL
+    Histogram *summary; // samples of a summary
+} Metrics_Value;
+
+Metrics *create_metrics(const char *uri);
+
+void metrics_count(Metrics *m, int counter, unsigned long n);
+
+void metrics_status(Metrics *m, int code);
+
+void metrics_observe(Metrics *m, int histogram, unsigned long value);
+
+char *metrics_render(Metrics *m, const Metrics_Value *values, int count, int *len);
+
+void destroy_metrics(Metrics *m);
+
+#endif
@@ -0,0 +1,480 @@
+/******************************************************************************
+* microbench.c                                                                *
+*                                                                             *
+* Description: Microbenchmarks of the request path: parse(),                 *
+*              parse_response(), handle_request(), the connection table and   *
+*              access_log(), over realistic and adversarial inputs. Built by  *
+*              `make bench`, which links lisod.c without its main() and wraps *
+*              the allocation and copy functions so each benchmark also       *
+*              reports allocations and bytes copied per operation.            *
+*                                                                             *
+*              Output is one JSON object per line:                            *
+*              {"bench": ..., "iterations": ..., "ns_per_op": ...,            *
+*               "allocs_per_op": ..., "alloc_bytes_per_op": ...,              *
+*               "copied_bytes_per_op": ...}                                   *
+*                                                                             *
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "parse.h"
+#include "log.h"
+#include "hash_table.h"
+#include "config.h"
+
+#define CORPUS_MAX 16
+#define TABLE_KEYS 1024
+
+extern Response *handle_request(Request *request, int pre_assigned_code, const char *www_folder, int requests_left);
+
+// what the wrapped functions saw while counting
+int counting = 0;
+unsigned long allocs = 0;
+unsigned long alloc_bytes = 0;
+unsigned long copied_bytes = 0;
+
+double min_seconds = 0.2; // per benchmark
+const char *filter = NULL;
+FILE *report;
+
+/*
+ * The link wraps these (-Wl,--wrap=...) for every object in the binary, so
+ * only lisod's own calls are counted, not those made inside libc or OpenSSL.
+ * Copies the compiler turns into inline moves are not seen.
+ */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+void *__real_memcpy(void *dest, const void *src, size_t n);
+void *__real_memmove(void *dest, const void *src, size_t n);
+char *__real_strcpy(char *dest, const char *src);
+char *__real_strncpy(char *dest, const char *src, size_t n);
+char *__real_strcat(char *dest, const char *src);
+
+void *__wrap_malloc(size_t size)
+{
+    if (counting)
+    {
+        allocs++;
+        alloc_bytes += size;
+    }
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    if (counting)
+    {
+        allocs++;
+        alloc_bytes += n * size;
+    }
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (counting)
+    {
+        allocs++;
+        alloc_bytes += size;
+    }
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+    if (counting)
+    {
+        allocs++;
+        alloc_bytes += strlen(s) + 1;
+        copied_bytes += strlen(s) + 1;
+    }
+    return __real_strdup(s);
+}
+
+void *__wrap_memcpy(void *dest, const void *src, size_t n)
+{
+    if (counting)
+        copied_bytes += n;
+    return __real_memcpy(dest, src, n);
+}
+
+void *__wrap_memmove(void *dest, const void *src, size_t n)
+{
+    if (counting)
+        copied_bytes += n;
+    return __real_memmove(dest, src, n);
+}
+
+char *__wrap_strcpy(char *dest, const char *src)
+{
+    if (counting)
+        copied_bytes += strlen(src) + 1;
+    return __real_strcpy(dest, src);
+}
+
+char *__wrap_strncpy(char *dest, const char *src, size_t n)
+{
+    if (counting)
+        copied_bytes += n;
+    return __real_strncpy(dest, src, n);
+}
+
+char *__wrap_strcat(char *dest, const char *src)
+{
+    if (counting)
+        copied_bytes += strlen(src) + 1;
+    return __real_strcat(dest, src);
+}
+
+int __wrap_sprintf(char *str, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int n = vsprintf(str, format, ap);
+    va_end(ap);
+    if (counting && n > 0)
+        copied_bytes += n;
+    return n;
+}
+
+int __wrap_snprintf(char *str, size_t size, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(str, size, format, ap);
+    va_end(ap);
+    if (counting && n > 0)
+        copied_bytes += (size_t)n < size ? (size_t)n : size;
+    return n;
+}
+
+typedef struct
+{
+    const char *name;
+    char *buf;
+    int len;
+} Sample;
+
+Sample requests[CORPUS_MAX];
+int request_count = 0;
+Sample responses[CORPUS_MAX];
+int response_count = 0;
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void add_sample(Sample *set, int *count, const char *name, char *buf)
+{
+    set[*count].name = name;
+    set[*count].buf = buf;
+    set[*count].len = strlen(buf);
+    (*count)++;
+}
+
+static char *repeat(char c, int n)
+{
+    char *s = malloc(n + 1);
+    memset(s, c, n);
+    s[n] = 0;
+    return s;
+}
+
+void build_corpus()
+{
+    char *buf;
+
+    add_sample(requests, &request_count, "simple", strdup("GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"));
+    // what a browser sends, as in sample_request_realistic
+    add_sample(requests, &request_count, "realistic",
+               strdup("GET /index.html HTTP/1.1\r\n"
+                      "Host: localhost:9999\r\n"
+                      "Connection: keep-alive\r\n"
+                      "Cache-Control: max-age=0\r\n"
+                      "Upgrade-Insecure-Requests: 1\r\n"
+                      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+                      "Chrome/80.0.3987.132 Safari/537.36\r\n"
+                      "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,"
+                      "image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.9\r\n"
+                      "Accept-Encoding: gzip, deflate, br\r\n"
+                      "Accept-Language: en-US,en;q=0.9\r\n"
+                      "Cookie: session=4f8a9c2e1b7d6e3a; theme=dark; tracking=off\r\n"
+                      "\r\n"));
+
+    // 100 short headers: one realloc of the header array each
+    buf = malloc(BUF_SIZE);
+    int at = sprintf(buf, "GET /index.html HTTP/1.1\r\n");
+    for (int i = 0; i < 100; ++i)
+        at += sprintf(buf + at, "X-Header-%d: value-%d\r\n", i, i);
+    sprintf(buf + at, "\r\n");
+    add_sample(requests, &request_count, "many_headers", buf);
+
+    // one 4000 byte value, built up a character at a time by the grammar
+    char *value = repeat('a', 4000);
+    buf = malloc(BUF_SIZE);
+    sprintf(buf, "GET / HTTP/1.1\r\nHost: localhost\r\nCookie: %s\r\n\r\n", value);
+    add_sample(requests, &request_count, "long_header", buf);
+    free(value);
+
+    char *uri = repeat('u', 4000);
+    uri[0] = '/';
+    buf = malloc(BUF_SIZE);
+    sprintf(buf, "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", uri);
+    add_sample(requests, &request_count, "huge_uri", buf);
+    free(uri);
+
+    // more than parse() looks at, rejected without the grammar
+    char *oversized = repeat('b', 9000);
+    buf = malloc(9100);
+    sprintf(buf, "GET / HTTP/1.1\r\nHost: localhost\r\nX-Big: %s\r\n\r\n", oversized);
+    add_sample(requests, &request_count, "oversized", buf);
+    free(oversized);
+
+    add_sample(requests, &request_count, "malformed", strdup("GET\r\n: no-name\r\n\r\n"));
+
+    add_sample(responses, &response_count, "cgi",
+               strdup("HTTP/1.1 200 OK\r\n"
+                      "Content-Type: text/html\r\n"
+                      "Content-Length: 1024\r\n"
+                      "Connection: keep-alive\r\n"
+                      "\r\n"));
+    buf = malloc(BUF_SIZE);
+    at = sprintf(buf, "HTTP/1.1 200 OK\r\n");
+    for (int i = 0; i < 50; ++i)
+        at += sprintf(buf + at, "Set-Cookie: c%d=%d; Path=/; HttpOnly\r\n", i, i);
+    sprintf(buf + at, "Connection: close\r\n\r\n");
+    add_sample(responses, &response_count, "many_headers", buf);
+}
+
+/*
+ * Run op() in rounds of doubling size until a round takes min_seconds,
+ * then report that round.
+ */
+void run(const char *name, void (*op)(void *), void *arg)
+{
+    if (filter != NULL && strstr(name, filter) == NULL)
+        return;
+
+    unsigned long n = 1;
+    for (;;)
+    {
+        allocs = alloc_bytes = copied_bytes = 0;
+        counting = 1;
+        unsigned long start = now_ns();
+        for (unsigned long i = 0; i < n; ++i)
+            op(arg);
+        unsigned long elapsed = now_ns() - start;
+        counting = 0;
+        if (elapsed >= min_seconds * 1e9 || n >= (1UL << 30))
+        {
+            fprintf(report,
+                    "{\"bench\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, "
+                    "\"alloc_bytes_per_op\": %.1f, \"copied_bytes_per_op\": %.1f}\n",
+                    name, n, (double)elapsed / n, (double)allocs / n, (double)alloc_bytes / n,
+                    (double)copied_bytes / n);
+            fflush(report);
+            return;
+        }
+        n *= 2;
+    }
+}
+
+void free_request(Request *request)
+{
+    if (request == NULL)
+        return;
+    free(request->headers);
+    free(request);
+}
+
+void free_response(Response *response)
+{
+    if (response == NULL)
+        return;
+    if (response->file_fd != -1)
+        close(response->file_fd);
+    free(response->buf);
+    free(response);
+}
+
+void op_parse(void *arg)
+{
+    Sample *s = (Sample *)arg;
+    free_request(parse(s->buf, s->len, 0));
+}
+
+void op_parse_response(void *arg)
+{
+    Sample *s = (Sample *)arg;
+    // the buffer stays the caller's
+    free(parse_response(s->buf, s->len, 0));
+}
+
+typedef struct
+{
+    Request *request;
+    int code;
+    const char *www;
+} Handle_Case;
+
+void op_handle_request(void *arg)
+{
+    Handle_Case *h = (Handle_Case *)arg;
+    free_response(handle_request(h->request, h->code, h->www, -1));
+}
+
+Table *bench_table;
+
+// a connection's life: accepted, looked up on every read, closed
+void op_table_cycle(void *arg)
+{
+    static int key = 0;
+    int k = TABLE_KEYS + key++ % TABLE_KEYS;
+    struct sockaddr_in *addr = malloc(sizeof(struct sockaddr_in));
+    memset(addr, 0, sizeof(*addr));
+    insert_table(bench_table, k, (struct sockaddr *)addr, 0);
+    lookup_table_node(bench_table, k);
+    mark_idle(bench_table, k);
+    mark_busy(bench_table, k);
+    remove_table(bench_table, k);
+}
+
+void op_table_lookup(void *arg)
+{
+    static int key = 0;
+    lookup_table_node(bench_table, key++ % TABLE_KEYS);
+}
+
+void op_access_log(void *arg)
+{
+    access_log((Log *)arg, "127.0.0.1", "", "GET /index.html HTTP/1.1", 200, 1024, NULL);
+}
+
+static void write_file(const char *dir, const char *name, int size)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *content = repeat('x', size);
+    if (fd < 0 || write(fd, content, size) != size)
+        perror(path);
+    free(content);
+    if (fd >= 0)
+        close(fd);
+}
+
+void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t seconds_per_benchmark] [-f name_filter]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            min_seconds = atof(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // the code under test prints as it goes, keep that out of the report
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    freopen("/dev/null", "w", stdout);
+    freopen("/dev/null", "w", stderr);
+
+    config_init_default(&config);
+    build_corpus();
+
+    char www[] = "/tmp/microbench.XXXXXX";
+    if (mkdtemp(www) == NULL)
+    {
+        fprintf(report, "Cannot create a www folder.\n");
+        return EXIT_FAILURE;
+    }
+    write_file(www, "index.html", 1024);
+    write_file(www, "style.css", 4096);
+
+    char name[128];
+    for (int i = 0; i < request_count; ++i)
+    {
+        snprintf(name, sizeof(name), "parse/%s", requests[i].name);
+        run(name, op_parse, &requests[i]);
+    }
+    for (int i = 0; i < response_count; ++i)
+    {
+        snprintf(name, sizeof(name), "parse_response/%s", responses[i].name);
+        run(name, op_parse_response, &responses[i]);
+    }
+
+    char get_css[] = "GET /style.css HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char head_index[] = "HEAD /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char missing[] = "GET /missing.html HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    Handle_Case cases[] = {
+        {parse(requests[1].buf, requests[1].len, 0), 0, www},
+        {parse(get_css, strlen(get_css), 0), 0, www},
+        {parse(head_index, strlen(head_index), 0), 0, www},
+        {parse(missing, strlen(missing), 0), 0, www},
+        {parse(requests[2].buf, requests[2].len, 0), 0, www},
+        {NULL, 400, www},
+    };
+    const char *case_names[] = {"realistic_200", "css_200", "head_200", "missing_404", "many_headers_200",
+                                "bad_request_400"};
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i)
+    {
+        snprintf(name, sizeof(name), "handle_request/%s", case_names[i]);
+        run(name, op_handle_request, &cases[i]);
+        free_request(cases[i].request);
+    }
+
+    bench_table = create_table(TABLE_KEYS);
+    for (int k = 0; k < TABLE_KEYS; ++k)
+    {
+        struct sockaddr_in *addr = calloc(1, sizeof(struct sockaddr_in));
+        insert_table(bench_table, k, (struct sockaddr *)addr, 0);
+    }
+    run("hash_table/lookup", op_table_lookup, NULL);
+    run("hash_table/insert_remove", op_table_cycle, NULL);
+    remove_all_entries_in_table(bench_table);
+
+    char log_path[512];
+    snprintf(log_path, sizeof(log_path), "%s/access.log", www);
+    Log *log = log_init_default(log_path);
+    run("access_log/line", op_access_log, log);
+
+    // leave nothing behind
+    snprintf(name, sizeof(name), "%s/index.html", www);
+    unlink(name);
+    snprintf(name, sizeof(name), "%s/style.css", www);
+    unlink(name);
+    unlink(log_path);
+    rmdir(www);
+    for (int i = 0; i < request_count; ++i)
+        free(requests[i].buf);
+    for (int i = 0; i < response_count; ++i)
+        free(responses[i].buf);
+    fclose(report);
+    return EXIT_SUCCESS;
+}
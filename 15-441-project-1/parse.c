@@ -161,6 +161,7 @@ Response *parse_response(char *buffer, int size, int socketFd)
 		response->code = -1;
 		response->real_size = 0; // TODO
 		response->buf = buffer;
+		response->file_fd = -1;
 		response->size = i;
 		//TODO You will need to handle resizing this in parser.y
 
@@ -1,3 +1,6 @@
+#ifndef _PARSE_H_
+#define _PARSE_H_
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,8 +34,12 @@ typedef struct
 	ssize_t size;
 	ssize_t real_size;
 	int close; // 0 close, 1 not close
+	int file_fd; // static file sent after buf, -1 if none
+	ssize_t file_size;
 } Response;
 
 Request *parse(char *buffer, int size, int socketFd);
 
 Response *parse_response(char *buffer, int size, int socketFd);
+
+#endif
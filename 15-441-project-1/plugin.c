@@ -0,0 +1,395 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include "plugin.h"
+#include "timer_wheel.h"
+
+/**
+ * load one "prefix=path[:args]" entry of the plugins option into route.
+ * Fails if the object cannot be loaded or was built for another ABI.
+ */
+static int load_route(Plugin_Route *route, char *entry)
+{
+    char *eq = strchr(entry, '=');
+    if (eq == NULL || eq == entry)
+    {
+        fprintf(stderr, "Plugin %s is not of the form prefix=path.\n", entry);
+        return PLUGIN_FAILURE;
+    }
+    *eq = '\0';
+    char *path = eq + 1;
+    char *colon = strchr(path, ':');
+    if (colon != NULL)
+        *colon = '\0';
+
+    memset(route, 0, sizeof(Plugin_Route));
+    route->dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (route->dl == NULL)
+    {
+        fprintf(stderr, "Error loading plugin %s: %s\n", path, dlerror());
+        return PLUGIN_FAILURE;
+    }
+    route->plugin = (const Lisod_Plugin *)dlsym(route->dl, LISOD_PLUGIN_SYMBOL);
+    if (route->plugin == NULL || route->plugin->abi != LISOD_PLUGIN_ABI || route->plugin->handle == NULL)
+    {
+        fprintf(stderr, "Plugin %s has no usable %s.\n", path, LISOD_PLUGIN_SYMBOL);
+        dlclose(route->dl);
+        return PLUGIN_FAILURE;
+    }
+
+    route->prefix = strdup(entry);
+    route->args = colon == NULL ? NULL : strdup(colon + 1);
+    if (route->plugin->init != NULL)
+        route->data = route->plugin->init(route->args);
+    printf("Plugin %s serves %s\n", route->plugin->name, route->prefix);
+    return 0;
+}
+
+/**
+ * load the handlers of spec, a comma separated list of prefix=path[:args].
+ * Handlers that fail to load are left out; NULL if none is left.
+ */
+Plugin_Host *create_plugin_host(const char *spec, int workers, plugin_callback done, void *arg)
+{
+    Plugin_Host *h = calloc(1, sizeof(Plugin_Host));
+    char *copy = strdup(spec);
+    int blocking = 0;
+
+    for (char *entry = strtok(copy, ","); entry != NULL; entry = strtok(NULL, ","))
+    {
+        h->routes = realloc(h->routes, (h->count + 1) * sizeof(Plugin_Route));
+        if (load_route(&h->routes[h->count], entry) != 0)
+            continue;
+        if (h->routes[h->count].plugin->flags & LISOD_BLOCKING)
+            blocking = 1;
+        h->count++;
+    }
+    free(copy);
+
+    if (h->count == 0 || pipe(h->notify_fd) < 0)
+    {
+        h->notify_fd[0] = h->notify_fd[1] = -1;
+        destroy_plugin_host(h);
+        return NULL;
+    }
+    fcntl(h->notify_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(h->notify_fd[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&h->lock, NULL);
+    h->done = done;
+    h->arg = arg;
+
+    if (blocking && workers > 0 && (h->workers = create_thread_pool(workers)) == NULL)
+        fprintf(stderr, "Error starting plugin workers, blocking handlers run in the loop.\n");
+    return h;
+}
+
+// the route serving uri, -1 if none does
+int plugin_route(Plugin_Host *h, const char *uri)
+{
+    for (int i = 0; i < h->count; ++i)
+    {
+        if (strncmp(uri, h->routes[i].prefix, strlen(h->routes[i].prefix)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void res_status(Lisod_Response *res, int code, const char *reason)
+{
+    Plugin_Response *r = (Plugin_Response *)res;
+    r->code = code;
+    snprintf(r->reason, sizeof(r->reason), "%s", reason == NULL ? "" : reason);
+}
+
+static void res_header(Lisod_Response *res, const char *name, const char *value)
+{
+    Plugin_Response *r = (Plugin_Response *)res;
+    int n = strlen(name) + strlen(value) + 4;
+    r->head = realloc(r->head, r->head_len + n + 1);
+    r->head_len += sprintf(r->head + r->head_len, "%s: %s\r\n", name, value);
+}
+
+static void res_write(Lisod_Response *res, const void *buf, int len)
+{
+    Plugin_Response *r = (Plugin_Response *)res;
+    r->body = realloc(r->body, r->body_len + len);
+    memcpy(r->body + r->body_len, buf, len);
+    r->body_len += len;
+}
+
+// may run on any thread; wakes the loop if it is not waiting for handle()
+static void res_finish(Lisod_Response *res)
+{
+    Plugin_Response *r = (Plugin_Response *)res;
+    Plugin_Host *h = r->host;
+    pthread_mutex_lock(&h->lock);
+    r->finished = 1;
+    if (r->handed_off)
+    {
+        r->finished_next = h->finished;
+        h->finished = r;
+        char c = 0;
+        write(h->notify_fd[1], &c, 1);
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+static char *copy_string(char **at, const char *s, size_t len)
+{
+    char *start = *at;
+    memcpy(start, s, len);
+    start[len] = '\0';
+    *at += len + 1;
+    return start;
+}
+
+// a copy of the request for the handler, it outlives the parser's
+static void build_view(Plugin_Response *r, Request *request, const char *body, int body_len,
+                       const char *addr, int https)
+{
+    const char *uri = request->http_uri;
+    const char *mark = strchr(uri, '?');
+    size_t path_end = mark == NULL ? strlen(uri) : (size_t)(mark - uri);
+    size_t prefix_len = strlen(r->route->prefix);
+    if (prefix_len > path_end)
+        prefix_len = path_end;
+    const char *query = mark == NULL ? "" : mark + 1;
+
+    size_t size = strlen(request->http_method) + strlen(uri) + path_end + strlen(query) + strlen(addr) +
+                  body_len + 6;
+    for (int i = 0; i < request->header_count; ++i)
+        size += strlen(request->headers[i].header_name) + strlen(request->headers[i].header_value) + 2;
+
+    char *at = r->strings = malloc(size);
+    r->req.method = copy_string(&at, request->http_method, strlen(request->http_method));
+    r->req.uri = copy_string(&at, uri, strlen(uri));
+    r->req.path = copy_string(&at, uri + prefix_len, path_end - prefix_len);
+    r->req.query = copy_string(&at, query, strlen(query));
+    r->req.remote_addr = copy_string(&at, addr, strlen(addr));
+    r->req.body = copy_string(&at, body, body_len);
+    r->req.body_len = body_len;
+    r->req.https = https;
+
+    r->headers = malloc((request->header_count + 1) * sizeof(Lisod_Header));
+    for (int i = 0; i < request->header_count; ++i)
+    {
+        const char *name = request->headers[i].header_name;
+        const char *value = request->headers[i].header_value;
+        r->headers[i].name = copy_string(&at, name, strlen(name));
+        r->headers[i].value = copy_string(&at, value, strlen(value));
+    }
+    r->req.headers = r->headers;
+    r->req.header_count = request->header_count;
+    r->head_only = strcmp(request->http_method, "HEAD") == 0;
+}
+
+static char *render(Plugin_Response *r, int *len)
+{
+    int body_len = r->head_only ? 0 : r->body_len;
+    char *http = malloc(sizeof(r->reason) + r->head_len + body_len + 64);
+    int n = sprintf(http, "HTTP/1.1 %d %s\r\n", r->code, r->reason);
+    if (r->head_len > 0)
+        memcpy(http + n, r->head, r->head_len);
+    n += r->head_len;
+    n += sprintf(http + n, "Content-Length: %d\r\n\r\n", r->body_len);
+    if (body_len > 0)
+        memcpy(http + n, r->body, body_len);
+    *len = n + body_len;
+    return http;
+}
+
+static void free_response(Plugin_Host *h, Plugin_Response *r)
+{
+    Plugin_Response **link = &h->in_flight;
+    while (*link != NULL && *link != r)
+        link = &(*link)->next;
+    if (*link != NULL)
+        *link = r->next;
+    free(r->strings);
+    free(r->headers);
+    free(r->head);
+    free(r->body);
+    free(r);
+}
+
+// a response is complete: pass it to its client unless that one is gone
+static void deliver(Plugin_Host *h, Plugin_Response *r)
+{
+    histogram_record(&r->route->latency_us, timer_now_us() - r->started);
+    if (r->client_fd >= 0)
+    {
+        int len;
+        char *http = render(r, &len);
+        h->done(r->client_fd, r->code, http, len, h->arg);
+    }
+    free_response(h, r);
+}
+
+/**
+ * handle() returned, on the loop. Whether the response is still to come;
+ * if so the handler's finish() wakes the loop from now on.
+ */
+static int hand_off(Plugin_Host *h, Plugin_Response *r)
+{
+    pthread_mutex_lock(&h->lock);
+    if (r->result != LISOD_ASYNC)
+        r->finished = 1;
+    int pending = !r->finished;
+    r->handed_off = pending;
+    pthread_mutex_unlock(&h->lock);
+    if (pending)
+        r->route->async++;
+    return pending;
+}
+
+static void blocking_work(void *job)
+{
+    Plugin_Response *r = (Plugin_Response *)job;
+    r->result = r->route->plugin->handle(&r->req, &r->res, r->route->data);
+}
+
+static void blocking_done(void *job, void *arg)
+{
+    Plugin_Host *h = (Plugin_Host *)arg;
+    Plugin_Response *r = (Plugin_Response *)job;
+    if (!hand_off(h, r))
+        deliver(h, r);
+}
+
+/**
+ * run the handler of route for client_fd. Returns 0 with the whole HTTP
+ * response in *http if it finished right away, PLUGIN_PENDING if it comes
+ * through the callback later.
+ */
+int plugin_dispatch(Plugin_Host *h, int route, int client_fd, Request *request, const char *body, int body_len,
+                    const char *addr, int https, char **http, int *len, int *code)
+{
+    Plugin_Route *rt = &h->routes[route];
+    Plugin_Response *r = calloc(1, sizeof(Plugin_Response));
+    r->res.status = res_status;
+    r->res.header = res_header;
+    r->res.write = res_write;
+    r->res.finish = res_finish;
+    r->host = h;
+    r->route = rt;
+    r->client_fd = client_fd;
+    r->code = 200;
+    strcpy(r->reason, "OK");
+    r->started = timer_now_us();
+    build_view(r, request, body, body_len, addr, https);
+    r->next = h->in_flight;
+    h->in_flight = r;
+    rt->calls++;
+
+    if ((rt->plugin->flags & LISOD_BLOCKING) && h->workers != NULL &&
+        thread_pool_submit(h->workers, blocking_work, blocking_done, r) == 0)
+        return PLUGIN_PENDING;
+
+    r->result = rt->plugin->handle(&r->req, &r->res, rt->data);
+    if (hand_off(h, r))
+        return PLUGIN_PENDING;
+
+    histogram_record(&rt->latency_us, timer_now_us() - r->started);
+    *http = render(r, len);
+    *code = r->code;
+    free_response(h, r);
+    return 0;
+}
+
+int plugin_is_notify(Plugin_Host *h, int fd)
+{
+    return fd == h->notify_fd[0] || (h->workers != NULL && fd == h->workers->notify_fd[0]);
+}
+
+/**
+ * deliver what blocking handlers returned and what asynchronous ones
+ * finished since the last call
+ */
+void plugin_complete(Plugin_Host *h)
+{
+    if (h->workers != NULL)
+        thread_pool_complete(h->workers, h);
+
+    char drain[64];
+    while (read(h->notify_fd[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&h->lock);
+    Plugin_Response *list = h->finished;
+    h->finished = NULL;
+    pthread_mutex_unlock(&h->lock);
+
+    // finished is a stack, put it back in completion order
+    Plugin_Response *ordered = NULL;
+    while (list != NULL)
+    {
+        Plugin_Response *next = list->finished_next;
+        list->finished_next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered != NULL)
+    {
+        Plugin_Response *next = ordered->finished_next;
+        deliver(h, ordered);
+        ordered = next;
+    }
+}
+
+// the client left, whatever its handler still produces is dropped
+void plugin_abort(Plugin_Host *h, int client_fd)
+{
+    for (Plugin_Response *r = h->in_flight; r != NULL; r = r->next)
+    {
+        if (r->client_fd == client_fd)
+            r->client_fd = -1;
+    }
+}
+
+void plugin_digest(Plugin_Host *h, char *buf, size_t size)
+{
+    size_t n = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < h->count && n < size; ++i)
+    {
+        Plugin_Route *route = &h->routes[i];
+        int k = snprintf(buf + n, size - n, "Plugin %s on %s: calls: %lu, asynchronous: %lu\n",
+                         route->plugin->name, route->prefix, route->calls, route->async);
+        if (k < 0)
+            break;
+        n += k;
+        if (n < size)
+        {
+            histogram_digest(&route->latency_us, "Plugin latency us", buf + n, size - n);
+            n += strlen(buf + n);
+        }
+    }
+}
+
+void destroy_plugin_host(Plugin_Host *h)
+{
+    // workers may still be inside a handler
+    if (h->workers != NULL)
+        destroy_thread_pool(h->workers);
+    while (h->in_flight != NULL)
+        free_response(h, h->in_flight);
+
+    for (int i = 0; i < h->count; ++i)
+    {
+        Plugin_Route *route = &h->routes[i];
+        if (route->plugin->fini != NULL)
+            route->plugin->fini(route->data);
+        dlclose(route->dl);
+        free(route->prefix);
+        free(route->args);
+    }
+    free(h->routes);
+    if (h->notify_fd[0] >= 0)
+    {
+        close(h->notify_fd[0]);
+        close(h->notify_fd[1]);
+        pthread_mutex_destroy(&h->lock);
+    }
+    free(h);
+}
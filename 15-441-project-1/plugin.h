@@ -0,0 +1,86 @@
+#ifndef _PLUGIN_H_
+#define _PLUGIN_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lisod_plugin.h"
+#include "parse.h"
+#include "thread_pool.h"
+#include "histogram.h"
+
+#define PLUGIN_FAILURE 2
+#define PLUGIN_PENDING 1 // plugin_dispatch(): the response comes through the callback
+
+// http is a whole HTTP response for the callback to free, code its status
+typedef void (*plugin_callback)(int client_fd, int code, char *http, int len, void *arg);
+
+typedef struct
+{
+    char *prefix;
+    char *args;
+    void *dl;
+    const Lisod_Plugin *plugin;
+    void *data; // from init()
+    unsigned long calls;
+    unsigned long async;
+    Histogram latency_us; // dispatch to finish
+} Plugin_Route;
+
+typedef struct Plugin_Response
+{
+    Lisod_Response res; // first, handlers only see this part
+    Lisod_Request req;
+    Lisod_Header *headers;
+    char *strings; // the request view points in here
+    int client_fd; // -1 once the client gave up on it
+    Plugin_Route *route;
+    int code;
+    char reason[64];
+    char *head; // header lines set by the handler
+    int head_len;
+    char *body;
+    int body_len;
+    int result;     // of handle()
+    int finished;   // finish() was called
+    int handed_off; // the loop moved on, finish() has to wake it
+    int head_only;  // HEAD, the body is counted but not sent
+    unsigned long started; // us
+    struct Plugin_Host *host;
+    struct Plugin_Response *next;          // in flight
+    struct Plugin_Response *finished_next; // finished, for the loop to deliver
+} Plugin_Response;
+
+typedef struct Plugin_Host
+{
+    Plugin_Route *routes;
+    int count;
+    Thread_Pool *workers; // for LISOD_BLOCKING handlers, NULL if none needs them
+    pthread_mutex_t lock;
+    Plugin_Response *finished; // asynchronous finishes, for the loop
+    Plugin_Response *in_flight;
+    int notify_fd[2]; // [0] turns readable when something finished
+    plugin_callback done;
+    void *arg;
+} Plugin_Host;
+
+Plugin_Host *create_plugin_host(const char *spec, int workers, plugin_callback done, void *arg);
+
+int plugin_route(Plugin_Host *h, const char *uri);
+
+int plugin_dispatch(Plugin_Host *h, int route, int client_fd, Request *request, const char *body, int body_len,
+                    const char *addr, int https, char **http, int *len, int *code);
+
+int plugin_is_notify(Plugin_Host *h, int fd);
+
+void plugin_complete(Plugin_Host *h);
+
+void plugin_abort(Plugin_Host *h, int client_fd);
+
+void plugin_digest(Plugin_Host *h, char *buf, size_t size);
+
+void destroy_plugin_host(Plugin_Host *h);
+
+#endif
@@ -0,0 +1,23 @@
+/*
+ * A minimal native handler, built as plugin_hello.so. Mount it with
+ *
+ *     ./lisod ... plugins=/hello=./plugin_hello.so
+ *
+ * and GET /hello/anything answers from inside lisod, no process started.
+ */
+#include <stdio.h>
+
+#include "lisod_plugin.h"
+
+static int handle(const Lisod_Request *req, Lisod_Response *res, void *data)
+{
+    char body[512];
+    int n = snprintf(body, sizeof(body), "Hello %s, you asked for %s\n", req->remote_addr, req->path);
+    if (n >= (int)sizeof(body))
+        n = sizeof(body) - 1;
+    res->header(res, "Content-Type", "text/plain");
+    res->write(res, body, n);
+    return LISOD_DONE;
+}
+
+const Lisod_Plugin lisod_plugin = {LISOD_PLUGIN_ABI, "hello", 0, NULL, handle, NULL};
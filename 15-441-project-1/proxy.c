@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "proxy.h"
+#include "timer_wheel.h"
+
+// where proxy_framed() is in a chunked body
+enum
+{
+    CHUNK_SIZE = 0,
+    CHUNK_EXT,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER_START,
+    CHUNK_TRAILER
+};
+
+// headers that only concern one hop, never passed on
+static const char *HOP_BY_HOP[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Expect", NULL};
+
+static int hop_by_hop(const char *name, size_t len)
+{
+    for (int i = 0; HOP_BY_HOP[i] != NULL; ++i)
+    {
+        if (strlen(HOP_BY_HOP[i]) == len && strncasecmp(name, HOP_BY_HOP[i], len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * resolve one upstream, unix:/path or host:port, into u. Host names are
+ * looked up once, at startup.
+ */
+static int resolve(Upstream *u, const char *name)
+{
+    memset(u, 0, sizeof(Upstream));
+    if (strncmp(name, "unix:", 5) == 0)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)&u->addr;
+        if (strlen(name + 5) >= sizeof(un->sun_path))
+            return PROXY_FAILURE;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, name + 5);
+        u->addr_len = sizeof(struct sockaddr_un);
+        u->name = strdup(name);
+        return 0;
+    }
+
+    char *host = strdup(name);
+    char *colon = strrchr(host, ':');
+    if (colon == NULL || colon == host)
+    {
+        free(host);
+        return PROXY_FAILURE;
+    }
+    *colon = '\0';
+    char *h = host;
+    if (*h == '[' && colon[-1] == ']')
+    {
+        h++;
+        colon[-1] = '\0';
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(h, colon + 1, &hints, &res);
+    free(host);
+    if (err != 0)
+        return PROXY_FAILURE;
+    memcpy(&u->addr, res->ai_addr, res->ai_addrlen);
+    u->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    u->name = strdup(name);
+    return 0;
+}
+
+/**
+ * read one "prefix=upstream|upstream..." entry of the proxy option into
+ * route. Upstreams that cannot be resolved are left out.
+ */
+static int load_route(Proxy_Route *route, char *entry)
+{
+    char *eq = strchr(entry, '=');
+    if (eq == NULL || eq == entry)
+    {
+        fprintf(stderr, "Proxy route %s is not of the form prefix=upstream.\n", entry);
+        return PROXY_FAILURE;
+    }
+    *eq = '\0';
+
+    memset(route, 0, sizeof(Proxy_Route));
+    char *save;
+    for (char *name = strtok_r(eq + 1, "|", &save); name != NULL; name = strtok_r(NULL, "|", &save))
+    {
+        route->servers = realloc(route->servers, (route->count + 1) * sizeof(Upstream));
+        if (resolve(&route->servers[route->count], name) != 0)
+        {
+            fprintf(stderr, "Error resolving upstream %s.\n", name);
+            continue;
+        }
+        printf("Upstream %s serves %s\n", name, entry);
+        route->count++;
+    }
+    if (route->count == 0)
+    {
+        free(route->servers);
+        return PROXY_FAILURE;
+    }
+    route->prefix = strdup(entry);
+    return 0;
+}
+
+/**
+ * the routes of spec, a comma separated list of prefix=upstream|upstream...
+ * balance is "least_conn" for least connections, round robin otherwise.
+ * NULL if no route is left.
+ */
+Proxy *create_proxy(const char *spec, const char *balance, int keepalive, int idle_timeout)
+{
+    Proxy *p = calloc(1, sizeof(Proxy));
+    char *copy = strdup(spec);
+
+    for (char *entry = strtok(copy, ","); entry != NULL; entry = strtok(NULL, ","))
+    {
+        p->routes = realloc(p->routes, (p->count + 1) * sizeof(Proxy_Route));
+        if (load_route(&p->routes[p->count], entry) == 0)
+            p->count++;
+    }
+    free(copy);
+
+    if (p->count == 0)
+    {
+        destroy_proxy(p);
+        return NULL;
+    }
+    p->least_conn = balance != NULL && strcmp(balance, "least_conn") == 0;
+    p->keepalive = keepalive;
+    p->idle_timeout = idle_timeout;
+    return p;
+}
+
+// the route serving uri, -1 if none does
+int proxy_route(Proxy *p, const char *uri)
+{
+    for (int i = 0; i < p->count; ++i)
+    {
+        if (strncmp(uri, p->routes[i].prefix, strlen(p->routes[i].prefix)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * an idle connection to u the upstream did not close meanwhile, NULL if
+ * none is left
+ */
+static Proxy_Conn *take_idle(Upstream *u)
+{
+    while (u->idle != NULL)
+    {
+        Proxy_Conn *c = u->idle;
+        u->idle = c->next;
+        u->idle_count--;
+
+        // anything to read now is either EOF or garbage
+        char b;
+        if (recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            c->reused = 1;
+            return c;
+        }
+        close(c->fd);
+        free(c);
+    }
+    return NULL;
+}
+
+// a new non-blocking connection to u, it may still be on its way
+static Proxy_Conn *open_conn(Upstream *u)
+{
+    int fd = socket(u->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    if (connect(fd, (struct sockaddr *)&u->addr, u->addr_len) < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return NULL;
+    }
+    if (u->addr.ss_family != AF_UNIX)
+    {
+        // the head and the body go out in separate writes
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    u->connects++;
+    Proxy_Conn *c = calloc(1, sizeof(Proxy_Conn));
+    c->fd = fd;
+    return c;
+}
+
+/**
+ * a connection to one of the upstreams of route for the next request: kept
+ * alive from an earlier one if possible, new otherwise. Upstreams that
+ * cannot be connected to are passed over; NULL if none can.
+ */
+Proxy_Conn *proxy_connect(Proxy *p, int route)
+{
+    Proxy_Route *r = &p->routes[route];
+    int first = r->next;
+    r->next = (r->next + 1) % r->count;
+    if (p->least_conn)
+    {
+        // ties go round robin
+        for (int k = 1; k < r->count; ++k)
+        {
+            int i = (r->next + k - 1) % r->count;
+            if (r->servers[i].active < r->servers[first].active)
+                first = i;
+        }
+    }
+
+    for (int k = 0; k < r->count; ++k)
+    {
+        Upstream *u = &r->servers[(first + k) % r->count];
+        Proxy_Conn *c = take_idle(u);
+        if (c == NULL && (c = open_conn(u)) == NULL)
+        {
+            u->failures++;
+            continue;
+        }
+        if (c->reused)
+            u->reused++;
+        u->requests++;
+        u->active++;
+        c->upstream = u;
+        c->route = route;
+        c->tries = 0;
+        c->sent = 0;
+        c->next = NULL;
+        c->keep_alive = 0;
+        c->chunked = 0;
+        c->done = 0;
+        c->started = timer_now_us();
+        return c;
+    }
+    return NULL;
+}
+
+/**
+ * the HTTP/1.1 request head that goes to the upstream for request: its
+ * end-to-end headers, who asked for it and a keep-alive connection.
+ */
+char *proxy_request_head(Proxy_Conn *c, Request *request, const char *addr, int https, int *len)
+{
+    size_t size = strlen(request->http_method) + strlen(request->http_uri) + strlen(c->upstream->name) + 256;
+    const char *forwarded = NULL;
+    int has_host = 0;
+    for (int k = 0; k < request->header_count; ++k)
+        size += strlen(request->headers[k].header_name) + strlen(request->headers[k].header_value) + 4;
+
+    char *head = malloc(size);
+    int n = sprintf(head, "%s %s HTTP/1.1\r\n", request->http_method, request->http_uri);
+    for (int k = 0; k < request->header_count; ++k)
+    {
+        const char *name = request->headers[k].header_name;
+        if (hop_by_hop(name, strlen(name)))
+            continue;
+        if (strcasecmp(name, "X-Forwarded-For") == 0)
+        {
+            forwarded = request->headers[k].header_value;
+            continue;
+        }
+        if (strcasecmp(name, "Host") == 0)
+            has_host = 1;
+        n += sprintf(head + n, "%s: %s\r\n", name, request->headers[k].header_value);
+    }
+    if (!has_host)
+        n += sprintf(head + n, "Host: %s\r\n", c->upstream->name);
+    n += sprintf(head + n, "X-Forwarded-For: %s%s%s\r\nX-Forwarded-Proto: %s\r\nConnection: keep-alive\r\n\r\n",
+                 forwarded == NULL ? "" : forwarded, forwarded == NULL ? "" : ", ", addr, https ? "https" : "http");
+
+    c->head = strcmp(request->http_method, "HEAD") == 0;
+    *len = n;
+    return head;
+}
+
+/**
+ * turn the response head at the start of what the upstream sent into the
+ * one the client gets: interim 1xx answers dropped, hop-by-hop headers
+ * taken out. *length is the body length, -1 if it runs until the upstream
+ * closes or is chunked; *used the bytes of out the head took. NULL while
+ * the head is incomplete, *used -1 as well if it is no HTTP response.
+ */
+char *proxy_response_head(Proxy_Conn *c, char *out, int len, int *used, int *http_len, long *length)
+{
+    int start = 0;
+    int code;
+    char *end, *eol, *sp;
+    *used = 0;
+    for (;;)
+    {
+        end = memmem(out + start, len - start, "\r\n\r\n", 4);
+        if (len - start >= 5 && strncmp(out + start, "HTTP/", 5) != 0)
+        {
+            *used = -1;
+            return NULL;
+        }
+        if (end == NULL)
+            return NULL;
+        eol = memmem(out + start, end + 2 - out - start, "\r\n", 2);
+        sp = memchr(out + start, ' ', eol - out - start);
+        code = sp == NULL ? 0 : atoi(sp + 1);
+        if (code < 100)
+        {
+            *used = -1;
+            return NULL;
+        }
+        if (code >= 200)
+            break;
+        start = end + 4 - out;
+    }
+
+    char *status = out + start;
+    int header_length = end - status + 2;
+    c->keep_alive = strncmp(status, "HTTP/1.0", 8) != 0;
+    *length = -1;
+
+    char *http = malloc(header_length + 16);
+    int n = sprintf(http, "HTTP/1.1%.*s\r\n", (int)(eol - sp), sp);
+    for (char *line = eol + 2; line < status + header_length; line = eol + 2)
+    {
+        eol = memmem(line, status + header_length - line, "\r\n", 2);
+        char *colon = memchr(line, ':', eol - line);
+        if (colon == NULL)
+            continue;
+        size_t name_len = colon - line;
+        char *value = colon + 1;
+        while (*value == ' ')
+            value++;
+        if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0)
+        {
+            if (strncasecmp(value, "close", 5) == 0)
+                c->keep_alive = 0;
+            else if (strncasecmp(value, "keep-alive", 10) == 0)
+                c->keep_alive = 1;
+        }
+        else if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0)
+            *length = atol(value);
+        else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+            c->chunked = memmem(value, eol - value, "chunked", 7) != NULL;
+
+        // the client gets the body as it comes, chunked or not
+        if (hop_by_hop(line, name_len) && !(name_len == 17 && c->chunked))
+            continue;
+        memcpy(http + n, line, eol - line + 2);
+        n += eol - line + 2;
+    }
+    memcpy(http + n, "\r\n", 3);
+    n += 2;
+
+    if (c->head || code == 204 || code == 304)
+    {
+        *length = 0;
+        c->chunked = 0;
+    }
+    else if (c->chunked)
+        *length = -1;
+    else if (*length < 0)
+        c->keep_alive = 0; // only closing ends such a body
+
+    histogram_record(&c->upstream->latency_us, timer_now_us() - c->started);
+    *used = end + 4 - out;
+    *http_len = n;
+    return http;
+}
+
+/**
+ * how many of the len body bytes in buf belong to the response. Only a
+ * chunked body can end early; done is set once its last chunk and the
+ * trailer are in.
+ */
+int proxy_framed(Proxy_Conn *c, const char *buf, int len)
+{
+    if (!c->chunked)
+        return len;
+
+    int i = 0;
+    while (i < len && !c->done)
+    {
+        char ch = buf[i];
+        switch (c->chunk_state)
+        {
+        case CHUNK_SIZE:
+            if (ch == ';')
+                c->chunk_state = CHUNK_EXT;
+            else if (ch == '\n')
+                c->chunk_state = c->chunk_left == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+            else if (ch >= '0' && ch <= '9')
+                c->chunk_left = c->chunk_left * 16 + ch - '0';
+            else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f')
+                c->chunk_left = c->chunk_left * 16 + (ch | 0x20) - 'a' + 10;
+            i++;
+            break;
+        case CHUNK_EXT:
+            if (ch == '\n')
+                c->chunk_state = c->chunk_left == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+            i++;
+            break;
+        case CHUNK_DATA:
+        {
+            long take = len - i < c->chunk_left ? len - i : c->chunk_left;
+            i += take;
+            c->chunk_left -= take;
+            if (c->chunk_left == 0)
+                c->chunk_state = CHUNK_DATA_END;
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (ch == '\n')
+                c->chunk_state = CHUNK_SIZE;
+            i++;
+            break;
+        case CHUNK_TRAILER_START:
+            if (ch == '\n')
+                c->done = 1;
+            else if (ch != '\r')
+                c->chunk_state = CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            if (ch == '\n')
+                c->chunk_state = CHUNK_TRAILER_START;
+            i++;
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * a request on c is over. reusable if its whole answer was read and the
+ * upstream got all of the request; such connections are kept for the next
+ * request as long as the pool has room.
+ */
+void proxy_release(Proxy *p, Proxy_Conn *c, int reusable)
+{
+    Upstream *u = c->upstream;
+    u->active--;
+    if (reusable && c->keep_alive && (!c->chunked || c->done) && u->idle_count < p->keepalive)
+    {
+        c->chunk_state = CHUNK_SIZE;
+        c->chunk_left = 0;
+        c->idle_since = timer_now_ms();
+        c->next = u->idle;
+        u->idle = c;
+        u->idle_count++;
+        return;
+    }
+    close(c->fd);
+    free(c);
+}
+
+// close the connections that were idle for longer than idle_timeout
+void proxy_maintain(Proxy *p)
+{
+    unsigned long now = timer_now_ms();
+    for (int i = 0; i < p->count; ++i)
+    {
+        for (int k = 0; k < p->routes[i].count; ++k)
+        {
+            Upstream *u = &p->routes[i].servers[k];
+            Proxy_Conn **at = &u->idle;
+            while (*at != NULL)
+            {
+                Proxy_Conn *c = *at;
+                if (now - c->idle_since < (unsigned long)p->idle_timeout)
+                {
+                    at = &c->next;
+                    continue;
+                }
+                *at = c->next;
+                u->idle_count--;
+                close(c->fd);
+                free(c);
+            }
+        }
+    }
+}
+
+void proxy_digest(Proxy *p, char *buf, size_t size)
+{
+    size_t n = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < p->count && n < size; ++i)
+    {
+        for (int k = 0; k < p->routes[i].count && n < size; ++k)
+        {
+            Upstream *u = &p->routes[i].servers[k];
+            int m = snprintf(buf + n, size - n,
+                             "Upstream %s on %s: requests: %lu, connects: %lu, reused: %lu, failures: %lu, idle: %d\n",
+                             u->name, p->routes[i].prefix, u->requests, u->connects, u->reused, u->failures,
+                             u->idle_count);
+            if (m < 0)
+                return;
+            n += m;
+            if (n < size)
+            {
+                histogram_digest(&u->latency_us, "Upstream latency us", buf + n, size - n);
+                n += strlen(buf + n);
+            }
+        }
+    }
+}
+
+void destroy_proxy(Proxy *p)
+{
+    for (int i = 0; i < p->count; ++i)
+    {
+        for (int k = 0; k < p->routes[i].count; ++k)
+        {
+            Upstream *u = &p->routes[i].servers[k];
+            while (u->idle != NULL)
+            {
+                Proxy_Conn *c = u->idle;
+                u->idle = c->next;
+                close(c->fd);
+                free(c);
+            }
+            free(u->name);
+        }
+        free(p->routes[i].servers);
+        free(p->routes[i].prefix);
+    }
+    free(p->routes);
+    free(p);
+}
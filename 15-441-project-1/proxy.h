@@ -0,0 +1,85 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "parse.h"
+#include "histogram.h"
+
+#define PROXY_FAILURE 2
+
+typedef struct Proxy_Conn
+{
+    int fd;
+    struct Upstream *upstream;
+    int route;       // it was picked for
+    int tries;       // upstreams of the route that refused the request before
+    int sent;        // took some of the request
+    int reused;      // came out of the pool
+    int head;        // HEAD request, the answer has no body
+    int keep_alive;  // the upstream keeps the connection after this answer
+    int chunked;     // the body is chunked, done tells where it ends
+    int chunk_state;
+    long chunk_left; // data bytes left in the current chunk
+    int done;        // the chunked body is complete
+    unsigned long started;    // us, request handed over
+    unsigned long idle_since; // ms, back in the pool
+    struct Proxy_Conn *next;  // idle ones of the same upstream
+} Proxy_Conn;
+
+typedef struct Upstream
+{
+    char *name; // host:port or unix:/path, as configured
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int active;       // connections handed out
+    Proxy_Conn *idle; // kept alive for the next request, most recent first
+    int idle_count;
+    unsigned long requests;
+    unsigned long connects;
+    unsigned long reused;
+    unsigned long failures;
+    Histogram latency_us; // request handed over to response headers in
+} Upstream;
+
+typedef struct
+{
+    char *prefix;
+    Upstream *servers;
+    int count;
+    int next; // round robin
+} Proxy_Route;
+
+typedef struct
+{
+    Proxy_Route *routes;
+    int count;
+    int least_conn;   // pick the upstream with the fewest active connections
+    int keepalive;    // idle connections kept per upstream
+    int idle_timeout; // ms an idle connection is kept
+} Proxy;
+
+Proxy *create_proxy(const char *spec, const char *balance, int keepalive, int idle_timeout);
+
+int proxy_route(Proxy *p, const char *uri);
+
+Proxy_Conn *proxy_connect(Proxy *p, int route);
+
+char *proxy_request_head(Proxy_Conn *c, Request *request, const char *addr, int https, int *len);
+
+char *proxy_response_head(Proxy_Conn *c, char *out, int len, int *used, int *http_len, long *length);
+
+int proxy_framed(Proxy_Conn *c, const char *buf, int len);
+
+void proxy_release(Proxy *p, Proxy_Conn *c, int reusable);
+
+void proxy_maintain(Proxy *p);
+
+void proxy_digest(Proxy *p, char *buf, size_t size);
+
+void destroy_proxy(Proxy *p);
+
+#endif
@@ -0,0 +1,142 @@
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#include "reaper.h"
+#include "timer_wheel.h"
+
+/**
+ * take SIGCHLD out of signal delivery: it is blocked and read from a
+ * signalfd the event loop watches, so a child exiting never interrupts a
+ * system call. Has to run before any thread is started, threads inherit
+ * the mask.
+ */
+Reaper *create_reaper()
+{
+    Reaper *r = calloc(1, sizeof(Reaper));
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    // SIG_IGN would have the kernel reap children before we see them
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    r->fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    return r;
+}
+
+static Child **find_child(Reaper *r, pid_t pid)
+{
+    Child **link = &r->buckets[pid % REAPER_BUCKETS];
+    while (*link != NULL && (*link)->pid != pid)
+        link = &(*link)->next;
+    return link;
+}
+
+// a CGI script was started for client_fd, spawned by us or the zygote
+void reaper_track(Reaper *r, pid_t pid, int client_fd)
+{
+    Child *child = malloc(sizeof(Child));
+    child->pid = pid;
+    child->client_fd = client_fd;
+    child->started = timer_now_ms();
+    child->killed = 0;
+    Child **link = &r->buckets[pid % REAPER_BUCKETS];
+    child->next = *link;
+    *link = child;
+    r->running++;
+    r->spawned++;
+}
+
+/**
+ * kill a script we gave up on. It stays tracked until its exit is
+ * reported, then it counts as killed rather than failed.
+ */
+int reaper_kill(Reaper *r, pid_t pid)
+{
+    Child *child = *find_child(r, pid);
+    if (child != NULL)
+        child->killed = 1;
+    return kill(pid, SIGKILL);
+}
+
+/**
+ * account for a child that is gone, with its waitpid() status. Returns
+ * the client it was started for, -1 if it was not a tracked script.
+ */
+int reaper_done(Reaper *r, pid_t pid, int status)
+{
+    Child **link = find_child(r, pid);
+    Child *child = *link;
+    if (child == NULL)
+    {
+        r->others++;
+        return -1;
+    }
+    *link = child->next;
+    r->running--;
+    histogram_record(&r->lifetime_ms, timer_now_ms() - child->started);
+
+    if (child->killed)
+        r->killed++;
+    else if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        r->exited++;
+    else if (WIFEXITED(status))
+        r->failed++;
+    else
+        r->signaled++;
+
+    int client_fd = child->client_fd;
+    free(child);
+    return client_fd;
+}
+
+/**
+ * collect every child that exited and report it. Several exits may have
+ * been folded into one SIGCHLD, so waitpid() runs until nothing is left.
+ */
+void reaper_read(Reaper *r, reaper_callback exited)
+{
+    if (r->fd >= 0)
+    {
+        struct signalfd_siginfo info[16];
+        while (read(r->fd, info, sizeof(info)) > 0)
+            ;
+    }
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        exited(pid, status);
+}
+
+void reaper_digest(Reaper *r, char *buf, size_t size)
+{
+    int n = snprintf(buf, size, "CGI children running: %d, spawned: %lu, exited: %lu, failed: %lu, "
+                                "signaled: %lu, killed: %lu, other children: %lu\n",
+                     r->running, r->spawned, r->exited, r->failed, r->signaled, r->killed, r->others);
+    if (n > 0 && (size_t)n < size)
+        histogram_digest(&r->lifetime_ms, "CGI child lifetime ms", buf + n, size - n);
+}
+
+void destroy_reaper(Reaper *r)
+{
+    for (int i = 0; i < REAPER_BUCKETS; ++i)
+    {
+        while (r->buckets[i] != NULL)
+        {
+            Child *next = r->buckets[i]->next;
+            free(r->buckets[i]);
+            r->buckets[i] = next;
+        }
+    }
+    if (r->fd >= 0)
+        close(r->fd);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    free(r);
+}
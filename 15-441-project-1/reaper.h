@@ -0,0 +1,52 @@
+#ifndef _REAPER_H_
+#define _REAPER_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "histogram.h"
+
+#define REAPER_BUCKETS 256
+
+typedef struct Child
+{
+    pid_t pid;
+    int client_fd;
+    unsigned long started; // ms
+    int killed;            // we sent it SIGKILL
+    struct Child *next;
+} Child;
+
+typedef struct
+{
+    int fd; // signalfd for SIGCHLD, -1 if there is none
+    Child *buckets[REAPER_BUCKETS];
+    int running;
+    unsigned long spawned;
+    unsigned long exited;   // with status 0
+    unsigned long failed;   // with another status
+    unsigned long signaled; // by a signal we did not send
+    unsigned long killed;   // by us, after a timeout or abort
+    unsigned long others;   // reaped children that were not CGI scripts
+    Histogram lifetime_ms;
+} Reaper;
+
+typedef void (*reaper_callback)(pid_t pid, int status);
+
+Reaper *create_reaper();
+
+void reaper_track(Reaper *r, pid_t pid, int client_fd);
+
+int reaper_kill(Reaper *r, pid_t pid);
+
+int reaper_done(Reaper *r, pid_t pid, int status);
+
+void reaper_read(Reaper *r, reaper_callback exited);
+
+void reaper_digest(Reaper *r, char *buf, size_t size);
+
+void destroy_reaper(Reaper *r);
+
+#endif
@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "shm_stats.h"
+
+const char *shm_counter_names[SHM_COUNTERS] = {"accepted", "requests", "responses", "responses_4xx",
+                                               "responses_5xx", "bytes_sent", "handshakes"};
+const char *shm_gauge_names[SHM_GAUGES] = {"connections", "idle", "in_flight", "cgi_running",
+                                           "cgi_queued", "tls_queued", "fcgi_queued"};
+
+static unsigned long generations;
+static __thread unsigned long my_generation; // of the Shm_Stats my_worker belongs to
+static __thread Shm_Worker *my_worker;
+
+/**
+ * create the POSIX shared memory segment name ("/lisod") for lisod_top to
+ * read, replacing whatever a previous server left there
+ */
+Shm_Stats *create_shm_stats(const char *name)
+{
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(Shm_Stats)) < 0)
+    {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    Shm_Stats *s = mmap(NULL, sizeof(Shm_Stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+    s->version = SHM_STATS_VERSION;
+    s->pid = getpid();
+    s->started = time(NULL);
+    snprintf(s->name, SHM_STATS_NAME, "%s", name);
+    s->generation = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+    // readers check it last
+    __atomic_store_n(&s->magic, SHM_STATS_MAGIC, __ATOMIC_RELEASE);
+    return s;
+}
+
+// a segment create_shm_stats() made, read only. NULL if it is not one.
+Shm_Stats *open_shm_stats(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    Shm_Stats *s = mmap(NULL, sizeof(Shm_Stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED)
+        return NULL;
+    if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SHM_STATS_MAGIC || s->version != SHM_STATS_VERSION)
+    {
+        munmap(s, sizeof(Shm_Stats));
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * the calling thread's slot, claimed under name on its first call. NULL
+ * once all slots are taken.
+ */
+Shm_Worker *shm_stats_worker(Shm_Stats *s, const char *name)
+{
+    if (my_generation == s->generation)
+        return my_worker;
+    int id = __atomic_fetch_add(&s->workers, 1, __ATOMIC_RELAXED);
+    my_worker = NULL;
+    if (id < SHM_STATS_WORKERS)
+    {
+        my_worker = &s->worker[id];
+        my_worker->tid = syscall(SYS_gettid);
+        snprintf(my_worker->name, sizeof(my_worker->name), "%s", name);
+    }
+    my_generation = s->generation;
+    return my_worker;
+}
+
+// the slot has one writer, so a relaxed load and store do, without a locked add
+void shm_count(Shm_Worker *w, int counter, unsigned long n)
+{
+    __atomic_store_n(&w->counters[counter], __atomic_load_n(&w->counters[counter], __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+void shm_gauge(Shm_Worker *w, int gauge, long value)
+{
+    __atomic_store_n(&w->gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+// busy for a long time since now_us means stuck
+void shm_heartbeat(Shm_Worker *w, int busy, unsigned long now_us)
+{
+    __atomic_store_n(&w->heartbeat_us, now_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->busy, busy, __ATOMIC_RELAXED);
+}
+
+void close_shm_stats(Shm_Stats *s)
+{
+    munmap(s, sizeof(Shm_Stats));
+}
+
+void destroy_shm_stats(Shm_Stats *s)
+{
+    char name[SHM_STATS_NAME];
+    memcpy(name, s->name, SHM_STATS_NAME);
+    munmap(s, sizeof(Shm_Stats));
+    shm_unlink(name);
+}
@@ -0,0 +1,80 @@
+#ifndef _SHM_STATS_H_
+#define _SHM_STATS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SHM_STATS_MAGIC 0x315453646f73696cUL // "lisodST1"
+#define SHM_STATS_VERSION 2
+#define SHM_STATS_WORKERS 16 // threads with a slot, the rest go unseen
+#define SHM_STATS_NAME 64
+
+// only ever go up
+enum
+{
+    SHM_ACCEPTED = 0,
+    SHM_REQUESTS,
+    SHM_RESPONSES,
+    SHM_RESPONSES_4XX,
+    SHM_RESPONSES_5XX,
+    SHM_BYTES_SENT,
+    SHM_HANDSHAKES, // SSL_accept() steps on a TLS worker
+    SHM_COUNTERS
+};
+
+// set to what they are now
+enum
+{
+    SHM_CONNECTIONS = 0, // clients and upstreams
+    SHM_IDLE,            // keep-alive connections between requests
+    SHM_IN_FLIGHT,       // requests read and not answered yet
+    SHM_CGI_RUNNING,
+    SHM_CGI_QUEUED,
+    SHM_TLS_QUEUED, // handshakes waiting for a worker
+    SHM_FCGI_QUEUED,
+    SHM_GAUGES
+};
+
+// one thread's numbers. Only that thread writes them.
+typedef struct
+{
+    char name[16]; // what the thread does, empty until it is claimed
+    int tid;
+    int busy;                   // 0 while it waits for work (select(), a job)
+    unsigned long heartbeat_us; // monotonic, when busy last changed
+    unsigned long counters[SHM_COUNTERS];
+    long gauges[SHM_GAUGES];
+} __attribute__((aligned(64))) Shm_Worker;
+
+typedef struct
+{
+    unsigned long magic;
+    int version;
+    int pid;
+    long started; // wall clock seconds
+    char name[SHM_STATS_NAME];
+    unsigned long generation; // tells it from a segment mapped at the same address before
+    int workers;              // slots claimed
+    Shm_Worker worker[SHM_STATS_WORKERS];
+} Shm_Stats;
+
+extern const char *shm_counter_names[SHM_COUNTERS];
+extern const char *shm_gauge_names[SHM_GAUGES];
+
+Shm_Stats *create_shm_stats(const char *name);
+
+Shm_Stats *open_shm_stats(const char *name);
+
+Shm_Worker *shm_stats_worker(Shm_Stats *s, const char *name);
+
+void shm_count(Shm_Worker *w, int counter, unsigned long n);
+
+void shm_gauge(Shm_Worker *w, int gauge, long value);
+
+void shm_heartbeat(Shm_Worker *w, int busy, unsigned long now_us);
+
+void close_shm_stats(Shm_Stats *s);
+
+void destroy_shm_stats(Shm_Stats *s);
+
+#endif
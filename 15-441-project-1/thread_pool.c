@@ -0,0 +1,180 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "thread_pool.h"
+
+static void *worker_main(void *data)
+{
+    Thread_Pool *pool = (Thread_Pool *)data;
+
+    // signal handlers belong to the event loop thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (pool->pending_head == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->pending_head == NULL)
+            break;
+
+        Pool_Job *job = pool->pending_head;
+        pool->pending_head = job->next;
+        if (pool->pending_head == NULL)
+            pool->pending_tail = NULL;
+        pool->pending--;
+        pool->running++;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->work(job->job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        job->next = pool->finished;
+        pool->finished = job;
+        // one byte per job is plenty, the loop drains the whole list
+        char c = 0;
+        write(pool->notify_fd[1], &c, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+Thread_Pool *create_thread_pool(int threads)
+{
+    Thread_Pool *pool = (Thread_Pool *)malloc(sizeof(Thread_Pool));
+    pool->threads = 0;
+    pool->workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    pool->pending_head = NULL;
+    pool->pending_tail = NULL;
+    pool->finished = NULL;
+    pool->pending = 0;
+    pool->running = 0;
+    pool->stopping = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    if (pipe(pool->notify_fd) < 0)
+    {
+        fprintf(stderr, "Error piping for thread pool.\n");
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    fcntl(pool->notify_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pool->notify_fd[1], F_SETFL, O_NONBLOCK);
+
+    for (int i = 0; i < threads; ++i)
+    {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0)
+        {
+            fprintf(stderr, "Error starting pool thread %d.\n", i);
+            break;
+        }
+        pool->threads++;
+    }
+    if (pool->threads == 0)
+    {
+        destroy_thread_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+int thread_pool_submit(Thread_Pool *pool, pool_work work, pool_done done, void *job)
+{
+    Pool_Job *new_job = (Pool_Job *)malloc(sizeof(Pool_Job));
+    if (new_job == NULL)
+        return POOL_FAILURE;
+    new_job->work = work;
+    new_job->done = done;
+    new_job->job = job;
+    new_job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->pending_tail != NULL)
+        pool->pending_tail->next = new_job;
+    else
+        pool->pending_head = new_job;
+    pool->pending_tail = new_job;
+    pool->pending++;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/**
+ * call the done callback of every finished job, on the calling thread.
+ * returns how many were completed.
+ */
+int thread_pool_complete(Thread_Pool *pool, void *arg)
+{
+    char drain[64];
+    while (read(pool->notify_fd[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pthread_mutex_lock(&pool->lock);
+    Pool_Job *list = pool->finished;
+    pool->finished = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    // finished is a stack, put it back in completion order
+    Pool_Job *ordered = NULL;
+    while (list != NULL)
+    {
+        Pool_Job *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    int completed = 0;
+    while (ordered != NULL)
+    {
+        Pool_Job *next = ordered->next;
+        ordered->done(ordered->job, arg);
+        free(ordered);
+        ordered = next;
+        completed++;
+    }
+    return completed;
+}
+
+int thread_pool_depth(Thread_Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    int depth = pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+    return depth;
+}
+
+/**
+ * let the workers finish what was queued, then stop them. Completions
+ * that were not collected are dropped.
+ */
+void destroy_thread_pool(Thread_Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threads; ++i)
+        pthread_join(pool->workers[i], NULL);
+
+    while (pool->finished != NULL)
+    {
+        Pool_Job *next = pool->finished->next;
+        free(pool->finished);
+        pool->finished = next;
+    }
+    close(pool->notify_fd[0]);
+    close(pool->notify_fd[1]);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,46 @@
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define POOL_FAILURE 2
+
+typedef void (*pool_work)(void *job);
+typedef void (*pool_done)(void *job, void *arg);
+
+typedef struct Pool_Job
+{
+    pool_work work; // runs on a worker thread
+    pool_done done; // runs on the event loop once work returned
+    void *job;
+    struct Pool_Job *next;
+} Pool_Job;
+
+typedef struct
+{
+    int threads;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    Pool_Job *pending_head; // waiting for a worker, FIFO
+    Pool_Job *pending_tail;
+    Pool_Job *finished;     // waiting for the event loop
+    int pending;            // queue depth
+    int running;
+    int stopping;
+    int notify_fd[2]; // [0] turns readable when jobs finished
+} Thread_Pool;
+
+Thread_Pool *create_thread_pool(int threads);
+
+int thread_pool_submit(Thread_Pool *pool, pool_work work, pool_done done, void *job);
+
+int thread_pool_complete(Thread_Pool *pool, void *arg);
+
+int thread_pool_depth(Thread_Pool *pool);
+
+void destroy_thread_pool(Thread_Pool *pool);
+
+#endif
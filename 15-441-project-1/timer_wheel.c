@@ -0,0 +1,220 @@
+#include "timer_wheel.h"
+
+unsigned long timer_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// the same clock to the microsecond, for latencies
+unsigned long timer_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+Timer_Wheel *create_timer_wheel(int size)
+{
+    Timer_Wheel *tw = (Timer_Wheel *)malloc(sizeof(Timer_Wheel));
+    tw->current = 0;
+    tw->start_ms = timer_now_ms();
+    tw->count = 0;
+    tw->size = size;
+    tw->timers = (Timer *)malloc(size * sizeof(Timer));
+    for (int i = 0; i < size; ++i)
+    {
+        tw->timers[i].fd = i;
+        tw->timers[i].type = TIMER_NONE;
+        tw->timers[i].slot = NULL;
+        tw->timers[i].prev = NULL;
+        tw->timers[i].next = NULL;
+    }
+    for (int l = 0; l < TIMER_LEVELS; ++l)
+        for (int s = 0; s < TIMER_SLOTS; ++s)
+            tw->slots[l][s] = NULL;
+    return tw;
+}
+
+static void timer_link(Timer **slot, Timer *timer)
+{
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL)
+        (*slot)->prev = timer;
+    *slot = timer;
+}
+
+static void timer_unlink(Timer *timer)
+{
+    if (timer->prev != NULL)
+        timer->prev->next = timer->next;
+    else
+        *timer->slot = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    timer->slot = NULL;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+/**
+ * put a timer in the level whose range covers its distance from now
+ */
+static void timer_place(Timer_Wheel *tw, Timer *timer)
+{
+    unsigned long delta;
+
+    if (timer->expires < tw->current)
+    {
+        timer_link(&tw->slots[0][tw->current & TIMER_SLOT_MASK], timer);
+        return;
+    }
+
+    delta = timer->expires - tw->current;
+    for (int l = 0; l < TIMER_LEVELS; ++l)
+    {
+        int level_shift = (l + 1) * TIMER_SLOT_BITS;
+        if (delta < (1UL << level_shift) || l == TIMER_LEVELS - 1)
+        {
+            if (l == TIMER_LEVELS - 1 && delta >= (1UL << level_shift))
+                timer->expires = tw->current + (1UL << level_shift) - 1;
+            int s = (timer->expires >> (l * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+            timer_link(&tw->slots[l][s], timer);
+            return;
+        }
+    }
+}
+
+void timer_set(Timer_Wheel *tw, int fd, int type, int timeout_ms)
+{
+    if (fd < 0 || fd >= tw->size)
+        return;
+
+    Timer *timer = &tw->timers[fd];
+    if (timer->type != TIMER_NONE)
+        timer_unlink(timer);
+    else
+        tw->count++;
+
+    unsigned long elapsed = timer_now_ms() - tw->start_ms + timeout_ms;
+    timer->type = type;
+    timer->expires = (elapsed + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    timer_place(tw, timer);
+}
+
+void timer_cancel(Timer_Wheel *tw, int fd)
+{
+    if (fd < 0 || fd >= tw->size)
+        return;
+
+    Timer *timer = &tw->timers[fd];
+    if (timer->type == TIMER_NONE)
+        return;
+    timer_unlink(timer);
+    timer->type = TIMER_NONE;
+    tw->count--;
+}
+
+int timer_type(Timer_Wheel *tw, int fd)
+{
+    if (fd < 0 || fd >= tw->size)
+        return TIMER_NONE;
+    return tw->timers[fd].type;
+}
+
+/**
+ * move every timer of one higher-level slot down to where it now belongs
+ * returns the index that was cascaded
+ */
+static int timer_cascade(Timer_Wheel *tw, int level)
+{
+    int s = (tw->current >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+    Timer *list = tw->slots[level][s];
+    tw->slots[level][s] = NULL;
+    while (list != NULL)
+    {
+        Timer *next = list->next;
+        timer_place(tw, list);
+        list = next;
+    }
+    return s;
+}
+
+/**
+ * milliseconds until the wheel has to be looked at again, -1 if nothing
+ * is armed. Never later than the earliest deadline, may be earlier when a
+ * higher level is due to cascade.
+ */
+int timer_next_timeout(Timer_Wheel *tw)
+{
+    if (tw->count == 0)
+        return -1;
+
+    unsigned long ticks;
+    for (ticks = 0; ticks < TIMER_SLOTS; ++ticks)
+    {
+        unsigned long tick = tw->current + ticks;
+        if (ticks > 0 && (tick & TIMER_SLOT_MASK) == 0)
+            break;
+        if (tw->slots[0][tick & TIMER_SLOT_MASK] != NULL)
+            break;
+    }
+
+    unsigned long deadline = tw->start_ms + (tw->current + ticks) * TIMER_TICK_MS;
+    unsigned long now = timer_now_ms();
+    if (deadline <= now)
+        return 0;
+    return deadline - now;
+}
+
+/**
+ * fire all timers whose deadline has passed, returns how many fired.
+ * the callback may set or cancel timers, including the one firing.
+ */
+int timer_expire(Timer_Wheel *tw, timer_callback callback, void *arg)
+{
+    int fired = 0;
+    unsigned long now_tick = (timer_now_ms() - tw->start_ms) / TIMER_TICK_MS;
+
+    while (tw->current <= now_tick)
+    {
+        int s = tw->current & TIMER_SLOT_MASK;
+
+        // level 0 wrapped around, pull the next slice down from above
+        if (s == 0)
+        {
+            for (int l = 1; l < TIMER_LEVELS; ++l)
+                if (timer_cascade(tw, l) != 0)
+                    break;
+        }
+
+        while (tw->slots[0][s] != NULL)
+        {
+            Timer *timer = tw->slots[0][s];
+            int type = timer->type;
+            timer_unlink(timer);
+            timer->type = TIMER_NONE;
+            tw->count--;
+            fired++;
+            callback(timer->fd, type, arg);
+        }
+
+        // nothing left, skip the idle ticks in one go
+        if (tw->count == 0)
+        {
+            tw->current = now_tick + 1;
+            break;
+        }
+        tw->current++;
+    }
+    return fired;
+}
+
+void destroy_timer_wheel(Timer_Wheel *tw)
+{
+    free(tw->timers);
+    free(tw);
+}
@@ -0,0 +1,67 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// 4 levels of 64 slots with 10 ms ticks cover a little more than 46 hours
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_TICK_MS 10
+
+// what a connection is waiting for when its deadline passes
+enum
+{
+    TIMER_NONE = 0,
+    TIMER_HANDSHAKE, // TLS handshake not finished yet
+    TIMER_HEADER,    // request line and headers not complete yet
+    TIMER_BODY,      // headers done, still reading Content-Length bytes
+    TIMER_KEEPALIVE, // idle between two requests
+    TIMER_CGI,       // CGI script still running for this client
+    TIMER_SEND       // a reply waits for the client to take more of it
+};
+
+typedef struct Timer
+{
+    int fd;
+    int type; // TIMER_NONE when not armed
+    unsigned long expires; // in ticks
+    struct Timer **slot;   // list head it is linked into
+    struct Timer *prev;
+    struct Timer *next;
+} Timer;
+
+typedef struct
+{
+    unsigned long current;  // next tick to be processed
+    unsigned long start_ms; // monotonic time of tick 0
+    int count;              // armed timers
+    int size;
+    Timer *timers; // one deadline per fd, indexed by fd
+    Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} Timer_Wheel;
+
+typedef void (*timer_callback)(int fd, int type, void *arg);
+
+unsigned long timer_now_ms();
+
+unsigned long timer_now_us();
+
+Timer_Wheel *create_timer_wheel(int size);
+
+void timer_set(Timer_Wheel *tw, int fd, int type, int timeout_ms);
+
+void timer_cancel(Timer_Wheel *tw, int fd);
+
+int timer_type(Timer_Wheel *tw, int fd);
+
+int timer_next_timeout(Timer_Wheel *tw);
+
+int timer_expire(Timer_Wheel *tw, timer_callback callback, void *arg);
+
+void destroy_timer_wheel(Timer_Wheel *tw);
+
+#endif
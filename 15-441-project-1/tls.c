@@ -0,0 +1,197 @@
+#include <pthread.h>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "tls.h"
+#include "config.h"
+#include "timer_wheel.h"
+
+Tls_Stats tls_stats;
+
+// ticket_keys[0] encrypts new tickets, the others only decrypt.
+// handshakes run on worker threads, so the keys are behind a lock
+static Ticket_Key ticket_keys[TICKET_KEYS];
+static pthread_mutex_t ticket_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const unsigned char SESSION_ID_CONTEXT[] = "Liso/1.0";
+
+static int new_ticket_key(Ticket_Key *key)
+{
+    if (RAND_bytes(key->name, sizeof(key->name)) != 1 ||
+        RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1 ||
+        RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1)
+    {
+        key->valid = 0;
+        return TLS_FAILURE;
+    }
+    key->created = timer_now_ms();
+    key->valid = 1;
+    return 0;
+}
+
+/**
+ * start encrypting tickets with a fresh key, keep the previous one around
+ * so tickets handed out before the rotation still resume
+ */
+void tls_rotate_ticket_keys()
+{
+    for (int i = TICKET_KEYS - 1; i > 0; --i)
+        ticket_keys[i] = ticket_keys[i - 1];
+    if (new_ticket_key(&ticket_keys[0]) != 0)
+        fprintf(stderr, "Error generating session ticket key.\n");
+}
+
+static int set_ticket_hmac(EVP_MAC_CTX *hctx, Ticket_Key *key)
+{
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  key->hmac_key, sizeof(key->hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+
+/**
+ * OpenSSL asks for a key to seal a new ticket (enc = 1) or to open one a
+ * client presented (enc = 0). Returns 0 to fall back to a full handshake,
+ * 2 to accept a ticket but issue a new one under the current key.
+ */
+static int ticket_key_callback(SSL *client_context, unsigned char key_name[16],
+                               unsigned char *iv, EVP_CIPHER_CTX *cctx,
+                               EVP_MAC_CTX *hctx, int enc)
+{
+    Ticket_Key key;
+    int found = -1;
+
+    pthread_mutex_lock(&ticket_lock);
+    if (enc)
+    {
+        unsigned long now = timer_now_ms();
+        if (!ticket_keys[0].valid ||
+            now - ticket_keys[0].created >= (unsigned long)config.tls_ticket_rotate)
+            tls_rotate_ticket_keys();
+        found = ticket_keys[0].valid ? 0 : -1;
+    }
+    else
+    {
+        for (int i = 0; i < TICKET_KEYS && found < 0; ++i)
+            if (ticket_keys[i].valid && memcmp(key_name, ticket_keys[i].name, sizeof(key.name)) == 0)
+                found = i;
+    }
+    if (found >= 0)
+        key = ticket_keys[found];
+    pthread_mutex_unlock(&ticket_lock);
+
+    if (enc)
+    {
+        if (found < 0 || RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1)
+            return -1;
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1 ||
+            set_ticket_hmac(hctx, &key) != 1)
+            return -1;
+        __atomic_fetch_add(&tls_stats.tickets_issued, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    if (found < 0)
+    {
+        __atomic_fetch_add(&tls_stats.tickets_rejected, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (set_ticket_hmac(hctx, &key) != 1 ||
+        EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1)
+        return -1;
+    if (found > 0)
+    {
+        __atomic_fetch_add(&tls_stats.tickets_renewed, 1, __ATOMIC_RELAXED);
+        return 2;
+    }
+    return 1;
+}
+
+/**
+ * let returning clients skip the key exchange: a server-side session
+ * cache for session ids, and stateless tickets under rotating keys
+ */
+int tls_setup_sessions(SSL_CTX *ssl_context)
+{
+    if (SSL_CTX_set_session_id_context(ssl_context, SESSION_ID_CONTEXT,
+                                       sizeof(SESSION_ID_CONTEXT) - 1) != 1)
+        return TLS_FAILURE;
+
+    SSL_CTX_set_session_cache_mode(ssl_context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ssl_context, config.tls_session_cache_size);
+    SSL_CTX_set_timeout(ssl_context, config.tls_session_lifetime / 1000);
+
+    if (config.tls_ticket_rotate == 0)
+    {
+        SSL_CTX_set_options(ssl_context, SSL_OP_NO_TICKET);
+        return 0;
+    }
+
+    for (int i = 0; i < TICKET_KEYS; ++i)
+        ticket_keys[i].valid = 0;
+    if (new_ticket_key(&ticket_keys[0]) != 0)
+        return TLS_FAILURE;
+    if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_context, ticket_key_callback) != 1)
+        return TLS_FAILURE;
+    return 0;
+}
+
+void tls_count_handshake(SSL *client_context, unsigned long started_us)
+{
+    tls_stats.handshakes++;
+    histogram_record(&tls_stats.handshake_us, timer_now_us() - started_us);
+    if (SSL_session_reused(client_context))
+        tls_stats.resumed++;
+    if (BIO_get_ktls_send(SSL_get_wbio(client_context)))
+        tls_stats.ktls++;
+}
+
+/**
+ * payload size for the next record on a connection: about one TCP segment
+ * while it starts up or after it sat idle, so the client can act on the
+ * first bytes early, then full 16 KB records once enough bytes or time
+ * went by
+ */
+int tls_record_size(Tls_Records *records)
+{
+    unsigned long now = timer_now_ms();
+    if (records->last_write == 0 || now - records->last_write >= (unsigned long)config.tls_idle_reset)
+    {
+        records->burst_start = now;
+        records->sent = 0;
+    }
+    records->last_write = now;
+
+    int boosted = records->sent >= (unsigned long)config.tls_boost_bytes ||
+                  now - records->burst_start >= (unsigned long)config.tls_boost_time;
+    return boosted || config.tls_record_size <= 0 ? TLS_MAX_RECORD : config.tls_record_size;
+}
+
+// a response went out completely
+void tls_response_done(Tls_Records *records)
+{
+    histogram_record(&tls_stats.records, records->records);
+    records->records = 0;
+}
+
+void tls_stats_digest(char *buf, size_t size)
+{
+    double rate = tls_stats.handshakes == 0 ? 0 : 100.0 * tls_stats.resumed / tls_stats.handshakes;
+    int n = snprintf(buf, size, "TLS handshakes: %lu, resumed: %lu (%.1f%%), tickets issued: %lu, "
+                                "renewed: %lu, rejected: %lu, kTLS offload: %lu, "
+                                "queue depth: %d (max %d)\n",
+                     tls_stats.handshakes, tls_stats.resumed, rate, tls_stats.tickets_issued,
+                     tls_stats.tickets_renewed, tls_stats.tickets_rejected, tls_stats.ktls,
+                     tls_stats.queue_depth, tls_stats.queue_max);
+    if (n > 0 && (size_t)n < size)
+    {
+        histogram_digest(&tls_stats.handshake_us, "TLS handshake us", buf + n, size - n);
+        n += strlen(buf + n);
+    }
+    if (n > 0 && (size_t)n < size)
+        histogram_digest(&tls_stats.records, "TLS records per response", buf + n, size - n);
+}
@@ -0,0 +1,64 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/ssl.h>
+
+#include "histogram.h"
+
+#define TLS_FAILURE 2
+#define TICKET_KEYS 2 // the current key and the one it replaced
+#define TLS_MAX_RECORD 16384
+
+// session ticket key, only ever kept in memory
+typedef struct
+{
+    unsigned char name[16];
+    unsigned char aes_key[32];
+    unsigned char hmac_key[32];
+    unsigned long created; // ms, monotonic
+    int valid;
+} Ticket_Key;
+
+// record sizing state of one connection
+typedef struct
+{
+    unsigned long burst_start; // ms, first write after the connection was idle
+    unsigned long last_write;  // ms
+    unsigned long sent;        // bytes since burst_start
+    int records;               // records in the current response
+} Tls_Records;
+
+typedef struct
+{
+    unsigned long handshakes; // completed handshakes
+    unsigned long resumed;    // of which skipped the key exchange
+    unsigned long tickets_issued;
+    unsigned long tickets_renewed; // presented with an old key, reissued
+    unsigned long tickets_rejected;
+    unsigned long ktls; // handshakes after which the kernel encrypts
+    int queue_depth;    // handshakes waiting for a worker thread
+    int queue_max;
+    Histogram handshake_us; // from accept() to handshake done
+    Histogram records;      // TLS records per response
+} Tls_Stats;
+
+extern Tls_Stats tls_stats;
+
+int tls_setup_sessions(SSL_CTX *ssl_context);
+
+void tls_rotate_ticket_keys();
+
+void tls_count_handshake(SSL *client_context, unsigned long started_us);
+
+int tls_record_size(Tls_Records *records);
+
+void tls_response_done(Tls_Records *records);
+
+void tls_stats_digest(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,112 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+const char *phase_names[PHASES] = {"accept", "tls", "read", "parse", "handle", "cgi", "send"};
+
+void phase_done(Request_Phases *p, int phase, unsigned long start, unsigned long end)
+{
+    p->at[phase] = start;
+    p->took[phase] = end > start ? end - start : 0;
+}
+
+// when the last phase recorded so far ended, 0 if none was
+unsigned long phases_end(const Request_Phases *p)
+{
+    unsigned long end = 0;
+    for (int i = 0; i < PHASES; ++i)
+    {
+        if (p->at[i] != 0 && p->at[i] + p->took[i] > end)
+            end = p->at[i] + p->took[i];
+    }
+    return end;
+}
+
+/**
+ * the phases as access log fields, " accept_us=12 tls_us=0 ...". Returns
+ * the length written.
+ */
+int phases_format(const Request_Phases *p, char *buf, size_t size)
+{
+    int at = 0;
+    for (int i = 0; i < PHASES && at < (int)size; ++i)
+        at += snprintf(buf + at, size - at, " %s_us=%lu", phase_names[i], p->took[i]);
+    return at < (int)size ? at : (int)size - 1;
+}
+
+/**
+ * write one request in sample to path, in the Chrome trace event format
+ * (chrome://tracing, Perfetto). The array is left open, which both read.
+ */
+Tracer *create_tracer(const char *path, int sample)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return NULL;
+    Tracer *t = calloc(1, sizeof(Tracer));
+    t->file = file;
+    t->sample = sample > 0 ? sample : 1;
+    t->pid = getpid();
+    fputs("[\n", file);
+    return t;
+}
+
+int trace_sampled(Tracer *t)
+{
+    return t->seen++ % t->sample == 0;
+}
+
+static void trace_string(FILE *file, const char *s)
+{
+    fputc('"', file);
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', file);
+        if ((unsigned char)*s >= ' ')
+            fputc(*s, file);
+    }
+    fputc('"', file);
+}
+
+/**
+ * a request of client fd as one event spanning it, and one per phase it
+ * went through, on a track of its own for the fd
+ */
+void trace_request(Tracer *t, int fd, const char *request, int code, const Request_Phases *p)
+{
+    unsigned long start = 0;
+    for (int i = 0; i < PHASES; ++i)
+    {
+        if (p->at[i] != 0 && (start == 0 || p->at[i] < start))
+            start = p->at[i];
+    }
+    if (start == 0)
+        return;
+
+    fprintf(t->file, "{\"name\":");
+    trace_string(t->file, request);
+    fprintf(t->file, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":%d,\"tid\":%d,"
+                     "\"args\":{\"code\":%d}},\n",
+            start, phases_end(p) - start, t->pid, fd, code);
+    for (int i = 0; i < PHASES; ++i)
+    {
+        if (p->at[i] != 0)
+            fprintf(t->file, "{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":%d,\"tid\":%d},\n",
+                    phase_names[i], p->at[i], p->took[i], t->pid, fd);
+    }
+    fflush(t->file);
+    t->written++;
+}
+
+void tracer_digest(Tracer *t, char *buf, size_t size)
+{
+    snprintf(buf, size, "Trace: %lu requests seen, %lu written, one in %d\n", t->seen, t->written, t->sample);
+}
+
+void destroy_tracer(Tracer *t)
+{
+    fclose(t->file);
+    free(t);
+}
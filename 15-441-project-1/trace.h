@@ -0,0 +1,58 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PHASE_FIELDS_SIZE 160 // phases_format() output at most
+
+// parts of serving a request, in the order they happen
+enum
+{
+    PHASE_ACCEPT = 0, // accept() and the connection set up, first request only
+    PHASE_TLS,        // the handshake, first request only
+    PHASE_READ,       // first byte of the request to the last
+    PHASE_PARSE,
+    PHASE_HANDLE,     // handle_request(): stat and open the file, or a plugin or proxy dispatch
+    PHASE_CGI,        // starting the CGI script
+    PHASE_SEND,       // writing the reply, or for CGI and proxy waiting for its headers
+    PHASES
+};
+
+// one request's phases, monotonic microseconds. A phase that did not
+// happen took 0.
+typedef struct
+{
+    unsigned long at[PHASES];
+    unsigned long took[PHASES];
+} Request_Phases;
+
+// sampled requests written as Chrome trace events
+typedef struct
+{
+    FILE *file;
+    int sample; // one request in sample
+    unsigned long seen;
+    unsigned long written;
+    int pid;
+} Tracer;
+
+extern const char *phase_names[PHASES];
+
+void phase_done(Request_Phases *p, int phase, unsigned long start, unsigned long end);
+
+unsigned long phases_end(const Request_Phases *p);
+
+int phases_format(const Request_Phases *p, char *buf, size_t size);
+
+Tracer *create_tracer(const char *path, int sample);
+
+int trace_sampled(Tracer *t);
+
+void trace_request(Tracer *t, int fd, const char *request, int code, const Request_Phases *p);
+
+void tracer_digest(Tracer *t, char *buf, size_t size);
+
+void destroy_tracer(Tracer *t);
+
+#endif
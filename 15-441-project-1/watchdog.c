@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <execinfo.h>
+
+#include "watchdog.h"
+#include "timer_wheel.h"
+
+// the loop's backtrace, taken in its own signal handler
+static void *frames[WATCHDOG_FRAMES];
+static int frame_count = -1; // -1 until the handler ran
+
+static void capture_backtrace(int sig)
+{
+    (void)sig;
+    __atomic_store_n(&frame_count, backtrace(frames, WATCHDOG_FRAMES), __ATOMIC_RELEASE);
+}
+
+// ask the stuck loop where it is and log the answer
+static void log_backtrace(Watchdog *w)
+{
+    __atomic_store_n(&frame_count, -1, __ATOMIC_RELAXED);
+    if (pthread_kill(w->loop, SIGRTMIN) != 0)
+        return;
+    int n = -1;
+    for (int tries = 0; tries < 100 && (n = __atomic_load_n(&frame_count, __ATOMIC_ACQUIRE)) < 0; ++tries)
+    {
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+    if (n <= 0)
+    {
+        w->report("no backtrace, the loop did not take the signal", w->arg);
+        return;
+    }
+    char **symbols = backtrace_symbols(frames, n);
+    if (symbols == NULL)
+        return;
+    char msg[WATCHDOG_MSG];
+    for (int i = 0; i < n; ++i)
+    {
+        snprintf(msg, sizeof(msg), "  #%d %s", i, symbols[i]);
+        w->report(msg, w->arg);
+    }
+    free(symbols);
+}
+
+static void *watchdog_loop(void *arg)
+{
+    Watchdog *w = (Watchdog *)arg;
+    int check_ms = w->threshold_ms / 4 > 0 ? w->threshold_ms / 4 : 1;
+    struct timespec pause = {check_ms / 1000, (check_ms % 1000) * 1000000L};
+    char msg[WATCHDOG_MSG];
+
+    while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE))
+    {
+        nanosleep(&pause, NULL);
+        unsigned long since = __atomic_load_n(&w->busy_since, __ATOMIC_RELAXED);
+        unsigned long round = __atomic_load_n(&w->round, __ATOMIC_RELAXED);
+        const char *phase = __atomic_load_n(&w->phase, __ATOMIC_RELAXED);
+        unsigned long now = timer_now_us();
+
+        // the stall reported last is over
+        if (w->stalled_round != 0 && (since == 0 || round != w->stalled_round))
+        {
+            unsigned long took_ms = (now - w->stalled_since) / 1000;
+            histogram_record(&w->stall_ms, took_ms);
+            if (took_ms > w->longest_ms)
+                w->longest_ms = took_ms;
+            snprintf(msg, sizeof(msg), "event loop went on after about %lu ms, stalled in %s", took_ms,
+                     w->stalled_phase);
+            w->report(msg, w->arg);
+            w->stalled_round = 0;
+        }
+
+        if (since == 0 || w->stalled_round == round || now < since + w->threshold_ms * 1000UL)
+            continue;
+
+        w->stalled_round = round;
+        w->stalled_since = since;
+        w->stalled_phase = phase != NULL ? phase : "?";
+        __atomic_fetch_add(&w->stalls, 1, __ATOMIC_RELAXED);
+        snprintf(msg, sizeof(msg), "event loop stalled for %lu ms in %s", (now - since) / 1000, w->stalled_phase);
+        w->report(msg, w->arg);
+        if (w->backtrace)
+            log_backtrace(w);
+    }
+    return NULL;
+}
+
+/**
+ * start watching the calling thread, which has to be the event loop, for
+ * rounds over threshold_ms, told to report. With backtrace set, a stalled
+ * loop is sent SIGRTMIN to find out where it is.
+ */
+Watchdog *create_watchdog(int threshold_ms, int backtrace_stalls, watchdog_report report, void *arg)
+{
+    Watchdog *w = calloc(1, sizeof(Watchdog));
+    w->threshold_ms = threshold_ms;
+    w->backtrace = backtrace_stalls;
+    w->report = report;
+    w->arg = arg;
+    w->loop = pthread_self();
+    if (backtrace_stalls)
+    {
+        // the first backtrace() loads libgcc, better here than in the handler
+        void *warm[1];
+        backtrace(warm, 1);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = capture_backtrace;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGRTMIN, &sa, NULL);
+    }
+    // signal handlers belong to the event loop thread, a SIGTERM taken on
+    // the watchdog would have it join itself in destroy_watchdog()
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&w->tid, NULL, watchdog_loop, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0)
+    {
+        free(w);
+        return NULL;
+    }
+    if (backtrace_stalls)
+    {
+        sigset_t rt;
+        sigemptyset(&rt);
+        sigaddset(&rt, SIGRTMIN);
+        pthread_sigmask(SIG_UNBLOCK, &rt, NULL);
+    }
+    return w;
+}
+
+// the loop is back from select() with work to do
+void watchdog_busy(Watchdog *w, unsigned long now)
+{
+    __atomic_store_n(&w->round, w->round + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->busy_since, now, __ATOMIC_RELAXED);
+}
+
+void watchdog_idle(Watchdog *w)
+{
+    __atomic_store_n(&w->busy_since, 0, __ATOMIC_RELAXED);
+}
+
+void watchdog_phase(Watchdog *w, const char *phase)
+{
+    __atomic_store_n(&w->phase, phase, __ATOMIC_RELAXED);
+}
+
+void watchdog_digest(Watchdog *w, char *buf, size_t size)
+{
+    int at = snprintf(buf, size, "Watchdog: %lu stalls over %d ms, longest %lu ms\n", w->stalls, w->threshold_ms,
+                      w->longest_ms);
+    if (w->stall_ms.count > 0 && at < (int)size)
+        histogram_digest(&w->stall_ms, "Loop stall ms", buf + at, size - at);
+}
+
+void destroy_watchdog(Watchdog *w)
+{
+    __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(w->tid, NULL);
+    if (w->backtrace)
+        signal(SIGRTMIN, SIG_DFL);
+    free(w);
+}
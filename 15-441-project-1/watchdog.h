@@ -0,0 +1,53 @@
+#ifndef _WATCHDOG_H_
+#define _WATCHDOG_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "histogram.h"
+
+#define WATCHDOG_FRAMES 32 // of a stalled loop's backtrace
+#define WATCHDOG_MSG 1024
+
+// one line about a stall, on the watchdog's thread
+typedef void (*watchdog_report)(const char *msg, void *arg);
+
+// watches the event loop from a thread of its own for rounds that take
+// longer than threshold_ms
+typedef struct
+{
+    // written by the loop
+    unsigned long busy_since; // us, 0 while it waits in select()
+    unsigned long round;
+    const char *phase; // what it is doing, a string literal
+
+    // the watchdog's own
+    int threshold_ms;
+    int backtrace; // 1 to log where a stalled loop is
+    watchdog_report report;
+    void *arg;
+    pthread_t loop;
+    pthread_t tid;
+    int stop;
+    unsigned long stalled_round; // the round a stall was reported for, 0 if none
+    unsigned long stalled_since;
+    const char *stalled_phase;
+    unsigned long stalls;
+    unsigned long longest_ms;
+    Histogram stall_ms;
+} Watchdog;
+
+Watchdog *create_watchdog(int threshold_ms, int backtrace, watchdog_report report, void *arg);
+
+void watchdog_busy(Watchdog *w, unsigned long now);
+
+void watchdog_idle(Watchdog *w);
+
+void watchdog_phase(Watchdog *w, const char *phase);
+
+void watchdog_digest(Watchdog *w, char *buf, size_t size);
+
+void destroy_watchdog(Watchdog *w);
+
+#endif
@@ -0,0 +1,330 @@
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "zygote.h"
+
+static int zygote_sock = -1;
+static pid_t zygote_pid = 0; // until its exit was reaped
+
+// exit notices that came in while we waited for a spawn reply
+static Zygote_Message *early_exits = NULL;
+static int early_count = 0;
+
+static int send_message(int sock, Zygote_Message *msg, int *fds, int nfds)
+{
+    struct iovec iov = {msg, sizeof(Zygote_Message)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (nfds > 0)
+    {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    return sendmsg(sock, &hdr, MSG_NOSIGNAL) == sizeof(Zygote_Message) ? 0 : ZYGOTE_FAILURE;
+}
+
+// returns what recvmsg() did, 0 once the other side is gone
+static int receive_message(int sock, Zygote_Message *msg, int *fds, int flags)
+{
+    struct iovec iov = {msg, sizeof(Zygote_Message)};
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    int n = recvmsg(sock, &hdr, flags | MSG_CMSG_CLOEXEC);
+    if (n != sizeof(Zygote_Message))
+        return n;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (fds != NULL && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    return n;
+}
+
+// the zygote died, spawning falls back to fork() from now on
+static void zygote_lost()
+{
+    fprintf(stderr, "CGI zygote %d is gone.\n", zygote_pid);
+    close(zygote_sock);
+    zygote_sock = -1;
+}
+
+/**
+ * in the zygote: start path with the given environment and its stdin and
+ * stdout on two new pipes, then hand our ends of the pipes to lisod
+ */
+static void spawn_one(int sock, char *buf, int len)
+{
+    Zygote_Message reply = {ZYGOTE_SPAWNED, -1, 0};
+    char *path = buf;
+    char *envp[ZYGOTE_MSG_MAX / 2];
+    int envc = 0;
+
+    buf[len - 1] = 0;
+    for (char *env = path + strlen(path) + 1; env < buf + len && *env != 0; env += strlen(env) + 1)
+        envp[envc++] = env;
+    envp[envc] = NULL;
+
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) < 0)
+    {
+        reply.status = errno;
+        send_message(sock, &reply, NULL, 0);
+        return;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0)
+    {
+        reply.status = errno;
+        close(in[0]);
+        close(in[1]);
+        send_message(sock, &reply, NULL, 0);
+        return;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+
+    // the zygote blocks SIGCHLD and ignores SIGPIPE, scripts should not
+    posix_spawnattr_t attr;
+    sigset_t empty, defaults;
+    sigemptyset(&empty);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGCHLD);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &empty);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    char *argv[] = {path, NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    close(in[0]);
+    close(out[1]);
+    if (err != 0)
+    {
+        reply.status = err;
+        send_message(sock, &reply, NULL, 0);
+    }
+    else
+    {
+        int fds[2] = {in[1], out[0]};
+        reply.pid = pid;
+        send_message(sock, &reply, fds, 2);
+    }
+    close(in[1]);
+    close(out[0]);
+}
+
+static void zygote_main(int sock)
+{
+    // none of lisod's handlers belong here, and lisod going away ends us
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    char *buf = malloc(ZYGOTE_MSG_MAX);
+    struct pollfd fds[2] = {{sock, POLLIN, 0}, {sfd, POLLIN, 0}};
+    while (1)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            _exit(EXIT_FAILURE);
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            read(sfd, &info, sizeof(info));
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            {
+                Zygote_Message exited = {ZYGOTE_EXITED, pid, status};
+                send_message(sock, &exited, NULL, 0);
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            int n = recv(sock, buf, ZYGOTE_MSG_MAX, 0);
+            if (n <= 0)
+                _exit(EXIT_SUCCESS);
+            spawn_one(sock, buf, n);
+        }
+    }
+}
+
+/**
+ * fork the spawning helper while the server is still small. Forking it
+ * again is a no-op, so restarts keep the same zygote.
+ */
+int zygote_start()
+{
+    if (zygote_sock >= 0)
+        return 0;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        return ZYGOTE_FAILURE;
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return ZYGOTE_FAILURE;
+    }
+    if (pid == 0)
+    {
+        close(sv[0]);
+        zygote_main(sv[1]);
+    }
+
+    close(sv[1]);
+    zygote_sock = sv[0];
+    zygote_pid = pid;
+    printf("CGI zygote %d started\n", pid);
+    return 0;
+}
+
+// the child pid was reaped, 1 if it was the zygote
+int zygote_exited(pid_t pid)
+{
+    if (zygote_pid == 0 || pid != zygote_pid)
+        return 0;
+    printf("CGI zygote %d exited\n", pid);
+    zygote_pid = 0;
+    return 1;
+}
+
+// socket to watch for exit notices, -1 without a zygote
+int zygote_fd()
+{
+    return zygote_sock;
+}
+
+/**
+ * have the zygote start a CGI script. Returns its pid and our ends of its
+ * stdin and stdout, or -1.
+ */
+pid_t zygote_spawn(const char *path, char **envp, int *stdin_fd, int *stdout_fd)
+{
+    char *buf = malloc(ZYGOTE_MSG_MAX);
+    int len = strlen(path) + 1;
+    if (len >= ZYGOTE_MSG_MAX)
+    {
+        free(buf);
+        return -1;
+    }
+    memcpy(buf, path, len);
+    for (int i = 0; envp[i] != NULL; ++i)
+    {
+        int env_len = strlen(envp[i]) + 1;
+        if (len + env_len >= ZYGOTE_MSG_MAX)
+            break;
+        memcpy(buf + len, envp[i], env_len);
+        len += env_len;
+    }
+    buf[len++] = 0;
+
+    int sent = send(zygote_sock, buf, len, MSG_NOSIGNAL);
+    free(buf);
+    if (sent != len)
+    {
+        zygote_lost();
+        return -1;
+    }
+
+    while (1)
+    {
+        Zygote_Message reply;
+        int fds[2] = {-1, -1};
+        int n = receive_message(zygote_sock, &reply, fds, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n != sizeof(Zygote_Message))
+        {
+            zygote_lost();
+            return -1;
+        }
+        if (reply.type == ZYGOTE_EXITED)
+        {
+            early_exits = realloc(early_exits, (early_count + 1) * sizeof(Zygote_Message));
+            early_exits[early_count++] = reply;
+            continue;
+        }
+        if (reply.pid < 0)
+        {
+            fprintf(stderr, "Zygote could not spawn %s: %s\n", path, strerror(reply.status));
+            return -1;
+        }
+        *stdin_fd = fds[0];
+        *stdout_fd = fds[1];
+        return reply.pid;
+    }
+}
+
+/**
+ * report the scripts that exited since the last call. Fails once the
+ * zygote is gone, its socket is closed by then.
+ */
+int zygote_read(zygote_exit_callback exited)
+{
+    for (int i = 0; i < early_count; ++i)
+        exited(early_exits[i].pid, early_exits[i].status);
+    early_count = 0;
+
+    Zygote_Message msg;
+    int n;
+    while ((n = receive_message(zygote_sock, &msg, NULL, MSG_DONTWAIT)) == sizeof(Zygote_Message))
+    {
+        if (msg.type == ZYGOTE_EXITED)
+            exited(msg.pid, msg.status);
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    {
+        zygote_lost();
+        return ZYGOTE_FAILURE;
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _ZYGOTE_H_
+#define _ZYGOTE_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define ZYGOTE_FAILURE 2
+#define ZYGOTE_MSG_MAX 65536 // program path plus environment of one spawn
+
+enum
+{
+    ZYGOTE_SPAWNED = 1, // reply to a spawn, carries the pipe fds
+    ZYGOTE_EXITED       // a script the zygote started is gone
+};
+
+typedef struct
+{
+    int type;
+    pid_t pid; // -1 if the spawn failed
+    int status; // waitpid() status, or errno of a failed spawn
+} Zygote_Message;
+
+typedef void (*zygote_exit_callback)(pid_t pid, int status);
+
+int zygote_start();
+
+int zygote_fd();
+
+int zygote_exited(pid_t pid);
+
+pid_t zygote_spawn(const char *path, char **envp, int *stdin_fd, int *stdout_fd);
+
+int zygote_read(zygote_exit_callback exited);
+
+#endif